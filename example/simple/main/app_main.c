@@ -10,7 +10,7 @@
 #include <sys/param.h>
 #include "esp_timer.h"
 #include "app_wifi.h"
-#include "rtsp_session.h"
+#include "rtsp_server.h"
 #include "media_mjpeg.h"
 #include "media_g711a.h"
 #include "media_l16.h"
@@ -23,12 +23,34 @@ uint32_t wave_get_framerate(void);
 uint32_t wave_get_bits(void);
 uint32_t wave_get_ch(void);
 
-static void streamImage(media_stream_t *mjpeg_stream)
+#define VIDEO_FRAME_INTERVAL_MS 40
+#define AUDIO_FRAME_INTERVAL_MS 100
+
+static int video_interval_ms = VIDEO_FRAME_INTERVAL_MS;
+
+/**
+ * Follow the frame rate the viewers can take, a camera would also lower its JPEG quality here
+ */
+static void on_video_rate(media_stream_t *stream, const media_stream_rate_t *rate)
+{
+    if (0 == rate->frame_rate) {
+        video_interval_ms = VIDEO_FRAME_INTERVAL_MS; // no viewer, no target
+        return;
+    }
+    int ms = 1000 / rate->frame_rate;
+    video_interval_ms = ms > VIDEO_FRAME_INTERVAL_MS ? ms : VIDEO_FRAME_INTERVAL_MS;
+    printf("video target %u kbps %u fps, loss %u/1000\n", rate->bitrate / 1000, rate->frame_rate, rate->loss_permille);
+}
+
+/**
+ * @return time in ms until the next frame is due
+ */
+static int streamImage(media_stream_t *mjpeg_stream)
 {
     static uint32_t index = 0;
     static int64_t last_frame = 0;
     int64_t interval = (esp_timer_get_time() - last_frame) / 1000;
-    if (interval > 40) {
+    if (interval > video_interval_ms) {
         printf("frame fps=%f\n", 1000.0f/(float)interval);
         uint8_t *p = g_frames[index][0];
         uint32_t len = g_frames[index][1] - g_frames[index][0];
@@ -39,23 +61,25 @@ static void streamImage(media_stream_t *mjpeg_stream)
         }
 
         last_frame = esp_timer_get_time();
+        return video_interval_ms;
     }
+    return video_interval_ms - interval;
 }
 
 static uint8_t *audio_p;
 static uint8_t *audio_end;
 static int64_t audio_last_frame = 0;
 
-static void streamaudio(media_stream_t *audio_stream)
+static int streamaudio(media_stream_t *audio_stream)
 {
     static uint8_t buffer[8192];
     int64_t interval = (esp_timer_get_time() - audio_last_frame) / 1000;
     if (audio_last_frame == 0) {
         audio_last_frame = esp_timer_get_time();
         audio_p = (uint8_t *)wave_get();
-        return;
+        return AUDIO_FRAME_INTERVAL_MS;
     }
-    if (interval > 100) {
+    if (interval > AUDIO_FRAME_INTERVAL_MS) {
         uint32_t len = 0;
         if (MEDIA_STREAM_PCMA == audio_stream->type) {
             len = interval * 32;
@@ -92,39 +116,39 @@ static void streamaudio(media_stream_t *audio_stream)
         printf("audio fps=%f\n", 1000.0f/(float)interval);
 
         audio_last_frame = esp_timer_get_time();
+        return AUDIO_FRAME_INTERVAL_MS;
     }
+    return AUDIO_FRAME_INTERVAL_MS - interval;
 }
 
 static void rtsp_video()
 {
-    rtsp_session_t *rtsp = rtsp_session_create("mjpeg/1", 8554);
+    rtsp_server_t *server = rtsp_server_create(8554, 0);
+    rtsp_session_t *rtsp = rtsp_session_create("mjpeg/1");
     media_stream_t *mjpeg = media_stream_mjpeg_create();
+    mjpeg->on_rate = on_video_rate;
+    mjpeg->max_frame_rate = 1000 / VIDEO_FRAME_INTERVAL_MS;
     media_stream_t *pcma = media_stream_g711a_create(16000);
     media_stream_t *l16 = media_stream_l16_create(16000);
     rtsp_session_add_media_stream(rtsp, mjpeg);
     rtsp_session_add_media_stream(rtsp, pcma);
+    rtsp_server_add_session(server, rtsp);
 
-    while (true) {
-
-        rtsp_session_accept(rtsp);
-        audio_p = (uint8_t *)wave_get();
-        audio_end = (uint8_t *)wave_get() + wave_get_size();
-        audio_last_frame = 0;
-
-        while (1) {
-            int ret = rtsp_handle_requests(rtsp, 1);
-            if (-3 == ret) {
-                break;
-            }
+    audio_p = (uint8_t *)wave_get();
+    audio_end = (uint8_t *)wave_get() + wave_get_size();
 
-            if (rtsp->state & 0x02) {
-                streamImage(mjpeg);
-                streamaudio(pcma);
-            }
+    while (true) {
+        int wait_ms = VIDEO_FRAME_INTERVAL_MS;
+        if (!SLIST_EMPTY(&mjpeg->subscribers) || !SLIST_EMPTY(&pcma->subscribers)) {
+            int video_ms = streamImage(mjpeg);
+            int audio_ms = streamaudio(pcma);
+            wait_ms = (video_ms < audio_ms) ? video_ms : audio_ms;
+        } else {
+            audio_last_frame = 0;
         }
-        rtsp_session_terminate(rtsp);
 
-        // rtsp_session_delete(rtsp);
+        // sleep in the reactor until a request arrives or the next frame is due
+        rtsp_server_poll(server, wait_ms > 0 ? wait_ms : 0);
     }
 }
 
@@ -149,6 +173,17 @@ void app_main(void)
 
     printf("Free heap: %d\n", esp_get_free_heap_size());
 
+#if defined(_DEBUG) || defined(DEBUG)
+    // self tests of the component which need no sockets
+    rtsp_session_test();
+    rtp_time_test();
+    rtcp_interval_test();
+    rtcp_estimate_test();
+    media_mjpeg_parse_test();
+    media_mjpeg_packet_test();
+    media_mjpeg_parts_test();
+#endif
+
     app_wifi_main();
     rtsp_video();
 }
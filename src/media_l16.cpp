@@ -7,6 +7,8 @@
 
 static const char *TAG = "rtp_l16";
 
+#define AUDIO_TRAIN_PACKETS  4  // initial packets of a frame, grows with bigger frames
+
 #define RTP_CHECK(a, str, ret_val)                       \
     if (!(a))                                                     \
     {                                                             \
@@ -36,10 +38,8 @@ int media_stream_l16_send_frame(media_stream_t *stream, const uint8_t *data, uin
 
 #define MAX_L16_PACKET_SIZE (MAX_RTP_PAYLOAD_SIZE - RTP_HEADER_SIZE - RTP_TCP_HEAD_SIZE)
 
-    rtp_packet_t rtp_packet;
-    rtp_packet.is_last = 0;
-    rtp_packet.data = stream->rtp_buffer;
-    uint8_t *pcma_buf = rtp_packet.data + RTP_TCP_HEAD_SIZE + RTP_HEADER_SIZE;
+    rtp_packet_train_t *train = media_stream_train_begin(stream);
+    RTP_CHECK(NULL != train, "can't get packet train", -1);
 
     int data_bytes_left = len;
     uint32_t offset = 0;
@@ -52,35 +52,35 @@ int media_stream_l16_send_frame(media_stream_t *stream, const uint8_t *data, uin
         uint32_t deltams = (curMsec >= stream->prevMsec) ? curMsec - stream->prevMsec : 100;
         stream->prevMsec = curMsec;
 
-        uint8_t *p_buf = (uint8_t *)pcma_buf;
+        rtp_packet_t *rtp_packet = rtp_packet_train_alloc(train);
+        RTP_CHECK(NULL != rtp_packet, "can't alloc rtp packet", -1);
 
-        uint32_t fragmentLen = MAX_L16_PACKET_SIZE - (p_buf - pcma_buf);
+        uint32_t fragmentLen = MAX_L16_PACKET_SIZE;
         if (fragmentLen >= data_bytes_left) {
             fragmentLen = data_bytes_left;
-            rtp_packet.is_last = 0; // RTP marker bit must be set on last fragment
+            rtp_packet->is_last = 0; // RTP marker bit must be set on last fragment
         }
 
-        memcpy(p_buf, data + offset, fragmentLen);
-        p_buf += fragmentLen;
+        // samples are sent from the frame in place
+        rtp_packet->payload = data + offset;
+        rtp_packet->payload_size = fragmentLen;
         offset += fragmentLen;
         data_bytes_left -= fragmentLen;
 
-        rtp_packet.size = p_buf - pcma_buf;
-        rtp_packet.timestamp = stream->Timestamp;
-        rtp_packet.type = RTP_PT_L16_CH1;
-        rtp_send_packet(stream->rtp_session, &rtp_packet);
+        rtp_packet->size = fragmentLen;
+        rtp_packet->timestamp = stream->Timestamp;
+        rtp_packet->type = RTP_PT_L16_CH1;
 
         // Increment ONLY after a full frame
         stream->Timestamp += (stream->clock_rate * deltams / 1000);
     }
+    media_stream_send_train(stream, train);
     return true;
 }
 
 static void media_stream_l16_delete(media_stream_t *stream)
 {
-    if (NULL != stream->rtp_buffer) {
-        free(stream->rtp_buffer);
-    }
+    media_stream_deinit(stream);
     free(stream);
 }
 
@@ -89,8 +89,7 @@ media_stream_t *media_stream_l16_create(uint16_t sample_rate)
     media_stream_t *stream = (media_stream_t *)calloc(1, sizeof(media_stream_t));
     RTP_CHECK(NULL != stream, "memory for g711a stream is not enough", NULL);
 
-    stream->rtp_buffer = (uint8_t *)malloc(MAX_RTP_PAYLOAD_SIZE);
-    if (NULL == stream->rtp_buffer) {
+    if (0 != media_stream_init(stream, AUDIO_TRAIN_PACKETS)) {
         free(stream);
         ESP_LOGE(TAG, "memory for media mjpeg buffer is insufficient");
         return NULL;
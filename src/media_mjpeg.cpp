@@ -16,6 +16,9 @@ static const char *TAG = "rtp_mjpeg";
     }
 
 #define MAX_JPEG_PACKET_SIZE (MAX_RTP_PAYLOAD_SIZE - RTP_HEADER_SIZE - RTP_TCP_HEAD_SIZE)
+#define MJPEG_TRAIN_PACKETS  16  // initial packets of a frame, grows with bigger frames
+#define MJPEG_QTABLE_REFRESH 25  // frames after which tables a receiver keeps are sent again, for viewers which lost them
+#define MJPEG_PART_SIZE      (2 * MAX_JPEG_PACKET_SIZE + 4) // a header, or bytes left from the last part and a fragment
 
 
 static void media_stream_mjpeg_get_description(media_stream_t *stream, char *buf, uint32_t buf_len, uint16_t port)
@@ -28,93 +31,375 @@ static void media_stream_mjpeg_get_attribute(media_stream_t *stream, char *buf,
     snprintf(buf, buf_len, "a=rtpmap:%d JPEG/90000", RTP_PT_JPEG);
 }
 
-static const uint8_t *findJPEGheader(const uint8_t *start, const uint8_t *end, uint16_t marker)
+/**
+ * Huffman tables of JPEG Annex K.3 as in a DHT segment: class and id, counts of each code length, values.
+ * RTP/JPEG receivers decode the scan with them (RFC2435 3.1).
+ */
+static const uint8_t jpeg_dc_luminance[] = {
+    0x00, 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0,
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+};
+static const uint8_t jpeg_dc_chrominance[] = {
+    0x01, 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+};
+static const uint8_t jpeg_ac_luminance[] = {
+    0x10, 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d,
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+    0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa,
+};
+static const uint8_t jpeg_ac_chrominance[] = {
+    0x11, 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77,
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+    0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+    0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa,
+};
+
+// by class and id of the table
+static const uint8_t *const jpeg_std_huffman[4] = {jpeg_dc_luminance, jpeg_dc_chrominance, jpeg_ac_luminance, jpeg_ac_chrominance};
+static const uint8_t jpeg_std_huffman_len[4] = {sizeof(jpeg_dc_luminance), sizeof(jpeg_dc_chrominance),
+                                                sizeof(jpeg_ac_luminance), sizeof(jpeg_ac_chrominance)};
+
+/**
+ * Quantization tables of JPEG Annex K.1 in zigzag order as in DQT, luminance then chrominance.
+ * A Q of 1-99 stands for them scaled as in RFC2435 Appendix A.
+ */
+static const uint8_t jpeg_std_quantizers[128] = {
+     16,  11,  12,  14,  12,  10,  16,  14,
+     13,  14,  18,  17,  16,  19,  24,  40,
+     26,  24,  22,  22,  24,  49,  35,  37,
+     29,  40,  58,  51,  61,  60,  57,  51,
+     56,  55,  64,  72,  92,  78,  64,  68,
+     87,  69,  55,  56,  80, 109,  81,  87,
+     95,  98, 103, 104, 103,  62,  77, 113,
+    121, 112, 100, 120,  92, 101, 103,  99,
+
+     17,  18,  18,  24,  21,  24,  47,  26,
+     26,  47,  99,  66,  56,  66,  99,  99,
+     99,  99,  99,  99,  99,  99,  99,  99,
+     99,  99,  99,  99,  99,  99,  99,  99,
+     99,  99,  99,  99,  99,  99,  99,  99,
+     99,  99,  99,  99,  99,  99,  99,  99,
+     99,  99,  99,  99,  99,  99,  99,  99,
+     99,  99,  99,  99,  99,  99,  99,  99,
+};
+
+/**
+ * What RTP/JPEG needs of a baseline JPEG frame
+ */
+typedef struct {
+    const uint8_t *qtable[2];   // 64 bytes each, luminance and chrominance
+    uint16_t width;
+    uint16_t height;
+    uint16_t dri;               // restart interval in MCUs, 0 if none
+    uint8_t type;               // RFC2435 type, 0 for 4:2:2 and 1 for 4:2:0
+    bool std_huffman;           // all Huffman tables are those of Annex K.3, or there are none
+    uint8_t q;                  // Q of RFC2435 Appendix A the tables are made with, 0 for other tables
+    const uint8_t *scan;        // entropy-coded data after the SOS header
+    uint32_t scan_len;          // without EOI
+} jpeg_frame_t;
+
+/**
+ * Restart interval which the next fragment of a scan starts in, fragments are aligned to intervals
+ */
+typedef struct {
+    uint32_t index;             // of the interval in the frame
+    bool start;                 // the fragment starts at the beginning of the interval
+} jpeg_restart_t;
+
+enum { MJPEG_PART_NONE, MJPEG_PART_HEADER, MJPEG_PART_SCAN }; // frame given in parts: none or dropped, then sending
+
+typedef struct {
+    media_stream_t stream;
+    bool own_huffman_logged;
+    uint8_t tables_q;                         // 128-254 for the other tables, the next one when they change, then 255
+    uint8_t tables[128];                      // the other tables
+    uint32_t tables_age;                      // frames since they were sent
+    const void *tables_viewer;                // newest subscriber when they were sent
+    jpeghdr_t jpghdr;                         // of the frame being sent, off is that of the next fragment
+    jpeghdr_rst_t rsthdr;
+    jpeg_restart_t restart;
+    bool aligned;                             // fragments hold whole restart intervals
+    bool whole_file;                          // the payload is the whole file, not only the scan
+    bool send_tables;
+    uint8_t part_state;                       // MJPEG_PART_*
+    uint8_t *part;                            // MJPEG_PART_SIZE bytes, NULL until a frame is given in parts
+    uint32_t part_len;
+    uint32_t part_skip;                       // bytes of a metadata segment still to drop
+    uint32_t part_deltams;                    // time before the frame given in parts
+} media_stream_mjpeg_t;
+
+static inline uint32_t jpeg_scan_len(const uint8_t *scan, const uint8_t *end)
 {
-    const uint8_t *p = start;
+    if (end - scan >= 2 && 0xFF == end[-2] && 0xD9 == end[-1]) {
+        return end - 2 - scan;
+    }
+    return end - scan;
+}
 
-    while (p < end) {
-        uint16_t data = *(uint16_t *)p;
-        if (data == marker) {
-            return p;
-        } else {
-            p++;
-            // // not the section we were looking for, skip the entire section
-            // switch (data) {
-            // case 0xd8: { // start of image
-            //     break; // no data to skip
-            // }
-            // case 0xe0: // app0
-            // case 0xdb: // dqt
-            // case 0xc4: // dht
-            // case 0xc0: // sof0
-            // case 0xda: { // sos
-            //     // standard format section with 2 bytes for len.  skip that many bytes
-            //     uint32_t len = p[0] * 256 + p[1];
-            //     //printf("skipping section 0x%x, %d bytes\n", typecode, len);
-            //     p += len;
-            //     break;
-            // }
-            // default:
-            //     break;
-            // }
+/**
+ * Q of RFC2435 Appendix A whose tables are those of the frame, 0 if there is none
+ */
+static uint8_t jpeg_find_q(const uint8_t *lqt, const uint8_t *cqt)
+{
+    for (int q = 1; q < 100; q++) {
+        int scale = q < 50 ? 5000 / q : 200 - q * 2;
+        int i;
+        for (i = 0; i < 128; i++) {
+            int v = (jpeg_std_quantizers[i] * scale + 50) / 100;
+            v = v < 1 ? 1 : (v > 255 ? 255 : v);
+            if (v != (i < 64 ? lqt[i] : cqt[i - 64])) {
+                break; // mostly at the first entry
+            }
+        }
+        if (128 == i) {
+            return q;
         }
     }
-
-    return NULL;
+    return 0;
 }
 
-static bool decodeJPEGfile(const uint8_t **start, uint32_t *len, const uint8_t **qtable0, const uint8_t **qtable1, uint16_t *width, uint16_t *height)
+/**
+ * Walk the segments from SOI to SOS by their lengths, the entropy-coded data is never scanned
+ *
+ * @return 0 on success, -1 if the frame is not a baseline JPEG which RTP/JPEG can carry
+ */
+static int jpeg_parse(const uint8_t *data, uint32_t len, jpeg_frame_t *frame)
 {
     /**
      * JPEG format Reference:
      * https://en.wikipedia.org/wiki/JPEG_File_Interchange_Format
      * http://lad.dsc.ufcg.edu.br/multimidia/jpegmarker.pdf
      */
-    #define SOI  0xD8FF
-    #define EOI  0xD9FF
-    #define S0F0 0xC0FF
-    #define S0F2 0xC2FF
-    #define DHT  0xC4FF
-    #define DQT  0xDBFF
-    #define DRI  0xDDFF
-    const uint8_t *end = *start + *len;
-
-    // Look for quant tables if they are present
-    const uint8_t *p = findJPEGheader(*start, end, DQT);
-    if (p) {
-        *qtable0 = p + 5; // 3 bytes of header skipped
-        uint32_t length = p[2] * 256 + p[3];
-        p += length;
-        p = findJPEGheader(p, end, DQT);
-        if (p) {
-            *qtable1 = p + 5;
-            uint32_t length = p[2] * 256 + p[3];
-            p += length;
-        } else {
-            printf("can't read qtable1\n");
-            return false;
-        }
-    } else {
-        printf("can't read qtable0\n");
-        return false;
-    }
-
-    p = findJPEGheader(p, end, S0F0);
-    if (p) {
-        *height = (p[5] << 8) | (p[6]);
-        *width  = (p[7] << 8) | (p[8]);
-    } else {
-        printf("can't read iamge size\n");
-        return false;
-    }
-
-    return true;
+    const uint8_t *p = data;
+    const uint8_t *end = data + len;
+    memset(frame, 0, sizeof(jpeg_frame_t));
+    frame->std_huffman = true;
+    if (len < 4 || 0xFF != p[0] || 0xD8 != p[1]) {
+        return -1;
+    }
+    p += 2;
+
+    while (end - p >= 4) {
+        if (0xFF != p[0]) {
+            // bytes between segments, which some encoders leave, up to the next marker
+            p = (const uint8_t *)memchr(p, 0xFF, end - p);
+            if (NULL == p) {
+                return -1;
+            }
+            continue;
+        }
+        uint8_t marker = p[1];
+        if (0xFF == marker) {
+            p++; // fill byte
+            continue;
+        }
+        if (0x01 == marker || (marker >= 0xD0 && marker <= 0xD7)) {
+            p += 2; // TEM and RSTn have no length
+            continue;
+        }
+        uint32_t seg_len = (p[2] << 8) | p[3];
+        const uint8_t *seg = p + 4;
+        const uint8_t *seg_end = p + 2 + seg_len;
+        if (seg_len < 2 || seg_end > end) {
+            return -1;
+        }
+
+        switch (marker) {
+        case 0xDB: // DQT, one or more tables
+            while (seg_end - seg >= 65) {
+                uint32_t size = (seg[0] >> 4) ? 128 : 64;
+                if ((uint32_t)(seg_end - seg) < 1 + size) {
+                    return -1;
+                }
+                if (64 == size && (seg[0] & 0x0F) < 2) {
+                    frame->qtable[seg[0] & 0x0F] = seg + 1;
+                }
+                seg += 1 + size;
+            }
+            break;
+        case 0xC0: // SOF0 baseline
+        case 0xC1: // SOF1 extended sequential, 8-bit with Huffman tables decodes the same
+            // Y with 2x1 or 2x2 sampling, Cb and Cr with 1x1
+            if (17 != seg_len || 8 != seg[0] || 3 != seg[5] || 0x11 != seg[10] || 0x11 != seg[13]) {
+                return -1;
+            }
+            frame->height = (seg[1] << 8) | seg[2];
+            frame->width = (seg[3] << 8) | seg[4];
+            if (0x21 == seg[7]) {
+                frame->type = 0;
+            } else if (0x22 == seg[7]) {
+                frame->type = 1;
+            } else {
+                return -1;
+            }
+            break;
+        case 0xC4: // DHT, one or more tables
+            while (seg_end - seg >= 17) {
+                uint32_t size = 17;
+                for (uint32_t i = 1; i <= 16; i++) {
+                    size += seg[i];
+                }
+                if ((uint32_t)(seg_end - seg) < size) {
+                    return -1;
+                }
+                uint32_t k = ((seg[0] >> 3) & 2) | (seg[0] & 0x0F);
+                if ((seg[0] & 0xEE) || size != jpeg_std_huffman_len[k] || 0 != memcmp(seg, jpeg_std_huffman[k], size)) {
+                    frame->std_huffman = false;
+                }
+                seg += size;
+            }
+            break;
+        case 0xDD: // DRI
+            if (4 != seg_len) {
+                return -1;
+            }
+            frame->dri = (seg[0] << 8) | seg[1];
+            break;
+        case 0xDA: // SOS of all 3 components, the scan follows its header
+            if (NULL == frame->qtable[0] || NULL == frame->qtable[1] || 0 == frame->width ||
+                12 != seg_len || 3 != seg[0]) {
+                return -1;
+            }
+            frame->q = jpeg_find_q(frame->qtable[0], frame->qtable[1]);
+            frame->scan = seg_end;
+            frame->scan_len = jpeg_scan_len(seg_end, end);
+            return 0;
+        default:
+            // progressive, lossless and arithmetic coded frames can't be sent
+            if ((marker & 0xF0) == 0xC0 && 0xC4 != marker && 0xCC != marker) {
+                return -1;
+            }
+            break; // APPn, COM, DHT
+        }
+        p = seg_end;
+    }
+    return -1;
 }
 
-int media_stream_mjpeg_send_frame(media_stream_t *stream, const uint8_t *jpeg_data, uint32_t jpegLen)
+/**
+ * Whether viewers may join without becoming a subscriber, i.e. the tables a receiver keeps can't be sent to them
+ */
+static bool media_stream_mjpeg_multicast(media_stream_mjpeg_t *mjpeg)
+{
+    media_subscriber_t *it;
+    SLIST_FOREACH(it, &mjpeg->stream.subscribers, next) {
+        if (RTP_OVER_MULTICAST == it->rtp_session->session_info.transport_mode) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Q for tables other than those of Appendix A. Receivers keep the tables of a Q of 128-254 (RFC2435 3.1.8),
+ * so they go only with the first frame after a change, the first to a new viewer and every MJPEG_QTABLE_REFRESH frames.
+ * A Q is never given other tables, since receivers may keep them for good. After 254, Q 255 sends them in every frame,
+ * as do multicast tracks.
+ *
+ * @param send set to whether the tables go with this frame
+ */
+static uint8_t media_stream_mjpeg_tables_q(media_stream_mjpeg_t *mjpeg, const jpeg_frame_t *frame, bool *send)
+{
+    if (0 == mjpeg->tables_q || 0 != memcmp(mjpeg->tables, frame->qtable[0], 64) ||
+        0 != memcmp(mjpeg->tables + 64, frame->qtable[1], 64)) {
+        // receivers keep the old tables for the old Q
+        mjpeg->tables_q = (0 == mjpeg->tables_q) ? 128 : (mjpeg->tables_q < 255 ? mjpeg->tables_q + 1 : 255);
+        memcpy(mjpeg->tables, frame->qtable[0], 64);
+        memcpy(mjpeg->tables + 64, frame->qtable[1], 64);
+        mjpeg->tables_age = MJPEG_QTABLE_REFRESH;
+    }
+    // subscribers are added at the head of the list
+    const void *newest = SLIST_FIRST(&mjpeg->stream.subscribers);
+    *send = 255 == mjpeg->tables_q || mjpeg->tables_age >= MJPEG_QTABLE_REFRESH || newest != mjpeg->tables_viewer ||
+            media_stream_mjpeg_multicast(mjpeg);
+    if (*send) {
+        mjpeg->tables_age = 0;
+        mjpeg->tables_viewer = newest;
+    }
+    mjpeg->tables_age++;
+    return mjpeg->tables_q;
+}
+
+/**
+ * Find the end of the restart interval at pos, after its RST marker, 0 if the marker is not before len.
+ * 0xFF in entropy-coded data is either stuffed or a marker.
+ */
+static uint32_t jpeg_restart_end(const uint8_t *scan, uint32_t pos, uint32_t len)
+{
+    while (pos + 1 < len) {
+        const uint8_t *p = (const uint8_t *)memchr(scan + pos, 0xFF, len - 1 - pos);
+        if (NULL == p) {
+            break;
+        }
+        pos = p - scan + 1;
+        if (p[1] >= 0xD0 && p[1] <= 0xD7) {
+            return pos + 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Take the next fragment of at most size bytes: whole intervals if the first one fits, else a part of it
+ *
+ * @param data len bytes of the scan from the fragment on
+ * @param last the bytes end the scan
+ * @param rsthdr set to F, L and the restart count of the fragment
+ * @return length of the fragment
+ */
+static uint32_t jpeg_restart_fragment(jpeg_restart_t *r, const uint8_t *data, uint32_t len, bool last, uint32_t size,
+                                      jpeghdr_rst_t *rsthdr)
+{
+    uint32_t limit = len > size ? size : len;
+    bool scan_end = last && limit == len; // the last interval has no RST marker
+    uint32_t pos = jpeg_restart_end(data, 0, limit);
+    if (0 == pos && scan_end) {
+        pos = limit;
+    }
+    rsthdr->count = r->index % 0x3FFF; // wraps before 0x3FFF, which means the fragments are not aligned
+    rsthdr->f = r->start;
+    rsthdr->l = 0 != pos;
+    r->start = 0 != pos;
+    if (0 == pos) {
+        // a part of a long interval, which doesn't end inside a marker, so that the next part finds it
+        return 0xFF == data[limit - 1] ? limit - 1 : limit;
+    }
+    r->index++;
+    // the last fragment of a long interval ends with it, so the next packet starts an interval again
+    while (rsthdr->f && pos < limit) {
+        uint32_t end = jpeg_restart_end(data, pos, limit);
+        if (0 == end && !scan_end) {
+            break;
+        }
+        pos = end ? end : limit;
+        r->index++;
+    }
+    return pos;
+}
+
+/**
+ * Time since the last frame, in ms
+ */
+static uint32_t media_stream_mjpeg_delta_ms(media_stream_t *stream)
 {
-    uint16_t w = 0;
-    uint16_t h = 0;
     uint32_t curMsec = (uint32_t)(esp_timer_get_time() / 1000);
     if (stream->prevMsec == 0) { // first frame init our timestamp
         stream->prevMsec = curMsec;
@@ -122,94 +407,330 @@ int media_stream_mjpeg_send_frame(media_stream_t *stream, const uint8_t *jpeg_da
     // compute deltat (being careful to handle clock rollover with a little lie)
     uint32_t deltams = (curMsec >= stream->prevMsec) ? curMsec - stream->prevMsec : 100;
     stream->prevMsec = curMsec;
+    return deltams;
+}
 
-    rtp_packet_t rtp_packet;
-    rtp_packet.is_last = 0;
-    rtp_packet.data = stream->rtp_buffer;
-
-    // locate quant tables if possible
-    const uint8_t *qtable0 = NULL, *qtable1 = NULL;
-    if (!decodeJPEGfile(&jpeg_data, &jpegLen, &qtable0, &qtable1, &w, &h)) {
-        ESP_LOGW(TAG, "can't decode jpeg data");
-        // return -1;
+/**
+ * Prepare the RTP/JPEG headers of a parsed frame
+ *
+ * @return true if the whole file is sent, else only the scan
+ */
+static bool media_stream_mjpeg_begin(media_stream_mjpeg_t *mjpeg, const jpeg_frame_t *frame)
+{
+    mjpeg->whole_file = false;
+    if (!frame->std_huffman) {
+        // receivers build the headers again with the standard tables, the whole file lets decoders take its own
+        if (!mjpeg->own_huffman_logged) {
+            ESP_LOGW(TAG, "jpeg has its own huffman tables, the whole file is sent");
+            mjpeg->own_huffman_logged = true;
+        }
+        mjpeg->whole_file = true;
     }
 
-    uint8_t q = (qtable0 && qtable1) ? 128 : 0x5e;
-    uint8_t *mjpeg_buf = rtp_packet.data + RTP_TCP_HEAD_SIZE + RTP_HEADER_SIZE;
+    // tables of Appendix A are only named by their Q
+    mjpeg->send_tables = false;
+    uint8_t q = frame->q ? frame->q : media_stream_mjpeg_tables_q(mjpeg, frame, &mjpeg->send_tables);
 
     /**
      * Prepare the 8 byte payload JPEG header. Reference https://tools.ietf.org/html/rfc2435
      */
-    jpeghdr_t jpghdr;
-    jpghdr.tspec = 0; // type specific
-    jpghdr.off = 0;
-    jpghdr.type = 0; // (fixme might be wrong for camera data)
-    jpghdr.q = q;
-    jpghdr.width = w / 8;
-    jpghdr.height = h / 8;
-
-    int jpeg_bytes_left = jpegLen;
-    while (jpeg_bytes_left != 0) {
+    jpeghdr_t *jpghdr = &mjpeg->jpghdr;
+    jpghdr->tspec = 0; // type specific
+    jpghdr->off = 0;
+    // types 64-127 carry the restart interval, receivers then put a DRI into the headers they build
+    jpghdr->type = frame->type + (frame->dri ? 64 : 0);
+    jpghdr->q = q;
+    jpghdr->width = frame->width / 8;
+    jpghdr->height = frame->height / 8;
+
+    /**
+     * Fragments of the scan hold whole restart intervals, or a part of one which doesn't fit in a packet,
+     * so a lost packet costs receivers only its intervals. Fragments of the whole file can't be aligned.
+     */
+    mjpeg->rsthdr.dri = frame->dri;
+    mjpeg->rsthdr.f = mjpeg->rsthdr.l = 1;
+    mjpeg->rsthdr.count = 0x3FFF;
+    mjpeg->aligned = frame->dri && !mjpeg->whole_file;
+    mjpeg->restart.index = 0;
+    mjpeg->restart.start = true;
+    return mjpeg->whole_file;
+}
+
+/**
+ * Packetize the next bytes of the frame prepared by media_stream_mjpeg_begin(), sent from data in place
+ *
+ * @param last the bytes end the frame, else fragments are only taken while more bytes follow them
+ * @param used set to the bytes taken, the rest goes with the next ones
+ */
+static int media_stream_mjpeg_packetize(media_stream_mjpeg_t *mjpeg, rtp_packet_train_t *train, const uint8_t *data,
+                                        uint32_t len, bool last, uint32_t *used)
+{
+    jpeghdr_t *jpghdr = &mjpeg->jpghdr;
+    bool restart = jpghdr->type >= 64;
+    uint32_t pos = 0;
+    while (pos < len) {
+        bool qtable = jpghdr->q >= 128 && jpghdr->off == 0;
+        uint32_t header_len = sizeof(jpeghdr_t) + (restart ? sizeof(jpeghdr_rst_t) : 0) +
+                              (qtable ? sizeof(jpeghdr_qtable_t) + (mjpeg->send_tables ? 128 : 0) : 0);
+        uint32_t fragmentLen = MAX_JPEG_PACKET_SIZE - header_len;
+        if (!last && len - pos <= fragmentLen + 2) {
+            break; // the frame may end with EOI, which is not sent with the scan
+        }
+
+        rtp_packet_t *rtp_packet = rtp_packet_train_alloc(train);
+        RTP_CHECK(NULL != rtp_packet, "can't alloc rtp packet", -1);
+        uint8_t *mjpeg_buf = rtp_packet->data + RTP_TCP_HEAD_SIZE + RTP_HEADER_SIZE;
         uint8_t *p_buf = mjpeg_buf;
-        p_buf = mem_swap32_copy(p_buf, (uint8_t *)&jpghdr, sizeof(jpeghdr_t));
+        p_buf = mem_swap32_copy(p_buf, (uint8_t *)jpghdr, sizeof(jpeghdr_t));
 
-        // if (dri != 0) {
-        //  jpeghdr_rst_t rsthdr;
-        //         memcpy(ptr, &rsthdr, sizeof(rsthdr));
-        //         ptr += sizeof(rsthdr);
-        // }
+        if (mjpeg->aligned) {
+            fragmentLen = jpeg_restart_fragment(&mjpeg->restart, data + pos, len - pos, last, fragmentLen, &mjpeg->rsthdr);
+        }
+        if (restart) {
+            p_buf = mem_swap32_copy(p_buf, (uint8_t *)&mjpeg->rsthdr, sizeof(jpeghdr_rst_t));
+        }
 
-        if (q >= 128 && jpghdr.off == 0) {
-            // we need a quant header - but only in first packet of the frame
+        if (qtable) {
+            // we need a quant header - but only in first packet of the frame, empty while receivers keep the tables
             int numQantBytes = 64; // Two 64 byte tables
             jpeghdr_qtable_t qtblhdr;
             qtblhdr.mbz = 0;
             qtblhdr.precision = 0; // 8 bit precision
-            qtblhdr.length = 2 * numQantBytes;
+            qtblhdr.length = mjpeg->send_tables ? 2 * numQantBytes : 0;
             p_buf = mem_swap32_copy(p_buf, (uint8_t *)&qtblhdr, sizeof(jpeghdr_qtable_t));
-            memcpy(p_buf, qtable0, numQantBytes);
-            p_buf += numQantBytes;
-            memcpy(p_buf, qtable1, numQantBytes);
-            p_buf += numQantBytes;
+            if (mjpeg->send_tables) {
+                memcpy(p_buf, mjpeg->tables, 2 * numQantBytes);
+                p_buf += 2 * numQantBytes;
+            }
         }
 
-        uint32_t fragmentLen = MAX_JPEG_PACKET_SIZE - (p_buf - mjpeg_buf);
-        if (fragmentLen >= jpeg_bytes_left) {
-            fragmentLen = jpeg_bytes_left;
-            rtp_packet.is_last = 1; // RTP marker bit must be set on last fragment
+        if (fragmentLen >= len - pos) {
+            fragmentLen = len - pos;
+            rtp_packet->is_last = last; // RTP marker bit must be set on last fragment
         }
 
-        memcpy(p_buf, jpeg_data + jpghdr.off, fragmentLen);
-        p_buf += fragmentLen;
-        jpghdr.off += fragmentLen;
-        jpeg_bytes_left -= fragmentLen;
+        // the scan data is sent from the frame in place
+        rtp_packet->header_size = p_buf - mjpeg_buf;
+        rtp_packet->payload = data + pos;
+        rtp_packet->payload_size = fragmentLen;
+        jpghdr->off += fragmentLen;
+        pos += fragmentLen;
+
+        rtp_packet->size = rtp_packet->header_size + fragmentLen;
+        rtp_packet->timestamp = mjpeg->stream.Timestamp;
+        rtp_packet->type = RTP_PT_JPEG;
+    }
+    *used = pos;
+    return 0;
+}
+
+int media_stream_mjpeg_send_frame(media_stream_t *stream, const uint8_t *jpeg_data, uint32_t jpegLen)
+{
+    media_stream_mjpeg_t *mjpeg = (media_stream_mjpeg_t *)stream;
+    jpeg_frame_t frame;
+    if (0 != jpeg_parse(jpeg_data, jpegLen, &frame)) {
+        ESP_LOGW(TAG, "can't decode jpeg data");
+        return -1;
+    }
+    // receivers build the headers again from the RTP/JPEG header, only the scan is sent
+    bool whole_file = !frame.std_huffman;
+    const uint8_t *payload = whole_file ? jpeg_data : frame.scan;
+    uint32_t payload_len = whole_file ? jpegLen : frame.scan_len;
+    if (!media_stream_rate_admit(stream, payload_len)) {
+        return 0; // dropped, the next frame carries the time since the last one sent
+    }
+    uint32_t deltams = media_stream_mjpeg_delta_ms(stream);
 
-        rtp_packet.size = p_buf - mjpeg_buf;
-        rtp_packet.timestamp = stream->Timestamp;
-        rtp_packet.type = RTP_PT_JPEG;
-        rtp_send_packet(stream->rtp_session, &rtp_packet);
+    rtp_packet_train_t *train = media_stream_train_begin(stream);
+    RTP_CHECK(NULL != train, "can't get packet train", -1);
+    media_stream_mjpeg_begin(mjpeg, &frame);
+    uint32_t used;
+    if (0 != media_stream_mjpeg_packetize(mjpeg, train, payload, payload_len, true, &used)) {
+        return -1;
     }
+    media_stream_send_train(stream, train);
     // Increment ONLY after a full frame
     stream->Timestamp += (stream->clock_rate * deltams / 1000);
     return 0;
 }
 
-static void media_stream_mjpeg_delete(media_stream_t *stream)
+static int media_stream_mjpeg_begin_frame(media_stream_t *stream)
+{
+    media_stream_mjpeg_t *mjpeg = (media_stream_mjpeg_t *)stream;
+    mjpeg->part_state = MJPEG_PART_NONE;
+    media_stream_parts_end(stream);
+    if (NULL == mjpeg->part) {
+        mjpeg->part = (uint8_t *)malloc(MJPEG_PART_SIZE);
+        RTP_CHECK(NULL != mjpeg->part, "memory for mjpeg parts is not enough", -1);
+    }
+    if (!media_stream_rate_admit(stream, 0)) {
+        return 1; // dropped before it is encoded
+    }
+    mjpeg->part_len = 0;
+    mjpeg->part_skip = 0;
+    mjpeg->part_state = MJPEG_PART_HEADER;
+    mjpeg->part_deltams = media_stream_mjpeg_delta_ms(stream);
+    media_stream_parts_begin(stream);
+    return 0;
+}
+
+/**
+ * Drop APPn and COM segments from the header in the part buffer, so that it holds the header whatever metadata
+ * the encoder adds. The bytes of a segment not given yet are skipped.
+ */
+static void media_stream_mjpeg_part_strip(media_stream_mjpeg_t *mjpeg)
+{
+    uint8_t *part = mjpeg->part;
+    uint32_t pos = 2;
+    while (pos + 4 <= mjpeg->part_len && 0xFF == part[pos] && part[pos + 1] >= 0xC0 && 0xFF != part[pos + 1] &&
+           0xDA != part[pos + 1]) {
+        uint8_t marker = part[pos + 1];
+        uint32_t seg_len = (part[pos + 2] << 8) | part[pos + 3];
+        uint32_t seg_end = pos + 2 + seg_len;
+        if (seg_len < 2) {
+            return; // not a JPEG, parsing fails
+        }
+        if ((marker & 0xF0) != 0xE0 && 0xFE != marker) {
+            pos = seg_end;
+            continue;
+        }
+        if (seg_end > mjpeg->part_len) {
+            mjpeg->part_skip = seg_end - mjpeg->part_len;
+            mjpeg->part_len = pos;
+            return;
+        }
+        memmove(part + pos, part + seg_end, mjpeg->part_len - seg_end);
+        mjpeg->part_len -= seg_end - pos;
+    }
+}
+
+/**
+ * Start sending once the part buffer has the header of the frame
+ *
+ * @return 0 when sending, 1 while the header is not complete
+ */
+static int media_stream_mjpeg_part_header(media_stream_mjpeg_t *mjpeg)
 {
-    if (NULL != stream->rtp_buffer) {
-        free(stream->rtp_buffer);
+    jpeg_frame_t frame;
+    media_stream_mjpeg_part_strip(mjpeg);
+    if (0 != jpeg_parse(mjpeg->part, mjpeg->part_len, &frame)) {
+        if (mjpeg->part_len < MJPEG_PART_SIZE) {
+            return 1;
+        }
+        mjpeg->part_state = MJPEG_PART_NONE;
+        ESP_LOGW(TAG, "can't decode jpeg header");
+        return -1;
+    }
+    if (!media_stream_mjpeg_begin(mjpeg, &frame)) {
+        // the tables are copied to the stream, only the scan stays
+        mjpeg->part_len -= frame.scan - mjpeg->part;
+        memmove(mjpeg->part, frame.scan, mjpeg->part_len);
     }
-    free(stream);
+    mjpeg->part_state = MJPEG_PART_SCAN;
+    return 0;
+}
+
+static int media_stream_mjpeg_append_frame(media_stream_t *stream, const uint8_t *data, uint32_t len)
+{
+    media_stream_mjpeg_t *mjpeg = (media_stream_mjpeg_t *)stream;
+    while (len > 0 && MJPEG_PART_NONE != mjpeg->part_state) {
+        if (mjpeg->part_skip) {
+            uint32_t skip = len < mjpeg->part_skip ? len : mjpeg->part_skip;
+            mjpeg->part_skip -= skip;
+            data += skip;
+            len -= skip;
+            continue;
+        }
+        // the bytes left from the last parts are completed to fragments in the part buffer
+        uint32_t n = len < MJPEG_PART_SIZE - mjpeg->part_len ? len : MJPEG_PART_SIZE - mjpeg->part_len;
+        memcpy(mjpeg->part + mjpeg->part_len, data, n);
+        mjpeg->part_len += n;
+        data += n;
+        len -= n;
+        bool header = MJPEG_PART_HEADER == mjpeg->part_state;
+        if (header) {
+            int ret = media_stream_mjpeg_part_header(mjpeg);
+            if (ret < 0) {
+                return -1;
+            } else if (ret > 0) {
+                continue;
+            }
+        }
+
+        rtp_packet_train_t *train = media_stream_train_begin(stream);
+        RTP_CHECK(NULL != train, "can't get packet train", -1);
+        uint32_t used;
+        if (0 != media_stream_mjpeg_packetize(mjpeg, train, mjpeg->part, mjpeg->part_len, false, &used)) {
+            mjpeg->part_state = MJPEG_PART_NONE;
+            return -1;
+        }
+        uint32_t rest = mjpeg->part_len - used;
+        if (!header && len > 0 && rest <= n) {
+            // the rest is at the end of what was copied, the fragments after it are sent from data in place
+            data -= rest;
+            len += rest;
+            if (0 != media_stream_mjpeg_packetize(mjpeg, train, data, len, false, &used)) {
+                mjpeg->part_state = MJPEG_PART_NONE;
+                return -1;
+            }
+            media_stream_send_train(stream, train);
+            // the packets are sent, the buffer is free for the bytes left
+            mjpeg->part_len = len - used;
+            memcpy(mjpeg->part, data + used, mjpeg->part_len);
+            break;
+        }
+        if (train->count) {
+            media_stream_send_train(stream, train);
+        }
+        memmove(mjpeg->part, mjpeg->part + used, rest);
+        mjpeg->part_len = rest;
+    }
+    return 0;
+}
+
+static int media_stream_mjpeg_end_frame(media_stream_t *stream)
+{
+    media_stream_mjpeg_t *mjpeg = (media_stream_mjpeg_t *)stream;
+    if (MJPEG_PART_NONE == mjpeg->part_state) {
+        return 0; // dropped
+    }
+    if (MJPEG_PART_HEADER == mjpeg->part_state && 0 != media_stream_mjpeg_part_header(mjpeg)) {
+        mjpeg->part_state = MJPEG_PART_NONE;
+        ESP_LOGW(TAG, "can't decode jpeg data");
+        return -1;
+    }
+    mjpeg->part_state = MJPEG_PART_NONE;
+    uint32_t len = mjpeg->whole_file ? mjpeg->part_len : jpeg_scan_len(mjpeg->part, mjpeg->part + mjpeg->part_len);
+
+    rtp_packet_train_t *train = media_stream_train_begin(stream);
+    RTP_CHECK(NULL != train, "can't get packet train", -1);
+    uint32_t used;
+    if (0 != media_stream_mjpeg_packetize(mjpeg, train, mjpeg->part, len, true, &used)) {
+        return -1;
+    }
+    media_stream_send_train(stream, train);
+    media_stream_parts_end(stream);
+    media_stream_rate_frame_size(stream, mjpeg->jpghdr.off);
+    // Increment ONLY after a full frame
+    stream->Timestamp += (stream->clock_rate * mjpeg->part_deltams / 1000);
+    return 0;
+}
+
+static void media_stream_mjpeg_delete(media_stream_t *stream)
+{
+    media_stream_deinit(stream);
+    free(((media_stream_mjpeg_t *)stream)->part);
+    free((media_stream_mjpeg_t *)stream);
 }
 
 media_stream_t* media_stream_mjpeg_create(void)
 {
-    media_stream_t *stream = (media_stream_t*)calloc(1, sizeof(media_stream_t));
-    RTP_CHECK(NULL != stream, "memory for mjpeg stream is not enough", NULL);
+    media_stream_mjpeg_t *mjpeg = (media_stream_mjpeg_t*)calloc(1, sizeof(media_stream_mjpeg_t));
+    RTP_CHECK(NULL != mjpeg, "memory for mjpeg stream is not enough", NULL);
 
-    stream->rtp_buffer = (uint8_t *)malloc(MAX_RTP_PAYLOAD_SIZE);
-    if (NULL == stream->rtp_buffer) {
-        free(stream);
+    media_stream_t *stream = &mjpeg->stream;
+    if (0 != media_stream_init(stream, MJPEG_TRAIN_PACKETS)) {
+        free(mjpeg);
         ESP_LOGE(TAG, "memory for media mjpeg buffer is insufficient");
         return NULL;
     }
@@ -219,6 +740,265 @@ media_stream_t* media_stream_mjpeg_create(void)
     stream->get_attribute = media_stream_mjpeg_get_attribute;
     stream->get_description = media_stream_mjpeg_get_description;
     stream->handle_frame = media_stream_mjpeg_send_frame;
+    stream->begin_frame = media_stream_mjpeg_begin_frame;
+    stream->append_frame = media_stream_mjpeg_append_frame;
+    stream->end_frame = media_stream_mjpeg_end_frame;
     return stream;
 }
 
+
+#if defined(_DEBUG) || defined(DEBUG)
+#include <assert.h>
+
+/**
+ * Write a baseline 4:2:2 JPEG of 320x240 with the tables of q, the standard Huffman tables and app_len bytes of APP1
+ *
+ * @return length of the file
+ */
+static uint32_t jpeg_test_file(uint8_t *out, uint32_t app_len, uint8_t q, uint16_t dri, const uint8_t *scan,
+                               uint32_t scan_len)
+{
+    static const uint8_t sof[] = {0xFF, 0xC0, 0, 17, 8, 0, 240, 1, 64, 3, 1, 0x21, 0, 2, 0x11, 1, 3, 0x11, 1};
+    static const uint8_t sos[] = {0xFF, 0xDA, 0, 12, 3, 1, 0x00, 2, 0x11, 3, 0x11, 0, 63, 0};
+    uint8_t *p = out;
+    *p++ = 0xFF;
+    *p++ = 0xD8;
+    while (app_len) {
+        uint32_t n = app_len > 65533 ? 65533 : app_len;
+        *p++ = 0xFF;
+        *p++ = 0xE1;
+        *p++ = (n + 2) >> 8;
+        *p++ = (n + 2) & 0xFF;
+        memset(p, 0xFF, n); // like markers, the parser must skip them by the length
+        p += n;
+        app_len -= n;
+    }
+    int scale = q < 50 ? 5000 / q : 200 - q * 2;
+    for (int t = 0; t < 2; t++) {
+        *p++ = 0xFF;
+        *p++ = 0xDB;
+        *p++ = 0;
+        *p++ = 67;
+        *p++ = t;
+        for (int i = 0; i < 64; i++) {
+            int v = (jpeg_std_quantizers[t * 64 + i] * scale + 50) / 100;
+            *p++ = v < 1 ? 1 : (v > 255 ? 255 : v);
+        }
+    }
+    memcpy(p, sof, sizeof(sof));
+    p += sizeof(sof);
+    uint32_t dht_len = 2;
+    for (int k = 0; k < 4; k++) {
+        dht_len += jpeg_std_huffman_len[k];
+    }
+    *p++ = 0xFF;
+    *p++ = 0xC4;
+    *p++ = dht_len >> 8;
+    *p++ = dht_len & 0xFF;
+    for (int k = 0; k < 4; k++) {
+        memcpy(p, jpeg_std_huffman[k], jpeg_std_huffman_len[k]);
+        p += jpeg_std_huffman_len[k];
+    }
+    if (dri) {
+        *p++ = 0xFF;
+        *p++ = 0xDD;
+        *p++ = 0;
+        *p++ = 4;
+        *p++ = dri >> 8;
+        *p++ = dri & 0xFF;
+    }
+    memcpy(p, sos, sizeof(sos));
+    p += sizeof(sos);
+    memcpy(p, scan, scan_len);
+    p += scan_len;
+    *p++ = 0xFF;
+    *p++ = 0xD9;
+    return p - out;
+}
+
+// headers are parsed segment by segment, the scan is never looked into
+void media_mjpeg_parse_test(void)
+{
+    static const uint8_t scan[] = {0x12, 0xFF, 0x00, 0x34, 0xFF, 0xD0, 0x56, 0xFF, 0xFF, 0xD1, 0x78};
+    uint32_t header_len = 2 + 2 * 69 + 19 + 4 + 416 + 14;
+    uint8_t *file = (uint8_t *)malloc(104 + header_len + 6 + sizeof(scan) + 2);
+    assert(file);
+    jpeg_frame_t frame;
+
+    uint32_t len = jpeg_test_file(file, 0, 50, 0, scan, sizeof(scan));
+    assert(0 == jpeg_parse(file, len, &frame));
+    assert(320 == frame.width && 240 == frame.height && 0 == frame.type && 0 == frame.dri && 50 == frame.q);
+    assert(frame.std_huffman && frame.scan == file + header_len && sizeof(scan) == frame.scan_len);
+    assert(frame.qtable[0] == file + 2 + 5 && frame.qtable[1] == file + 2 + 69 + 5);
+
+    // metadata moves the header, other tables change Q, a restart interval changes the type
+    len = jpeg_test_file(file, 100, 80, 4, scan, sizeof(scan));
+    assert(0 == jpeg_parse(file, len, &frame));
+    assert(80 == frame.q && 4 == frame.dri && frame.scan == file + 104 + header_len + 6);
+    assert(sizeof(scan) == frame.scan_len);
+
+    // tables of no Q
+    file[2 + 104 + 5] ^= 1;
+    assert(0 == jpeg_parse(file, len, &frame));
+    assert(0 == frame.q);
+
+    // other Huffman tables, the frame is sent as a whole file
+    len = jpeg_test_file(file, 0, 50, 0, scan, sizeof(scan));
+    file[2 + 2 * 69 + 19 + 4 + 17] ^= 1;
+    assert(0 == jpeg_parse(file, len, &frame));
+    assert(!frame.std_huffman && 50 == frame.q);
+    file[2 + 2 * 69 + 19 + 4 + 17] ^= 1;
+
+    // broken files
+    assert(0 != jpeg_parse(file, header_len - 1, &frame));
+    file[1] = 0xD9;
+    assert(0 != jpeg_parse(file, len, &frame));
+    free(file);
+
+    // a header of more than 64 KB, e.g. with an EXIF thumbnail, only if there is enough memory
+    file = (uint8_t *)malloc(70008 + header_len + sizeof(scan) + 2);
+    if (file) {
+        len = jpeg_test_file(file, 70000, 50, 0, scan, sizeof(scan));
+        assert(0 == jpeg_parse(file, len, &frame));
+        assert(frame.scan == file + 70008 + header_len && sizeof(scan) == frame.scan_len && 50 == frame.q);
+        free(file);
+    }
+}
+
+/**
+ * Check the packets of the last frame sent: the payloads are data in order, from its main JPEG headers
+ */
+static void media_mjpeg_packet_check(media_stream_t *stream, const uint8_t *data, uint32_t len, uint8_t type,
+                                     uint8_t q)
+{
+    rtp_packet_train_t *train = stream->train;
+    uint32_t off = 0;
+    for (uint32_t i = 0; i < train->count; i++) {
+        const rtp_packet_t *packet = &train->packets[i];
+        const uint8_t *hdr = packet->data + RTP_TCP_HEAD_SIZE + RTP_HEADER_SIZE;
+        assert(packet->header_size >= 8 && packet->size == packet->header_size + packet->payload_size);
+        assert(off == (uint32_t)((hdr[1] << 16) | (hdr[2] << 8) | hdr[3]));
+        assert(type == hdr[4] && q == hdr[5] && 320 / 8 == hdr[6] && 240 / 8 == hdr[7]);
+        assert(type < 64 || (packet->header_size >= 12 && 4 == ((hdr[8] << 8) | hdr[9])));
+        assert(packet->payload == data + off && packet->is_last == (i + 1 == train->count));
+        off += packet->payload_size;
+    }
+    assert(train->count > 1 && len == off);
+}
+
+// only the scan is sent when receivers can build the headers again from the RTP/JPEG header
+void media_mjpeg_packet_test(void)
+{
+    uint32_t scan_len = 3 * MAX_JPEG_PACKET_SIZE;
+    uint8_t *scan = (uint8_t *)malloc(scan_len);
+    uint8_t *file = (uint8_t *)malloc(2 + 2 * 69 + 19 + 4 + 416 + 6 + 14 + scan_len + 2);
+    media_stream_t *stream = media_stream_mjpeg_create();
+    assert(scan && file && stream);
+    memset(scan, 0x11, scan_len);
+
+    uint32_t len = jpeg_test_file(file, 0, 50, 0, scan, scan_len);
+    assert(0 == media_stream_mjpeg_send_frame(stream, file, len));
+    media_mjpeg_packet_check(stream, file + len - 2 - scan_len, scan_len, 0, 50);
+
+    // a restart interval of 4 MCUs, given by the type and the restart marker header
+    for (uint32_t i = MJPEG_PART_SIZE; i + 2 < scan_len; i += MJPEG_PART_SIZE) {
+        scan[i] = 0xFF;
+        scan[i + 1] = 0xD0 + (i / MJPEG_PART_SIZE - 1) % 8;
+    }
+    len = jpeg_test_file(file, 0, 50, 4, scan, scan_len);
+    assert(0 == media_stream_mjpeg_send_frame(stream, file, len));
+    media_mjpeg_packet_check(stream, file + len - 2 - scan_len, scan_len, 64, 50);
+
+    // other Huffman tables, receivers need the whole file
+    len = jpeg_test_file(file, 0, 50, 0, scan, scan_len);
+    file[2 + 2 * 69 + 19 + 4 + 17] ^= 1;
+    assert(0 == media_stream_mjpeg_send_frame(stream, file, len));
+    media_mjpeg_packet_check(stream, file, len, 0, 50);
+
+    stream->delete_media(stream);
+    free(file);
+    free(scan);
+}
+
+typedef struct {
+    uint8_t *buf;
+    uint32_t len;
+    uint32_t size;
+} jpeg_test_record_t;
+
+// marker bit, RTP/JPEG headers and payload of every packet sent, in order
+static void media_mjpeg_record_train(media_stream_t *stream, const rtp_packet_train_t *train)
+{
+    jpeg_test_record_t *rec = (jpeg_test_record_t *)stream->user_data;
+    for (uint32_t i = 0; i < train->count; i++) {
+        const rtp_packet_t *packet = &train->packets[i];
+        assert(rec->len + 2 + packet->size <= rec->size);
+        rec->buf[rec->len++] = packet->is_last;
+        rec->buf[rec->len++] = packet->header_size;
+        memcpy(rec->buf + rec->len, packet->data + RTP_TCP_HEAD_SIZE + RTP_HEADER_SIZE, packet->header_size);
+        rec->len += packet->header_size;
+        memcpy(rec->buf + rec->len, packet->payload, packet->payload_size);
+        rec->len += packet->payload_size;
+    }
+}
+
+// a frame given in parts is sent as the same packets as the whole frame without its metadata
+void media_mjpeg_parts_test(void)
+{
+    uint32_t scan_len = 3 * MAX_JPEG_PACKET_SIZE;
+    uint32_t app_len = MJPEG_PART_SIZE + 100; // more than the part buffer, skipped after it is stripped
+    uint32_t dht = 2 + 2 * 69 + 19 + 4 + 17;
+    uint32_t size = 2 + 2 * 69 + 19 + 4 + 416 + 6 + 14 + scan_len + 2;
+    uint8_t *scan = (uint8_t *)malloc(scan_len);
+    uint8_t *plain = (uint8_t *)malloc(size);
+    uint8_t *file = (uint8_t *)malloc(4 + app_len + size);
+    jpeg_test_record_t whole = {(uint8_t *)malloc(2 * size), 0, 2 * size};
+    jpeg_test_record_t parts = {(uint8_t *)malloc(2 * size), 0, 2 * size};
+    media_stream_t *stream = media_stream_mjpeg_create();
+    assert(scan && plain && file && whole.buf && parts.buf && stream);
+    memset(scan, 0x11, scan_len);
+    for (uint32_t i = MJPEG_PART_SIZE; i + 2 < scan_len; i += MJPEG_PART_SIZE) {
+        scan[i] = 0xFF;
+        scan[i + 1] = 0xD0 + (i / MJPEG_PART_SIZE - 1) % 8;
+    }
+    stream->on_train = media_mjpeg_record_train;
+
+    // 1 byte at a time, around a packet, the whole file at once; all but the last split the APP1 segment
+    static const uint32_t chunks[] = {1, MAX_JPEG_PACKET_SIZE - 1, MAX_JPEG_PACKET_SIZE + 1, 0};
+    for (int k = 0; k < 3; k++) {
+        // the standard tables, a restart interval, other Huffman tables which make the whole file sent
+        uint16_t dri = 1 == k ? 4 : 0;
+        uint32_t plain_len = jpeg_test_file(plain, 0, 50, dri, scan, scan_len);
+        uint32_t len = jpeg_test_file(file, app_len, 50, dri, scan, scan_len);
+        if (2 == k) {
+            plain[dht] ^= 1;
+            file[4 + app_len + dht] ^= 1;
+        }
+        stream->user_data = &whole;
+        whole.len = 0;
+        assert(0 == media_stream_mjpeg_send_frame(stream, plain, plain_len));
+        media_mjpeg_packet_check(stream, 2 == k ? plain : plain + plain_len - 2 - scan_len,
+                                 2 == k ? plain_len : scan_len, 1 == k ? 64 : 0, 50);
+
+        stream->user_data = &parts;
+        for (uint32_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+            uint32_t chunk = chunks[c] ? chunks[c] : len;
+            parts.len = 0;
+            assert(0 == stream->begin_frame(stream));
+            for (uint32_t pos = 0; pos < len; pos += chunk) {
+                assert(0 == stream->append_frame(stream, file + pos, len - pos < chunk ? len - pos : chunk));
+            }
+            assert(0 == stream->end_frame(stream));
+            assert(whole.len == parts.len && 0 == memcmp(whole.buf, parts.buf, whole.len));
+        }
+    }
+
+    stream->user_data = NULL;
+    stream->delete_media(stream);
+    free(parts.buf);
+    free(whole.buf);
+    free(file);
+    free(plain);
+    free(scan);
+}
+#endif
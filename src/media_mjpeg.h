@@ -40,6 +40,12 @@ typedef struct
 
 media_stream_t* media_stream_mjpeg_create(void);
 
+#if defined(_DEBUG) || defined(DEBUG)
+void media_mjpeg_parse_test(void);
+void media_mjpeg_packet_test(void);
+void media_mjpeg_parts_test(void);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,8 +1,284 @@
 
 #include <stdio.h>
 #include <string.h>
+#include "esp_log.h"
+#include "media_stream.h"
+#include "send_queue.h"
 
-// #include "media_stream.h"
+static const char *TAG __attribute__((unused)) = "media_stream";
 
+#define MEDIA_CHECK(a, str, ret_val)                       \
+    if (!(a))                                                     \
+    {                                                             \
+        ESP_LOGE(TAG, "%s(%d): %s", __FUNCTION__, __LINE__, str); \
+        return (ret_val);                                         \
+    }
 
+int media_stream_init(media_stream_t *stream, uint32_t packets)
+{
+    SLIST_INIT(&stream->subscribers);
+    stream->train = rtp_packet_train_create(packets, RTP_PACKET_SLOT_SIZE);
+    MEDIA_CHECK(NULL != stream->train, "memory for media packet train is not enough", -1);
+    stream->udp_batch = rtp_udp_batch_create(packets);
+    if (NULL == stream->udp_batch) {
+        media_stream_deinit(stream);
+        return -1;
+    }
+    return 0;
+}
 
+void media_stream_deinit(media_stream_t *stream)
+{
+    while (!SLIST_EMPTY(&stream->subscribers)) {
+        media_subscriber_t *it = SLIST_FIRST(&stream->subscribers);
+        SLIST_REMOVE_HEAD(&stream->subscribers, next);
+        free(it);
+    }
+    if (NULL != stream->train) {
+        rtp_packet_train_release(stream->train);
+        stream->train = NULL;
+    }
+    if (NULL != stream->udp_batch) {
+        rtp_udp_batch_delete(stream->udp_batch);
+        stream->udp_batch = NULL;
+    }
+}
+
+int media_stream_add_subscriber(media_stream_t *stream, rtp_session_t *rtp_session)
+{
+    media_subscriber_t *it;
+    SLIST_FOREACH(it, &stream->subscribers, next) {
+        if (it->rtp_session == rtp_session) {
+            return 0; // already subscribed, e.g. PLAY after PAUSE
+        }
+    }
+
+    it = (media_subscriber_t *)calloc(1, sizeof(media_subscriber_t));
+    MEDIA_CHECK(NULL != it, "memory for media subscriber is not enough", -1);
+    it->rtp_session = rtp_session;
+    SLIST_INSERT_HEAD(&stream->subscribers, it, next);
+    return 0;
+}
+
+int media_stream_remove_subscriber(media_stream_t *stream, rtp_session_t *rtp_session)
+{
+    media_subscriber_t *it;
+    SLIST_FOREACH(it, &stream->subscribers, next) {
+        if (it->rtp_session == rtp_session) {
+            SLIST_REMOVE(&stream->subscribers, it, media_subscriber_t, next);
+            free(it);
+            if (SLIST_EMPTY(&stream->subscribers)) {
+                // the next viewer starts from the rate of the producer again, which is told with its next frame
+                memset(&stream->rate, 0, sizeof(stream->rate));
+                memset(&stream->rc, 0, sizeof(stream->rc));
+                stream->rc.reset = true;
+            }
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Loss based rate control like that of the Google congestion control (draft-ietf-rmcat-gcc):
+ * cut the rate by half the loss when loss is high, a little when RTT grows, else grow it slowly
+ */
+static void media_stream_rate_update(media_stream_t *stream, uint32_t reports, const media_stream_rate_t *worst)
+{
+    media_stream_rc_t *rc = &stream->rc;
+    media_stream_rate_t rate = stream->rate;
+    if (0 == rc->frame_us || 0 == rc->frame_bits) {
+        return; // the rate of the producer is not known yet
+    }
+    rc->reports = reports;
+    uint32_t producer_fps = (1000000 + rc->frame_us / 2) / rc->frame_us;
+    uint32_t producer_bitrate = (uint32_t)((uint64_t)rc->frame_bits * 1000000 / rc->frame_us);
+    if (0 == rate.bitrate) {
+        rate.bitrate = producer_bitrate;
+    }
+    // the producer follows the target, so the rate it sends at can't tell how far the target may grow again
+    if (producer_fps > rc->max_fps) {
+        rc->max_fps = producer_fps;
+    }
+    uint32_t nominal_fps = stream->max_frame_rate ? stream->max_frame_rate : rc->max_fps;
+    uint32_t nominal_bitrate = rc->frame_bits * nominal_fps;
+    if (worst->rtt_us && (0 == rc->min_rtt_us || worst->rtt_us < rc->min_rtt_us)) {
+        rc->min_rtt_us = worst->rtt_us;
+    }
+
+    if (worst->loss_permille > MEDIA_RATE_LOSS_HIGH) {
+        rate.bitrate = (uint32_t)((uint64_t)rate.bitrate * (2000 - worst->loss_permille) / 2000);
+    } else if (worst->rtt_us > rc->min_rtt_us + MEDIA_RATE_RTT_SLACK_US) {
+        rate.bitrate = rate.bitrate / 100 * 85;
+    } else if (worst->loss_permille < MEDIA_RATE_LOSS_LOW) {
+        // up to half more than the producer sends at its nominal rate, so that it may raise its quality again
+        rate.bitrate = rate.bitrate / 100 * 105;
+        if (rate.bitrate > nominal_bitrate + nominal_bitrate / 2) {
+            rate.bitrate = nominal_bitrate + nominal_bitrate / 2;
+        }
+    }
+    if (rate.bitrate < rc->frame_bits * MEDIA_RATE_MIN_FPS) {
+        rate.bitrate = rc->frame_bits * MEDIA_RATE_MIN_FPS;
+    }
+
+    rate.frame_rate = rate.bitrate / rc->frame_bits;
+    if (rate.frame_rate < MEDIA_RATE_MIN_FPS) {
+        rate.frame_rate = MEDIA_RATE_MIN_FPS;
+    } else if (rate.frame_rate > nominal_fps) {
+        rate.frame_rate = nominal_fps;
+    }
+    rate.loss_permille = worst->loss_permille;
+    rate.rtt_us = worst->rtt_us;
+    rate.jitter_us = worst->jitter_us;
+
+    bool changed = rate.bitrate != stream->rate.bitrate || rate.frame_rate != stream->rate.frame_rate;
+    stream->rate = rate;
+    if (changed) {
+        ESP_LOGD(TAG, "rate %u bps %u fps, loss %u/1000 rtt %u us", rate.bitrate, rate.frame_rate,
+                 rate.loss_permille, rate.rtt_us);
+        if (stream->on_rate) {
+            stream->on_rate(stream, &stream->rate);
+        }
+    }
+}
+
+void media_stream_rate_frame_size(media_stream_t *stream, uint32_t len)
+{
+    media_stream_rc_t *rc = &stream->rc;
+    // averages over about 8 frames
+    if (0 == rc->frame_bits) {
+        rc->frame_bits = len * 8;
+    } else {
+        rc->frame_bits += (int32_t)(len * 8 - rc->frame_bits) / 8;
+    }
+}
+
+bool media_stream_rate_admit(media_stream_t *stream, uint32_t len)
+{
+    media_stream_rc_t *rc = &stream->rc;
+    uint64_t now = rtpclock();
+    if (rc->reset) {
+        rc->reset = false;
+        if (stream->on_rate) {
+            stream->on_rate(stream, &stream->rate);
+        }
+    }
+    if (SLIST_EMPTY(&stream->subscribers)) {
+        return true;
+    }
+
+    if (len) {
+        media_stream_rate_frame_size(stream, len);
+    }
+    if (rc->last_frame) {
+        uint32_t us = (uint32_t)(now - rc->last_frame);
+        rc->frame_us = rc->frame_us ? rc->frame_us + ((int32_t)(us - rc->frame_us) / 8) : us;
+    }
+    rc->last_frame = now;
+
+    // the viewer with the worst link decides
+    uint32_t reports = 0;
+    media_stream_rate_t worst = {0};
+    media_subscriber_t *it;
+    SLIST_FOREACH(it, &stream->subscribers, next) {
+        rtp_qos_t qos;
+        if (0 != rtp_get_qos(it->rtp_session, &qos)) {
+            continue;
+        }
+        reports += qos.reports;
+        worst.loss_permille = qos.loss_permille > worst.loss_permille ? qos.loss_permille : worst.loss_permille;
+        worst.rtt_us = qos.rtt_us > worst.rtt_us ? qos.rtt_us : worst.rtt_us;
+        worst.jitter_us = qos.jitter_us > worst.jitter_us ? qos.jitter_us : worst.jitter_us;
+    }
+    if (reports != rc->reports) {
+        media_stream_rate_update(stream, reports, &worst);
+    }
+
+    if (0 == stream->rate.frame_rate) {
+        return true;
+    }
+    // frames within half an interval of the producer count as due, so that its jitter doesn't drop them
+    uint32_t interval = 1000000 / stream->rate.frame_rate;
+    if (now + rc->frame_us / 2 < rc->next_send) {
+        return false;
+    }
+    rc->next_send = (rc->next_send + interval < now) ? now + interval : rc->next_send + interval;
+    return true;
+}
+
+rtp_packet_train_t *media_stream_train_begin(media_stream_t *stream)
+{
+    rtp_packet_train_t *train = stream->train;
+    if (train->ref > 1) {
+        // the last frame is still referenced by someone, leave it to them
+        stream->train = rtp_packet_train_create(train->capacity, train->stride);
+        rtp_packet_train_release(train);
+        MEDIA_CHECK(NULL != stream->train, "memory for media packet train is not enough", NULL);
+        train = stream->train;
+    }
+    rtp_packet_train_reset(train);
+    return train;
+}
+
+int media_stream_send_train(media_stream_t *stream, rtp_packet_train_t *train)
+{
+#if defined(_DEBUG) || defined(DEBUG)
+    if (stream->on_train) {
+        stream->on_train(stream, train);
+    }
+#endif
+    if (SLIST_EMPTY(&stream->subscribers)) {
+        return 0;
+    }
+
+    // the frame is packetized once, each subscriber only patches its own header fields
+    rtp_packet_train_write_headers(train);
+    media_subscriber_t *it;
+    SLIST_FOREACH(it, &stream->subscribers, next) {
+        if (stream->in_parts && it->skip) {
+            continue;
+        }
+        // a viewer admitted by media_stream_parts_begin() gets every part of the frame
+        if (0 != rtp_send_packet_train(it->rtp_session, train, stream->udp_batch, stream->in_parts) &&
+            stream->in_parts) {
+            it->skip = true; // out of memory, the frame is broken for this viewer anyway
+        }
+    }
+    // UDP packets of the frame go out for all subscribers at once
+    uint32_t datagrams = stream->udp_batch->count;
+    int calls = rtp_udp_batch_flush(stream->udp_batch);
+    ESP_LOGD(TAG, "frame of %u packets: %u datagrams in %d send calls", train->count, datagrams, calls);
+
+    // payloads still point into the frame of the caller, keep them for packets left in send queues
+    if (train->ref > 1 && 0 != rtp_packet_train_detach(train)) {
+        SLIST_FOREACH(it, &stream->subscribers, next) {
+            send_queue_t *queue = it->rtp_session->session_info.send_queue;
+            if (RTP_OVER_TCP == it->rtp_session->session_info.transport_mode && send_queue_depth(queue)) {
+                send_queue_abort(queue);
+            }
+        }
+        return -1;
+    }
+    return 0;
+}
+
+void media_stream_parts_begin(media_stream_t *stream)
+{
+    // room for frames up to twice the average, the sizes vary with the scene and the quality
+    uint32_t bytes = stream->rc.frame_bits / 4;
+    uint32_t packets = bytes / MAX_RTP_PAYLOAD_SIZE + 1;
+    media_subscriber_t *it;
+    SLIST_FOREACH(it, &stream->subscribers, next) {
+        it->skip = !rtp_has_room(it->rtp_session, packets, bytes);
+        if (it->skip) {
+            it->rtp_session->session_info.send_queue->dropped += packets;
+            ESP_LOGD(TAG, "send queue is full, skip frame in parts");
+        }
+    }
+    stream->in_parts = true;
+}
+
+void media_stream_parts_end(media_stream_t *stream)
+{
+    stream->in_parts = false;
+}
@@ -3,6 +3,8 @@
 #ifndef _MEDIA_STREAM_H_
 #define _MEDIA_STREAM_H_
 
+#include <stdbool.h>
+#include <sys/queue.h>
 #include "rtp.h"
 
 #ifdef __cplusplus
@@ -103,21 +105,131 @@ typedef enum {
     MEDIA_STREAM_L16,
 }media_stream_type_t;
 
+#define MEDIA_RATE_MIN_FPS        1       // frame rate the congestion control never goes below
+#define MEDIA_RATE_LOSS_HIGH      100     // loss over the report window in 1/1000 above which the rate is cut
+#define MEDIA_RATE_LOSS_LOW       20      // loss below which the rate may grow
+#define MEDIA_RATE_RTT_SLACK_US   100000  // RTT above the smallest one seen which means queues are building up
+
+/**
+ * Target of the congestion control of a stream, from the RTCP receiver reports of its viewers
+ */
+typedef struct media_stream_rate_t {
+    uint32_t bitrate;         // bits per second
+    uint32_t frame_rate;      // frames per second
+    uint32_t loss_permille;   // of the viewer with the most loss
+    uint32_t rtt_us;          // of the viewer with the longest RTT
+    uint32_t jitter_us;       // of the viewer with the most jitter
+} media_stream_rate_t;
+
+/**
+ * State of the congestion control
+ */
+typedef struct media_stream_rc_t {
+    uint32_t reports;         // receiver reports of all subscribers when the rate was last computed
+    uint32_t frame_bits;      // average frame size from the producer
+    uint32_t frame_us;        // average interval of frames from the producer, 0 until the second frame
+    uint32_t min_rtt_us;      // smallest RTT seen, 0 if none
+    uint32_t max_fps;         // highest frame rate measured from the producer
+    bool reset;               // the target was dropped with the last viewer, on_rate is due
+    uint64_t last_frame;      // rtpclock() of the last frame from the producer
+    uint64_t next_send;       // rtpclock() at which the next frame is due at the target frame rate
+} media_stream_rc_t;
+
+typedef struct media_subscriber_t {
+    rtp_session_t *rtp_session;
+    bool skip;                // gets no part of the frame in parts being sent
+    /* Next subscriber entry in the singly linked list */
+    SLIST_ENTRY(media_subscriber_t) next;
+} media_subscriber_t;
+
 typedef struct media_stream_t{
     media_stream_type_t type;
-    uint8_t *rtp_buffer;
+    rtp_packet_train_t *train;    // packets of the last frame
+    rtp_udp_batch_t *udp_batch;   // UDP packets of all subscribers for one frame
     uint32_t prevMsec;
     uint32_t Timestamp;
     uint32_t clock_rate;
     uint32_t sample_rate;
-    rtp_session_t *rtp_session;
+    SLIST_HEAD(media_subscribers_list_t, media_subscriber_t) subscribers; // rtp sessions of clients in play state
+    media_stream_rate_t rate;     // 0 until a viewer reports
+    uint32_t max_frame_rate;      // nominal rate of the producer the target grows back to, 0 for the highest measured
+    media_stream_rc_t rc;
+    bool in_parts;                // a frame in parts is being sent, see media_stream_parts_begin()
+    void *user_data;              // of on_rate
     void (*delete_media)(struct media_stream_t *stream);
     void (*get_description)(struct media_stream_t *stream, char *buf, uint32_t buf_len, uint16_t port);
     void (*get_attribute)(struct media_stream_t *stream, char *buf, uint32_t buf_len);
     int (*handle_frame)(struct media_stream_t *stream, const uint8_t *data, uint32_t len);
+    /**
+     * A frame in parts as the producer has them, e.g. from the JPEG encoder, whose packets are sent as soon as
+     * their bytes are given. NULL for streams which take only whole frames.
+     * begin_frame returns 1 when the frame is dropped to keep the target frame rate, its parts are then ignored.
+     */
+    int (*begin_frame)(struct media_stream_t *stream);
+    int (*append_frame)(struct media_stream_t *stream, const uint8_t *data, uint32_t len);
+    int (*end_frame)(struct media_stream_t *stream);
     uint32_t (*get_timestamp)();
+    /**
+     * Set by the producer to follow the target, e.g. by the JPEG quality and the capture rate of the camera.
+     * Frames sent faster than the target frame rate are dropped by the stream in any case.
+     * A rate of 0 means no target, after the last viewer left: the producer goes back to its nominal rate.
+     */
+    void (*on_rate)(struct media_stream_t *stream, const media_stream_rate_t *rate);
+#if defined(_DEBUG) || defined(DEBUG)
+    void (*on_train)(struct media_stream_t *stream, const rtp_packet_train_t *train); // self tests, every train sent
+#endif
 } media_stream_t;
 
+/**
+ * Initialize the common part of stream
+ *
+ * @param packets initial capacity of the packet train, it grows when a frame needs more
+ */
+int media_stream_init(media_stream_t *stream, uint32_t packets);
+
+void media_stream_deinit(media_stream_t *stream);
+
+int media_stream_add_subscriber(media_stream_t *stream, rtp_session_t *rtp_session);
+
+int media_stream_remove_subscriber(media_stream_t *stream, rtp_session_t *rtp_session);
+
+/**
+ * Feed a frame of len bytes from the producer to the congestion control.
+ * The target is computed again when viewers sent new receiver reports, on_rate is called when it changes.
+ *
+ * @param len 0 if not known yet, it is then given by media_stream_rate_frame_size()
+ * @return true to send the frame, false to drop it to keep the target frame rate
+ */
+bool media_stream_rate_admit(media_stream_t *stream, uint32_t len);
+
+/**
+ * Feed the size of a frame once it is sent, for frames admitted before their size was known
+ */
+void media_stream_rate_frame_size(media_stream_t *stream, uint32_t len);
+
+/**
+ * Get an empty packet train to packetize the next frame into
+ */
+rtp_packet_train_t *media_stream_train_begin(media_stream_t *stream);
+
+/**
+ * Send the packets of a frame to every subscriber of the stream.
+ * Payloads may point into the frame, which is no longer referenced once this returns.
+ */
+int media_stream_send_train(media_stream_t *stream, rtp_packet_train_t *train);
+
+/**
+ * Start a frame whose packets are sent in several trains as its parts are given.
+ * Whether a subscriber gets it is decided once here for the whole frame: a TCP viewer whose send queue has no room
+ * for a frame of about the average size skips every part of it, so that it never gets a broken frame.
+ */
+void media_stream_parts_begin(media_stream_t *stream);
+
+/**
+ * End the frame in parts, trains are sent to every subscriber again
+ */
+void media_stream_parts_end(media_stream_t *stream);
+
 
 #ifdef __cplusplus
 }
@@ -5,7 +5,9 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/select.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_log.h"
@@ -77,7 +79,30 @@ UDPSOCKET udpsocketcreate(unsigned short portNum)
 ssize_t socketsend(SOCKET sockfd, const void *buf, size_t len)
 {
     // printf("TCP send\n");
-    return send(sockfd, buf, len, 0);
+    ssize_t res = send(sockfd, buf, len, MSG_DONTWAIT);
+    if (res >= 0) {
+        return res;
+    }
+    if (errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR) {
+        return -1;
+    }
+    return -2;
+}
+
+ssize_t socketsendv(SOCKET sockfd, const struct iovec *iov, int iovcnt)
+{
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = (struct iovec *)iov;
+    hdr.msg_iovlen = iovcnt;
+    ssize_t res = sendmsg(sockfd, &hdr, MSG_DONTWAIT);
+    if (res >= 0) {
+        return res;
+    }
+    if (errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR) {
+        return -1;
+    }
+    return -2;
 }
 
 ssize_t udpsocketsend(UDPSOCKET sockfd, const void *buf, size_t len,
@@ -92,6 +117,64 @@ ssize_t udpsocketsend(UDPSOCKET sockfd, const void *buf, size_t len,
     return sendto(sockfd, buf, len, 0, (struct sockaddr*)&addr, sizeof(addr));
 }
 
+ssize_t udpsocketrecv(UDPSOCKET sockfd, void *buf, size_t len, IPADDRESS *srcaddr, IPPORT *srcport)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+
+    ssize_t res = recvfrom(sockfd, buf, len, MSG_DONTWAIT, (struct sockaddr *)&addr, &addrlen);
+    if (res < 0) {
+        return -1;
+    }
+    *srcaddr = addr.sin_addr.s_addr;
+    *srcport = ntohs(addr.sin_port);
+    return res;
+}
+
+int udpsocketconnect(UDPSOCKET s, IPADDRESS destaddr, IPPORT destport)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = destaddr;
+    addr.sin_port = htons(destport);
+    return connect(s, (struct sockaddr *)&addr, sizeof(addr)) == 0 ? 0 : -1;
+}
+
+int udpsocketsetmulticastttl(UDPSOCKET s, uint8_t ttl)
+{
+    int value = ttl;
+    return setsockopt(s, IPPROTO_IP, IP_MULTICAST_TTL, &value, sizeof(value)) == 0 ? 0 : -1;
+}
+
+int udpsocketsendbatch(const udpsocket_msg_t *msgs, int count)
+{
+    for (int i = 0; i < count; i++) {
+        const udpsocket_msg_t *msg = &msgs[i];
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = msg->destaddr;
+        addr.sin_port = htons(msg->destport);
+
+        struct msghdr hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        if (msg->destaddr) {
+            hdr.msg_name = &addr;
+            hdr.msg_namelen = sizeof(addr);
+        }
+        hdr.msg_iov = (struct iovec *)msg->iov;
+        hdr.msg_iovlen = msg->iovcnt;
+        sendmsg(msg->socket, &hdr, MSG_DONTWAIT);
+    }
+    return count;
+}
+
+int udpsocketsetgso(int enable)
+{
+    return enable ? -1 : 0;
+}
+
 /**
    Read from a socket with a timeout.
 
@@ -121,6 +204,142 @@ int socketread(SOCKET sock, char *buf, size_t buflen, int timeoutmsec)
 }
 
 
+int socketrecv(SOCKET sock, char *buf, size_t buflen)
+{
+    int res = recv(sock, buf, buflen, MSG_DONTWAIT);
+    if (res > 0) {
+        return res;
+    } else if (res == 0) {
+        return 0; // client dropped connection
+    } else {
+        if (errno == EWOULDBLOCK || errno == EAGAIN) {
+            return -1;
+        }
+        return 0; // unknown error, just claim client dropped it
+    }
+}
+
+int socketsetnonblocking(SOCKET s)
+{
+    int flags = fcntl(s, F_GETFL, 0);
+    ERR_CHECK(flags >= 0, "fcntl(F_GETFL) failed", -1);
+    ERR_CHECK(fcntl(s, F_SETFL, flags | O_NONBLOCK) == 0, "fcntl(F_SETFL) failed", -1);
+    return 0;
+}
+
+typedef struct {
+    SOCKET s;
+    uint32_t events;
+    void *ctx;
+} socketpoll_item_t;
+
+struct socketpoll_t {
+    int count;
+    int capacity;
+    socketpoll_item_t items[];
+};
+
+socketpoll_t *socketpollcreate(int maxsockets)
+{
+    socketpoll_t *poll = (socketpoll_t *)calloc(1, sizeof(socketpoll_t) + maxsockets * sizeof(socketpoll_item_t));
+    ERR_CHECK(NULL != poll, "memory for socket poll is not enough", NULL);
+    poll->capacity = maxsockets;
+    return poll;
+}
+
+void socketpolldelete(socketpoll_t *poll)
+{
+    free(poll);
+}
+
+static socketpoll_item_t *socketpollfind(socketpoll_t *poll, SOCKET s)
+{
+    for (int i = 0; i < poll->count; i++) {
+        if (poll->items[i].s == s) {
+            return &poll->items[i];
+        }
+    }
+    return NULL;
+}
+
+int socketpolladd(socketpoll_t *poll, SOCKET s, uint32_t events, void *ctx)
+{
+    ERR_CHECK(poll->count < poll->capacity, "socket poll is full", -1);
+    ERR_CHECK(s < FD_SETSIZE, "socket exceeds FD_SETSIZE", -1);
+    socketpoll_item_t *item = &poll->items[poll->count++];
+    item->s = s;
+    item->events = events;
+    item->ctx = ctx;
+    return 0;
+}
+
+int socketpollmodify(socketpoll_t *poll, SOCKET s, uint32_t events, void *ctx)
+{
+    socketpoll_item_t *item = socketpollfind(poll, s);
+    ERR_CHECK(NULL != item, "socket is not registered", -1);
+    item->events = events;
+    item->ctx = ctx;
+    return 0;
+}
+
+int socketpollremove(socketpoll_t *poll, SOCKET s)
+{
+    socketpoll_item_t *item = socketpollfind(poll, s);
+    if (NULL == item) {
+        return -1;
+    }
+    // keep the array dense, order of the items doesn't matter
+    *item = poll->items[--poll->count];
+    return 0;
+}
+
+int socketpollwait(socketpoll_t *poll, socketpoll_event_t *events, int maxevents, int timeoutmsec)
+{
+    fd_set rfds, wfds;
+    int maxfd = -1;
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    for (int i = 0; i < poll->count; i++) {
+        socketpoll_item_t *item = &poll->items[i];
+        if (item->events & SOCKETPOLL_READ) {
+            FD_SET(item->s, &rfds);
+        }
+        if (item->events & SOCKETPOLL_WRITE) {
+            FD_SET(item->s, &wfds);
+        }
+        if (item->s > maxfd) {
+            maxfd = item->s;
+        }
+    }
+
+    struct timeval tv;
+    tv.tv_sec = timeoutmsec / 1000;
+    tv.tv_usec = (timeoutmsec % 1000) * 1000;
+    int res = select(maxfd + 1, &rfds, &wfds, NULL, timeoutmsec < 0 ? NULL : &tv);
+    if (res <= 0) {
+        return res;
+    }
+
+    int n = 0;
+    for (int i = 0; i < poll->count && n < maxevents; i++) {
+        socketpoll_item_t *item = &poll->items[i];
+        uint32_t ready = 0;
+        if (FD_ISSET(item->s, &rfds)) {
+            ready |= SOCKETPOLL_READ;
+        }
+        if (FD_ISSET(item->s, &wfds)) {
+            ready |= SOCKETPOLL_WRITE;
+        }
+        if (ready) {
+            events[n].ctx = item->ctx;
+            events[n].events = ready;
+            n++;
+        }
+    }
+    return n;
+}
+
+
 uint8_t *mem_swap32_copy(uint8_t *out, const uint8_t *in, uint32_t length)
 {
     if (length % 4) {
@@ -1,7 +1,14 @@
 #if __linux
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // sendmmsg
+#endif
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/random.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 
@@ -16,6 +23,14 @@ void closesocket(SOCKET s) {
     close(s);
 }
 
+uint32_t getrandom32(void) {
+    uint32_t r;
+    if (getrandom(&r, sizeof(r), 0) != sizeof(r)) {
+        return (uint32_t)rand(); // e.g. ENOSYS of a kernel older than 3.17
+    }
+    return r;
+}
+
 void socketpeeraddr(SOCKET s, IPADDRESS *addr, IPPORT *port) {
 
     sockaddr_in r;
@@ -30,7 +45,7 @@ void socketpeeraddr(SOCKET s, IPADDRESS *addr, IPPORT *port) {
 
         *port  = r.sin_port;
         *addr = r.sin_addr.s_addr;
-        printf("ip=%d,p=%d\n", *addr, *port);
+        // printf("ip=%d,p=%d\n", *addr, *port);
     }
 }
 
@@ -65,7 +80,28 @@ UDPSOCKET udpsocketcreate(unsigned short portNum)
 ssize_t socketsend(SOCKET sockfd, const void *buf, size_t len)
 {
     // printf("TCP send\n");
-    return send(sockfd, buf, len, 0);
+    ssize_t res = send(sockfd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (res >= 0) {
+        return res;
+    }
+    if (errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR)
+        return -1;
+    return -2;
+}
+
+ssize_t socketsendv(SOCKET sockfd, const struct iovec *iov, int iovcnt)
+{
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = (struct iovec *)iov;
+    hdr.msg_iovlen = iovcnt;
+    ssize_t res = sendmsg(sockfd, &hdr, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (res >= 0) {
+        return res;
+    }
+    if (errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR)
+        return -1;
+    return -2;
 }
 
 ssize_t udpsocketsend(UDPSOCKET sockfd, const void *buf, size_t len,
@@ -81,6 +117,187 @@ ssize_t udpsocketsend(UDPSOCKET sockfd, const void *buf, size_t len,
     return sendto(sockfd, buf, len, 0, (sockaddr *) &addr, sizeof(addr));
 }
 
+ssize_t udpsocketrecv(UDPSOCKET sockfd, void *buf, size_t len, IPADDRESS *srcaddr, IPPORT *srcport)
+{
+    sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+
+    ssize_t res = recvfrom(sockfd, buf, len, MSG_DONTWAIT, (sockaddr *)&addr, &addrlen);
+    if (res < 0) {
+        return -1;
+    }
+    *srcaddr = addr.sin_addr.s_addr;
+    *srcport = ntohs(addr.sin_port);
+    return res;
+}
+
+#define UDPSOCKET_BATCH_MAX 64 // messages of one sendmmsg
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103 // since linux 4.18
+#endif
+#define UDPSOCKET_GSO_MAX_SEGMENTS 64     // UDP_MAX_SEGMENTS of the kernel
+#define UDPSOCKET_GSO_MAX_BYTES    63000  // stay below the 64K limit of one UDP send
+
+static int s_udp_gso = 0;
+
+int udpsocketsetgso(int enable)
+{
+    s_udp_gso = enable;
+    return 0;
+}
+
+static size_t udpsocketmsglen(const udpsocket_msg_t *msg)
+{
+    size_t len = 0;
+    for (int i = 0; i < msg->iovcnt; i++) {
+        len += msg->iov[i].iov_len;
+    }
+    return len;
+}
+
+static int udpsocketsame(const udpsocket_msg_t *a, const udpsocket_msg_t *b)
+{
+    return a->socket == b->socket && a->destaddr == b->destaddr && a->destport == b->destport;
+}
+
+/**
+   Count the leading datagrams which can go in one GSO send:
+   same destination, all of the size of the first one except a shorter last one
+ */
+static int udpsocketgsorun(const udpsocket_msg_t *msgs, int count)
+{
+    size_t seg = udpsocketmsglen(&msgs[0]);
+    size_t bytes = 0;
+    int n = 0;
+    while (n < count && n < UDPSOCKET_GSO_MAX_SEGMENTS && udpsocketsame(&msgs[0], &msgs[n])) {
+        size_t len = udpsocketmsglen(&msgs[n]);
+        if (len > seg || bytes + len > UDPSOCKET_GSO_MAX_BYTES) {
+            break;
+        }
+        bytes += len;
+        n++;
+        if (len < seg) {
+            break; // only the last segment may be shorter
+        }
+    }
+    return n;
+}
+
+/**
+   Send datagrams as one buffer which the kernel splits at the size of the first one
+
+   Return 0 on success, -1 on error with errno set
+ */
+static int udpsocketsendgso(const udpsocket_msg_t *msgs, int n)
+{
+    struct iovec iov[UDPSOCKET_GSO_MAX_SEGMENTS * UDPSOCKET_MSG_IOV];
+    int iovcnt = 0;
+    for (int i = 0; i < n; i++) {
+        memcpy(&iov[iovcnt], msgs[i].iov, msgs[i].iovcnt * sizeof(struct iovec));
+        iovcnt += msgs[i].iovcnt;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = msgs[0].destaddr;
+    addr.sin_port = htons(msgs[0].destport);
+
+    char control[CMSG_SPACE(sizeof(uint16_t))];
+    memset(control, 0, sizeof(control));
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    if (msgs[0].destaddr) {
+        hdr.msg_name = &addr;
+        hdr.msg_namelen = sizeof(addr);
+    }
+    hdr.msg_iov = iov;
+    hdr.msg_iovlen = iovcnt;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&hdr);
+    cm->cmsg_level = SOL_UDP;
+    cm->cmsg_type = UDP_SEGMENT;
+    cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    uint16_t seg = udpsocketmsglen(&msgs[0]);
+    memcpy(CMSG_DATA(cm), &seg, sizeof(seg));
+
+    return sendmsg(msgs[0].socket, &hdr, MSG_DONTWAIT) < 0 ? -1 : 0;
+}
+
+int udpsocketconnect(UDPSOCKET s, IPADDRESS destaddr, IPPORT destport)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = destaddr;
+    addr.sin_port = htons(destport);
+    return connect(s, (struct sockaddr *)&addr, sizeof(addr)) == 0 ? 0 : -1;
+}
+
+int udpsocketsetmulticastttl(UDPSOCKET s, uint8_t ttl)
+{
+    int value = ttl;
+    return setsockopt(s, IPPROTO_IP, IP_MULTICAST_TTL, &value, sizeof(value)) == 0 ? 0 : -1;
+}
+
+int udpsocketsendbatch(const udpsocket_msg_t *msgs, int count)
+{
+    struct mmsghdr hdrs[UDPSOCKET_BATCH_MAX];
+    struct sockaddr_in addrs[UDPSOCKET_BATCH_MAX];
+    int calls = 0;
+    int i = 0;
+
+    while (i < count) {
+        if (s_udp_gso) {
+            int n = udpsocketgsorun(msgs + i, count - i);
+            if (n > 1) {
+                int res = udpsocketsendgso(msgs + i, n);
+                calls++;
+                if (0 == res || (errno != EIO && errno != EINVAL && errno != ENOPROTOOPT && errno != EOPNOTSUPP)) {
+                    i += n; // sent, or dropped like any datagram which can't be sent
+                    continue;
+                }
+                // kernel or device without UDP GSO, go on with sendmmsg
+                printf("UDP GSO refused (errno=%d), fall back to sendmmsg\n", errno);
+                s_udp_gso = 0;
+            }
+        }
+
+        UDPSOCKET s = msgs[i].socket;
+        int n = 0;
+        while (i + n < count && n < UDPSOCKET_BATCH_MAX && msgs[i + n].socket == s) {
+            const udpsocket_msg_t *msg = &msgs[i + n];
+            memset(&addrs[n], 0, sizeof(addrs[n]));
+            addrs[n].sin_family = AF_INET;
+            addrs[n].sin_addr.s_addr = msg->destaddr;
+            addrs[n].sin_port = htons(msg->destport);
+            memset(&hdrs[n], 0, sizeof(hdrs[n]));
+            if (msg->destaddr) {
+                hdrs[n].msg_hdr.msg_name = &addrs[n];
+                hdrs[n].msg_hdr.msg_namelen = sizeof(addrs[n]);
+            }
+            hdrs[n].msg_hdr.msg_iov = (struct iovec *)msg->iov;
+            hdrs[n].msg_hdr.msg_iovlen = msg->iovcnt;
+            n++;
+        }
+
+        int sent = sendmmsg(s, hdrs, n, MSG_DONTWAIT);
+        calls++;
+        if (sent < 0) {
+            sent = 0;
+        }
+        // the message after the sent ones failed, drop it and go on with the rest
+        i += (sent < n) ? sent + 1 : n;
+    }
+    return calls;
+}
+
 /**
    Read from a socket with a timeout.
 
@@ -109,4 +326,109 @@ int socketread(SOCKET sock, char *buf, size_t buflen, int timeoutmsec)
     };
 }
 
+int socketrecv(SOCKET sock, char *buf, size_t buflen)
+{
+    int res = recv(sock, buf, buflen, MSG_DONTWAIT);
+    if (res > 0) {
+        return res;
+    } else if (res == 0) {
+        return 0; // client dropped connection
+    } else {
+        if (errno == EWOULDBLOCK || errno == EAGAIN)
+            return -1;
+        else
+            return 0; // unknown error, just claim client dropped it
+    }
+}
+
+int socketsetnonblocking(SOCKET s)
+{
+    int flags = fcntl(s, F_GETFL, 0);
+    if (flags < 0 || fcntl(s, F_SETFL, flags | O_NONBLOCK) != 0) {
+        printf("set nonblocking failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+struct socketpoll_t {
+    int epfd;
+};
+
+static uint32_t socketpollevents(uint32_t events)
+{
+    uint32_t ev = 0;
+    if (events & SOCKETPOLL_READ)
+        ev |= EPOLLIN;
+    if (events & SOCKETPOLL_WRITE)
+        ev |= EPOLLOUT;
+    return ev;
+}
+
+socketpoll_t *socketpollcreate(int maxsockets)
+{
+    (void)maxsockets; // epoll has no fixed capacity
+    socketpoll_t *poll = (socketpoll_t *)calloc(1, sizeof(socketpoll_t));
+    if (NULL == poll) {
+        return NULL;
+    }
+    poll->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (poll->epfd < 0) {
+        printf("epoll create failed\n");
+        free(poll);
+        return NULL;
+    }
+    return poll;
+}
+
+void socketpolldelete(socketpoll_t *poll)
+{
+    close(poll->epfd);
+    free(poll);
+}
+
+int socketpolladd(socketpoll_t *poll, SOCKET s, uint32_t events, void *ctx)
+{
+    struct epoll_event ev;
+    ev.events = socketpollevents(events);
+    ev.data.ptr = ctx;
+    return epoll_ctl(poll->epfd, EPOLL_CTL_ADD, s, &ev);
+}
+
+int socketpollmodify(socketpoll_t *poll, SOCKET s, uint32_t events, void *ctx)
+{
+    struct epoll_event ev;
+    ev.events = socketpollevents(events);
+    ev.data.ptr = ctx;
+    return epoll_ctl(poll->epfd, EPOLL_CTL_MOD, s, &ev);
+}
+
+int socketpollremove(socketpoll_t *poll, SOCKET s)
+{
+    struct epoll_event ev; // non-NULL for kernels before 2.6.9
+    return epoll_ctl(poll->epfd, EPOLL_CTL_DEL, s, &ev);
+}
+
+int socketpollwait(socketpoll_t *poll, socketpoll_event_t *events, int maxevents, int timeoutmsec)
+{
+    struct epoll_event ev[32];
+    if (maxevents > (int)(sizeof(ev) / sizeof(ev[0])))
+        maxevents = sizeof(ev) / sizeof(ev[0]);
+
+    int n = epoll_wait(poll->epfd, ev, maxevents, timeoutmsec);
+    if (n < 0) {
+        return (errno == EINTR) ? 0 : -1;
+    }
+    for (int i = 0; i < n; i++) {
+        events[i].ctx = ev[i].data.ptr;
+        events[i].events = 0;
+        // errors and hangups are reported as readable so that recv() observes them
+        if (ev[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            events[i].events |= SOCKETPOLL_READ;
+        if (ev[i].events & EPOLLOUT)
+            events[i].events |= SOCKETPOLL_WRITE;
+    }
+    return n;
+}
+
 #endif
\ No newline at end of file
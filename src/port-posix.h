@@ -1,6 +1,7 @@
 #pragma once
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
@@ -9,6 +10,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -24,7 +26,22 @@ typedef uint16_t IPPORT; // on linux use network byte order
 
 void closesocket(SOCKET s);
 
-#define GET_RANDOM() rand()
+/**
+ * Random number from the kernel, e.g. for Session IDs which must not be guessed
+ */
+uint32_t getrandom32(void);
+
+#define GET_RANDOM() getrandom32()
+
+#define SOCKETPOLL_READ   0x01
+#define SOCKETPOLL_WRITE  0x02
+
+typedef struct {
+    void *ctx;        // context registered together with the socket
+    uint32_t events;  // SOCKETPOLL_xxx which are ready
+} socketpoll_event_t;
+
+typedef struct socketpoll_t socketpoll_t;
 
 void socketpeeraddr(SOCKET s, IPADDRESS *addr, IPPORT *port);
 
@@ -32,10 +49,71 @@ void udpsocketclose(UDPSOCKET s);
 
 UDPSOCKET udpsocketcreate(unsigned short portNum);
 
-// TCP sending
+/**
+   Fix the destination of a UDP socket, datagrams are then sent with a zero destaddr.
+
+   Return 0 on success, -1 on error
+ */
+int udpsocketconnect(UDPSOCKET s, IPADDRESS destaddr, IPPORT destport);
+
+/**
+   Set the time to live of multicast datagrams sent by the socket
+
+   Return 0 on success, -1 on error
+ */
+int udpsocketsetmulticastttl(UDPSOCKET s, uint8_t ttl);
+
+/**
+   TCP sending without blocking, may send only part of buf.
+
+   Return >=0 number of bytes sent, -1=would block, -2=error
+ */
 ssize_t socketsend(SOCKET sockfd, const void *buf, size_t len);
+
+/**
+   Gathering version of socketsend(), the buffers are sent as one stream of bytes
+ */
+ssize_t socketsendv(SOCKET sockfd, const struct iovec *iov, int iovcnt);
 ssize_t udpsocketsend(UDPSOCKET sockfd, const void *buf, size_t len,
                              IPADDRESS destaddr, uint16_t destport);
+
+/**
+   Read one datagram without blocking.
+
+   Return >=0 size of the datagram, -1 no datagram available
+ */
+ssize_t udpsocketrecv(UDPSOCKET sockfd, void *buf, size_t len, IPADDRESS *srcaddr, IPPORT *srcport);
+
+#define UDPSOCKET_MSG_IOV 3 // e.g. RTP header, payload header and payload
+
+/**
+   One datagram of a batch, gathered from up to UDPSOCKET_MSG_IOV buffers.
+   A zero destaddr sends to the address the socket is connected to.
+ */
+typedef struct {
+    UDPSOCKET socket;
+    IPADDRESS destaddr;
+    IPPORT destport;
+    int iovcnt;
+    struct iovec iov[UDPSOCKET_MSG_IOV];
+} udpsocket_msg_t;
+
+/**
+   Send datagrams without blocking, consecutive ones of the same socket go in one sendmmsg().
+   A datagram which can't be sent is dropped.
+
+   Return number of send calls made
+ */
+int udpsocketsendbatch(const udpsocket_msg_t *msgs, int count);
+
+/**
+   Let udpsocketsendbatch() send runs of equal size datagrams to the same destination
+   with one UDP_SEGMENT send, the kernel splits them. Falls back to sendmmsg() by itself
+   when the kernel refuses it.
+
+   Return 0 on success, -1 not supported
+ */
+int udpsocketsetgso(int enable);
 /**
    Read from a socket with a timeout.
 
@@ -43,6 +121,29 @@ ssize_t udpsocketsend(UDPSOCKET sockfd, const void *buf, size_t len,
  */
 int socketread(SOCKET sock, char *buf, size_t buflen, int timeoutmsec);
 
+/**
+   Read from a socket without blocking.
+
+   Return 0=socket was closed by client, -1=no data available, >0 number of bytes read
+ */
+int socketrecv(SOCKET sock, char *buf, size_t buflen);
+
+int socketsetnonblocking(SOCKET s);
+
+// socket readiness reactor, built on epoll
+socketpoll_t *socketpollcreate(int maxsockets);
+void socketpolldelete(socketpoll_t *poll);
+int socketpolladd(socketpoll_t *poll, SOCKET s, uint32_t events, void *ctx);
+int socketpollmodify(socketpoll_t *poll, SOCKET s, uint32_t events, void *ctx);
+int socketpollremove(socketpoll_t *poll, SOCKET s);
+
+/**
+   Wait until at least one registered socket is ready or timeout elapses.
+
+   Return number of events filled, 0=timeout, <0 error
+ */
+int socketpollwait(socketpoll_t *poll, socketpoll_event_t *events, int maxevents, int timeoutmsec);
+
 #ifdef __cplusplus
 }
 #endif
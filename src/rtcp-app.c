@@ -3,28 +3,15 @@
 #include "rtcp-internal.h"
 #include "rtp-util.h"
 
-// void rtcp_app_unpack(rtp_session_t *session, rtcp_hdr_t *header, const uint8_t* ptr)
-// {
-// 	struct rtcp_msg_t msg;
-// 	rtp_member *member;
-
-// 	if (header->length * 4 < 8) // RTCP header + SSRC + name
-// 	{
-// 		assert(0);
-// 		return;
-// 	}
-
-// 	msg.type = RTCP_MSG_APP;
-// 	msg.u.app.ssrc = nbo_r32(ptr);
-
-// 	member = rtp_member_fetch(session, msg.u.app.ssrc);
-// 	if(!member) return; // error	
-
-// 	memcpy(msg.u.app.name, ptr+4, 4);
-// 	msg.u.app.data = (void*)(ptr + 8);
-// 	msg.u.app.bytes = header->length * 4 - 8;
-	
-// }
+void rtcp_app_unpack(rtp_session_t *session, rtcp_hdr_t *header, const uint8_t* ptr)
+{
+	if (header->length * 4 < 8) // RTCP header + SSRC + name
+		return; // malformed
+
+	// application defined data is not used, only the member is learned
+	if (nbo_r32(ptr) != session->self->ssrc)
+		rtp_member_fetch(session, nbo_r32(ptr));
+}
 
 // int rtcp_app_pack(rtp_session_t *session, uint8_t* ptr, int bytes, const char name[4], const void* app, int len)
 // {
@@ -14,6 +14,12 @@
 #include "rtp-member-list.h"
 #include "rtp.h"
 
+#define RTCP_LOWER_HEADER_SIZE 28 /* IPv4 and UDP headers, counted in avg_rtcp_size (RFC3550 6.2) */
+
+enum { 
+	RTP_SENDER		= 1,	/// send RTP packet
+	RTP_RECEIVER	= 2,	/// receive RTP packet
+};
 
 
 rtp_member* rtp_sender_fetch(rtp_session_t *session, uint32_t ssrc);
@@ -34,6 +40,34 @@ void rtcp_bye_unpack(rtp_session_t *session, rtcp_hdr_t *header, const uint8_t*
 void rtcp_app_unpack(rtp_session_t *session, rtcp_hdr_t *header, const uint8_t* data);
 
 int rtcp_report_block(rtp_member* sender, uint8_t* ptr, int bytes);
+void rtcp_report_block_unpack(rtp_session_t *session, rtp_member* reporter, const uint8_t* ptr);
+
+/// @param avg_rtcp_size in 1/16 octets
+/// @return interval in milliseconds
+int rtcp_interval(int members, int senders, int rtcp_bw, int we_sent, int avg_rtcp_size, int initial);
+int rtcp_interval_deterministic(int members, int senders, int rtcp_bw, int we_sent, int avg_rtcp_size, int initial);
+
+/// RFC3550 A.8 J += (|D| - J)/16, in 1/16 timestamp units
+static inline uint32_t rtcp_jitter_update(uint32_t jitter, int d)
+{
+	return jitter + (d < 0 ? -d : d) - ((jitter + 8) >> 4);
+}
+
+/// RFC3550 6.3.3 avg_rtcp_size += (size - avg_rtcp_size)/16, in 1/16 octets
+static inline int rtcp_avg_size_update(int avg_rtcp_size, int size)
+{
+	return avg_rtcp_size + size - ((avg_rtcp_size + 8) >> 4);
+}
+
+/// @param delay in microseconds
+/// @return in 1/65536 seconds, 65536/1000000 == 1024/15625
+static inline uint32_t rtcp_dlsr(uint64_t delay)
+{
+	return (uint32_t)(delay * 1024 / 15625);
+}
+
+void rtcp_expire_members(rtp_session_t *session, uint64_t clock);
+void rtcp_reconsider_reverse(rtp_session_t *session, uint64_t clock);
 
 uint64_t rtpclock(void);
 uint64_t ntp2clock(uint64_t ntp);
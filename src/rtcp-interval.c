@@ -1,34 +1,28 @@
 // RFC3550 A.7 Computing the RTCP Transmission Interval (p74)
+// in integer milliseconds, the targets may have no FPU
 
-#define _CRT_RAND_S
 #include <stdlib.h>
+#include <stdint.h>
 
-#if defined(OS_WINDOWS)
-#include <limits.h>
-double drand48(void)
-{
-	unsigned int v = 0;
-	rand_s(&v);
-	return (v * 1.0) / UINT_MAX;
-}
-#endif
+// 1/(e-3/2) in 1/32768
+#define RTCP_COMPENSATION_Q15 26898
 
-double rtcp_interval(int members,
+int rtcp_interval_deterministic(int members,
 					int senders,
-					double rtcp_bw,
+					int rtcp_bw,
 					int we_sent,
-					double avg_rtcp_size,
+					int avg_rtcp_size,
 					int initial)
 {
 	/*
 	* Minimum average time between RTCP packets from this site (in
-	* seconds). This time prevents the reports from `clumping' when
+	* milliseconds). This time prevents the reports from `clumping' when
 	* sessions are small and the law of large numbers isn't helping
 	* to smooth out the traffic. It also keeps the report interval
 	* from becoming ridiculously small during transient outages like
 	* a network partition.
 	*/
-	double const RTCP_MIN_TIME = 5.0;
+	int const RTCP_MIN_TIME = 5000;
 
 	/*
 	* Fraction of the RTCP bandwidth to be shared among active
@@ -37,17 +31,10 @@ double rtcp_interval(int members,
 	* time would be roughly equal to the minimum report time so that
 	* we don't unnecessarily slow down receiver reports.) The
 	* receiver fraction must be 1 - the sender fraction.
+	* Here 1/4 and 3/4, applied to the interval as num/den below.
 	*/
-	double const RTCP_SENDER_BW_FRACTION = 0.25;
-	double const RTCP_RCVR_BW_FRACTION = (1-RTCP_SENDER_BW_FRACTION);
-
-	/*
-	* To compensate for "timer reconsideration" converging to a
-	* value below the intended average.
-	*/
-	double const COMPENSATION = 2.71828 - 1.5;
-	double t; /* interval */
-	double rtcp_min_time = RTCP_MIN_TIME;
+	uint64_t num, den;
+	int rtcp_min_time = RTCP_MIN_TIME;
 	int n; /* no. of members for computation */
 
 	/*
@@ -67,12 +54,14 @@ double rtcp_interval(int members,
 	* more than that fraction.
 	*/
 	n = members;
-	if (senders <= members * RTCP_SENDER_BW_FRACTION) {
+	num = 4;
+	den = 4;
+	if (senders * 4 <= members) {
 		if (we_sent) {
-			rtcp_bw *= RTCP_SENDER_BW_FRACTION;
+			den = 1;
 			n = senders;
 		} else {
-			rtcp_bw *= RTCP_RCVR_BW_FRACTION;
+			den = 3;
 			n -= senders;
 		}
 	}
@@ -86,15 +75,69 @@ double rtcp_interval(int members,
 	* time interval we send one report so this time is also our
 	* average time between reports.
 	*/
-	t = avg_rtcp_size * n / rtcp_bw;
-	if (t < rtcp_min_time) t = rtcp_min_time;
+	// avg_rtcp_size is in 1/16 octets
+	if (rtcp_bw <= 0)
+		return rtcp_min_time;
+	num *= (uint64_t)avg_rtcp_size * n * 1000;
+	den *= (uint64_t)rtcp_bw * 16;
+	if (num / den < (uint64_t)rtcp_min_time)
+		return rtcp_min_time;
+	return (int)(num / den);
+}
+
+int rtcp_interval(int members,
+					int senders,
+					int rtcp_bw,
+					int we_sent,
+					int avg_rtcp_size,
+					int initial)
+{
+	/*
+	* To compensate for "timer reconsideration" converging to a
+	* value below the intended average.
+	*/
+	uint64_t t; /* interval */
+
+	t = rtcp_interval_deterministic(members, senders, rtcp_bw, we_sent, avg_rtcp_size, initial);
 
 	/*
 	* To avoid traffic bursts from unintended synchronization with
 	* other sites, we then pick our actual next report interval as a
 	* random number uniformly distributed between 0.5*t and 1.5*t.
 	*/
-	t = t * (drand48() + 0.5);
-	t = t / COMPENSATION;
-	return t;
+	t = t * (16384 + (rand() & 0x7FFF)); // (0.5 + [0, 1)) in 1/32768
+	t = t * RTCP_COMPENSATION_Q15 >> 30;
+	return (int)t;
 }
+
+#if defined(_DEBUG) || defined(DEBUG)
+#include <assert.h>
+// same intervals as the floating-point code of RFC3550 A.7, within the 1ms rounding
+void rtcp_interval_test(void)
+{
+	static const int cases[][4] = { /* members, senders, we_sent, avg size */
+		{ 2, 1, 1, 100 }, { 2, 1, 0, 100 }, { 50, 1, 1, 120 }, { 50, 1, 0, 120 },
+		{ 300, 2, 0, 90 }, { 300, 200, 0, 90 }, { 1000, 3, 1, 200 },
+	};
+	int i, t, bw;
+	double rtcp_bw, expected;
+
+	for (i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); i++) {
+		for (bw = 100; bw <= 100000; bw *= 10) {
+			rtcp_bw = bw;
+			if (cases[i][1] <= cases[i][0] * 0.25) {
+				rtcp_bw *= cases[i][2] ? 0.25 : 0.75;
+				expected = (double)cases[i][3] * (cases[i][2] ? cases[i][1] : cases[i][0] - cases[i][1]) / rtcp_bw;
+			} else {
+				expected = (double)cases[i][3] * cases[i][0] / rtcp_bw;
+			}
+			if (expected < 5.0) expected = 5.0;
+
+			t = rtcp_interval_deterministic(cases[i][0], cases[i][1], bw, cases[i][2], cases[i][3] * 16, 0);
+			assert(t <= expected * 1000 && t > expected * 1000 - 1);
+			t = rtcp_interval(cases[i][0], cases[i][1], bw, cases[i][2], cases[i][3] * 16, 0);
+			assert(t >= expected * 1000 * 0.5 / 1.21828 - 1 && t < expected * 1000 * 1.5 / 1.21828);
+		}
+	}
+}
+#endif
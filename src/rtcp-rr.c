@@ -1,26 +1,26 @@
 // RFC3550 6.4.2 RR: Receiver Report RTCP Packet
 
+#include <stddef.h>
 #include "rtcp-internal.h"
 #include "rtp-util.h"
 
 void rtcp_rr_unpack(rtp_session_t *session, rtcp_hdr_t *header, const uint8_t* ptr)
 {
 	uint32_t ssrc, i;
-	rtcp_rb_t *rb;
 	rtp_member *receiver;
 
-	assert(24 == sizeof(rtcp_rb_t) && 4 == sizeof(rtcp_rr_t));
+	assert(24 == sizeof(rtcp_rb_t) && 4 == offsetof(rtcp_rr_t, rr));
 	if (header->length * 4 < 4/*sizeof(rtcp_rr_t)*/ + header->count * 24/*sizeof(rtcp_rb_t)*/) // RR SSRC + Report Block
 	{
-		assert(0);
-		return;
+		return; // malformed
 	}
 	ssrc = nbo_r32(ptr);
+	if(ssrc == session->self->ssrc)
+		return; // collision or loop, ignored
 
 	receiver = rtp_member_fetch(session, ssrc);
 	if(!receiver) return; // error
 
-	assert(receiver != session->self);
 	assert(receiver->rtcp_sr.ssrc == ssrc);
 	assert(receiver->rtcp_rb.ssrc == ssrc);
 	receiver->rtcp_clock = rtpclock(); // last received clock, for keep-alive
@@ -33,13 +33,7 @@ void rtcp_rr_unpack(rtp_session_t *session, rtcp_hdr_t *header, const uint8_t* p
 		if(ssrc != session->self->ssrc)
 			continue; // ignore
 
-		rb = &receiver->rtcp_rb;
-		rb->fraction = ptr[4];
-		rb->cumulative = (((uint32_t)ptr[5])<<16) | (((uint32_t)ptr[6])<<8)| ptr[7];
-		rb->exthsn = nbo_r32(ptr+8);
-		rb->jitter = nbo_r32(ptr+12);
-		rb->lsr = nbo_r32(ptr+16);
-		rb->dlsr = nbo_r32(ptr+20);
+		rtcp_report_block_unpack(session, receiver, ptr);
 	}
 }
 
@@ -54,7 +48,6 @@ int rtcp_rr_pack(rtp_session_t *session, uint8_t* ptr, int bytes)
 
 	assert(4 == sizeof(rtcp_rr_t));
 	assert(24 == sizeof(rtcp_rb_t));
-	assert(rtp_member_list_count(session->senders) < 32);
 	header.v = 2;
 	header.p = 0;
 	header.pt = RTCP_RR;
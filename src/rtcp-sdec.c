@@ -12,7 +12,6 @@ void rtcp_sdes_unpack(rtp_session_t *session, rtcp_hdr_t *header, const uint8_t*
 
 	p = ptr;
 	end = ptr + header->length * 4;
-	assert(header->length >= header->count);
 
 	for(i = 0; i < header->count && p + 8 /*4-ssrc + 1-PT*/ <= end; i++)
 	{
@@ -30,8 +29,7 @@ void rtcp_sdes_unpack(rtp_session_t *session, rtcp_hdr_t *header, const uint8_t*
 			item.data = (unsigned char*)(p+2);
 			if (p + 2 + item.len > end)
 			{
-				assert(0);
-				return; // error
+				return; // malformed
 			}
 
 			switch(item.pt)
@@ -46,12 +44,8 @@ void rtcp_sdes_unpack(rtp_session_t *session, rtcp_hdr_t *header, const uint8_t*
 				rtp_member_setvalue(member, item.pt, item.data, item.len);
 				break;
 
-			case RTCP_SDES_PRIVATE:
-				assert(0);
-				break;
-
 			default:
-				assert(0);
+				break; // private or unknown items are ignored
 			}
 
 			// RFC3550 6.5 SDES: Source Description RTCP Packet
@@ -66,7 +60,7 @@ void rtcp_sdes_unpack(rtp_session_t *session, rtcp_hdr_t *header, const uint8_t*
 		// No length octet follows the null item type octet, 
 		// but additional null octets must be included if needed to pad until the next 32-bit boundary.
 		// offset sizeof(SSRC) + sizeof(chunk type) + sizeof(chunk length)
-		p = (const unsigned char *)((p - (const unsigned char *)0 + 3) / 4 * 4);
+		p = ptr + (p - ptr) / 4 * 4 + 4;
 	}
 }
 
@@ -1,5 +1,6 @@
 // RFC3550 6.4.1 SR: Sender Report RTCP Packet
 
+#include <stddef.h>
 #include "rtcp-internal.h"
 #include "rtp-util.h"
 
@@ -7,22 +8,21 @@ void rtcp_sr_unpack(rtp_session_t *session, rtcp_hdr_t *header, const uint8_t* p
 {
 	uint32_t ssrc, i;
 	rtcp_sr_t *sr;
-	rtcp_rb_t *rb;
 	rtp_member *sender;
 
-	assert(24 == sizeof(rtcp_sr_t));
+	assert(24 == offsetof(rtcp_sr_t, rr)); // the report blocks follow the sender info
 	assert(24 == sizeof(rtcp_rb_t));
 	if (header->length * 4 < 24/*sizeof(rtcp_sr_t)*/ + header->count * 24/*sizeof(rtcp_rb_t)*/)
 	{
-		assert(0);
-		return;
+		return; // malformed
 	}
 	ssrc = nbo_r32(ptr);
+	if(ssrc == session->self->ssrc)
+		return; // collision or loop, ignored
 
 	sender = rtp_sender_fetch(session, ssrc);
 	if(!sender) return; // error
 
-	assert(sender != session->self);
 	assert(sender->rtcp_sr.ssrc == ssrc);
 	assert(sender->rtcp_rb.ssrc == ssrc);
 	sender->rtcp_clock = rtpclock();
@@ -43,13 +43,7 @@ void rtcp_sr_unpack(rtp_session_t *session, rtcp_hdr_t *header, const uint8_t* p
 		if(ssrc != session->self->ssrc)
 			continue; // ignore
 
-		rb = &sender->rtcp_rb;
-		rb->fraction = ptr[4];
-		rb->cumulative = (((uint32_t)ptr[5])<<16) | (((uint32_t)ptr[6])<<8)| ptr[7];
-		rb->exthsn = nbo_r32(ptr+8);
-		rb->jitter = nbo_r32(ptr+12);
-		rb->lsr = nbo_r32(ptr+16);
-		rb->dlsr = nbo_r32(ptr+20);
+		rtcp_report_block_unpack(session, sender, ptr);
 	}
 }
 
@@ -59,9 +53,8 @@ int rtcp_sr_pack(rtp_session_t *session, uint8_t* ptr, int bytes)
 	uint64_t ntp;
 	rtcp_hdr_t header;
 
-	assert(24 == sizeof(rtcp_sr_t));
+	assert(24 == offsetof(rtcp_sr_t, rr));
 	assert(24 == sizeof(rtcp_rb_t));
-	assert(rtp_member_list_count(session->senders) < 32);
 	header.v = 2;
 	header.p = 0;
 	header.pt = RTCP_SR;
@@ -146,9 +139,7 @@ int rtcp_report_block(rtp_member* sender, uint8_t* ptr, int bytes)
 
 	delay = rtpclock() - sender->rtcp_clock; // now - Last SR time
 	lsr = ((sender->rtcp_sr.ntpmsw & 0xFFFF) << 16) | ((sender->rtcp_sr.ntplsw >> 16) & 0xFFFF);
-	// in units of 1/65536 seconds
-	// 65536/1000000 == 1024/15625
-	dlsr = (uint32_t)(delay / 1000000.0f * 65536);
+	dlsr = rtcp_dlsr(delay); // in units of 1/65536 seconds
 
 	nbo_w32(ptr, sender->ssrc);
 	ptr[4] = (unsigned char)fraction;
@@ -156,7 +147,7 @@ int rtcp_report_block(rtp_member* sender, uint8_t* ptr, int bytes)
 	ptr[6] = (unsigned char)((lost >> 8) & 0xFF);
 	ptr[7] = (unsigned char)(lost & 0xFF);
 	nbo_w32(ptr + 8, extseq);
-	nbo_w32(ptr + 12, (uint32_t)sender->jitter);
+	nbo_w32(ptr + 12, sender->jitter >> 4);
 	nbo_w32(ptr + 16, lsr);
 	nbo_w32(ptr + 20, 0 == lsr ? 0 : dlsr);
 
@@ -165,3 +156,70 @@ int rtcp_report_block(rtp_member* sender, uint8_t* ptr, int bytes)
 
 	return 24; /*sizeof(rtcp_rb_t)*/
 }
+
+// keep the report in the quality record of the reporter, loss rate from the oldest to the newest report
+static void rtcp_report_block_qos(rtp_session_t *session, rtp_member* reporter)
+{
+	int32_t lost;
+	uint32_t expected;
+	rtcp_rb_t *rb;
+	rtp_qos_t *qos;
+	rtp_qos_sample_t *sample, *oldest;
+
+	rb = &reporter->rtcp_rb;
+	qos = &reporter->qos;
+	if(qos->count > 0)
+		qos->head = (qos->head + 1) % RTP_QOS_HISTORY;
+	if(qos->count < RTP_QOS_HISTORY)
+		qos->count++;
+
+	sample = &qos->history[qos->head];
+	sample->time_ms = (uint32_t)(rtpclock() / 1000);
+	sample->exthsn = rb->exthsn;
+	// 24-bit signed
+	sample->cumulative = (int32_t)((uint32_t)rb->cumulative << 8) >> 8;
+	sample->rtt_us = 0 == rb->lsr ? 0 : (uint32_t)(((uint64_t)reporter->rtt * 1000000) >> 16);
+	sample->jitter_us = session->frequence > 0 ? (uint32_t)((uint64_t)rb->jitter * 1000000 / session->frequence) : 0;
+	sample->fraction = (uint8_t)rb->fraction;
+
+	qos->reports++;
+	qos->rtt_us = sample->rtt_us;
+	qos->jitter_us = sample->jitter_us;
+	qos->lost = sample->cumulative;
+
+	oldest = &qos->history[(qos->head + RTP_QOS_HISTORY + 1 - qos->count) % RTP_QOS_HISTORY];
+	expected = sample->exthsn - oldest->exthsn;
+	lost = sample->cumulative - oldest->cumulative;
+	if(oldest == sample)
+		qos->loss_permille = sample->fraction * 1000 / 256;
+	else if(0 == expected || lost <= 0)
+		qos->loss_permille = 0;
+	else
+		qos->loss_permille = (uint32_t)((uint64_t)lost * 1000 / expected);
+}
+
+void rtcp_report_block_unpack(rtp_session_t *session, rtp_member* reporter, const uint8_t* ptr)
+{
+	uint32_t ntp;
+	int32_t rtt;
+	rtcp_rb_t *rb;
+
+	rb = &reporter->rtcp_rb;
+	rb->fraction = ptr[4];
+	rb->cumulative = (((uint32_t)ptr[5])<<16) | (((uint32_t)ptr[6])<<8)| ptr[7];
+	rb->exthsn = nbo_r32(ptr+8);
+	rb->jitter = nbo_r32(ptr+12);
+	rb->lsr = nbo_r32(ptr+16);
+	rb->dlsr = nbo_r32(ptr+20);
+
+	// RFC3550 6.4.1 round-trip propagation delay = A - LSR - DLSR, middle 32 bits of NTP
+	if(0 != rb->lsr)
+	{
+		ntp = (uint32_t)(clock2ntp(rtpclock()) >> 16);
+		// the DLSR of a receiver may be a little longer than the time since our SR
+		rtt = (int32_t)(ntp - rb->lsr - rb->dlsr);
+		reporter->rtt = rtt > 0 ? (uint32_t)rtt : 0;
+	}
+
+	rtcp_report_block_qos(session, reporter);
+}
@@ -16,7 +16,7 @@ static void rtp_seq_init(rtp_member *sender, uint16_t seq)
 	sender->rtp_bytes = 0;
 	sender->rtp_packets = 0;
 	sender->rtp_probation = 0;
-	sender->jitter = 0.0;
+	sender->jitter = 0;
 }
 
 static int rtp_seq_update(rtp_member *sender, uint16_t seq)
@@ -83,17 +83,15 @@ rtp_member* rtp_member_fetch(rtp_session_t *session, uint32_t ssrc)
 		// exist in sender list?
 		assert(!rtp_member_list_find(session->senders, ssrc));
 
-		p = rtp_member_create(ssrc);
+		p = rtp_member_pool_alloc(&session->member_pool, ssrc);
 		if(p)
 		{
-			struct rtcp_msg_t msg;
-
+			p->rtcp_clock = rtpclock(); // heard from now, it times out from here
 			// update members list
-			rtp_member_list_add(session->members, p);
+			int r = rtp_member_list_add(session->members, p);
 			rtp_member_release(p);
-
-			msg.type = RTCP_MSG_MEMBER;
-			msg.u.member.ssrc = ssrc;
+			if(0 != r)
+				return NULL;
 		}
 	}
 	return p;
@@ -115,6 +113,57 @@ rtp_member* rtp_sender_fetch(rtp_session_t *session, uint32_t ssrc)
 	return p;
 }
 
+// RFC3550 6.3.4 members left, the next report comes earlier in proportion
+void rtcp_reconsider_reverse(rtp_session_t *session, uint64_t clock)
+{
+	int members;
+	members = rtp_member_list_count(session->members);
+	if(members >= session->rtcp_pmembers)
+		return;
+
+	if(session->rtcp_next > clock)
+	{
+		session->rtcp_next = clock + (session->rtcp_next - clock) * members / session->rtcp_pmembers;
+		session->rtcp_last = clock - (clock - session->rtcp_last) * members / session->rtcp_pmembers;
+	}
+	session->rtcp_pmembers = members;
+}
+
+// RFC3550 6.3.5 members not heard from in 5 Td leave, senders without RTP or SR in 2 Td are receivers again
+void rtcp_expire_members(rtp_session_t *session, uint64_t clock)
+{
+	int i, n;
+	uint64_t td, last;
+	rtp_member *member;
+
+	n = rtp_member_list_count(session->members);
+	td = (uint64_t)rtcp_interval_deterministic(n,
+		rtp_member_list_count(session->senders) + ((RTP_SENDER==session->role) ? 1 : 0),
+		session->rtcp_bw, 0, session->avg_rtcp_size, 0) * 1000;
+
+	// backwards, a deleted item is replaced by the last one which was checked already
+	for(i = rtp_member_list_count(session->senders) - 1; i >= 0; i--)
+	{
+		member = rtp_member_list_get(session->senders, i);
+		last = member->rtp_clock > member->rtcp_clock ? member->rtp_clock : member->rtcp_clock;
+		if(last + 2 * td < clock)
+			rtp_member_list_delete(session->senders, member->ssrc);
+	}
+
+	for(i = n - 1; i >= 0; i--)
+	{
+		member = rtp_member_list_get(session->members, i);
+		last = member->rtp_clock > member->rtcp_clock ? member->rtp_clock : member->rtcp_clock;
+		if(member == session->self || last + 5 * td >= clock)
+			continue;
+
+		rtp_member_list_delete(session->senders, member->ssrc);
+		rtp_member_list_delete(session->members, member->ssrc);
+	}
+
+	rtcp_reconsider_reverse(session, clock);
+}
+
 static int rtcp_parse(rtp_session_t *session, const unsigned char* data, size_t bytes)
 {
 	uint32_t rtcphd;
@@ -134,8 +183,7 @@ static int rtcp_parse(rtp_session_t *session, const unsigned char* data, size_t
 	// 3. padding only valid at the last packet
 	if (header.length * 4 + 4 > bytes || 2 != header.v || (1 == header.p && header.length < data[bytes - 1]))
 	{
-		assert(0);
-		return -1;
+		return -1; // malformed, drop the rest of the compound packet
 	}
 
 	if(1 == header.p)
@@ -166,7 +214,7 @@ static int rtcp_parse(rtp_session_t *session, const unsigned char* data, size_t
 		break;
 
 	default:
-		assert(0);
+		break; // e.g. feedback or extended reports, not used
 	}
 
 	return (RTCP_LEN(rtcphd) + 1) * 4;
@@ -182,15 +230,16 @@ int rtcp_input_rtcp(rtp_session_t *session, const void* data, int bytes)
 	// 2. An SDES packet containing a CNAME item must be included in each compound RTCP packet
 	// 3. BYE should be the last packet sent with a given SSRC/CSRC.
 	p = (const unsigned char*)data;
+
+	// RFC3550 6.3.3 Receiving an RTP or Non-BYE RTCP Packet (p26)
+	session->avg_rtcp_size = rtcp_avg_size_update(session->avg_rtcp_size, bytes + RTCP_LOWER_HEADER_SIZE);
+
 	while(bytes > 4)
 	{
 		// compound RTCP packet
 		r = rtcp_parse(session, p, bytes);
 		if(r <= 0)
-			break;
-
-		// RFC3550 6.3.3 Receiving an RTP or Non-BYE RTCP Packet (p26)
-		session->avg_rtcp_size = (int)(session->avg_rtcp_size*1.0/16 + r * 15.0/16);
+			return -1;
 
 		p += r;
 		bytes -= r;
@@ -227,12 +276,11 @@ int rtcp_input_rtp(rtp_session_t *session, const void* data, int bytes)
 	{
 		int D;
 		D = (int)((unsigned int)((clock - sender->rtp_clock)*session->frequence/1000000) - (pkt.rtp.ts - sender->rtp_timestamp));
-		if(D < 0) D = -D;
-		sender->jitter += (D - sender->jitter)/16.0;
+		sender->jitter = rtcp_jitter_update(sender->jitter, D);
 	}
 	else
 	{
-		sender->jitter = 0.0;
+		sender->jitter = 0;
 	}
 
 	sender->rtp_clock = clock;
@@ -241,3 +289,40 @@ int rtcp_input_rtp(rtp_session_t *session, const void* data, int bytes)
 	sender->rtp_packets += 1;
 	return 1;
 }
+
+#if defined(_DEBUG) || defined(DEBUG)
+// the fixed-point estimates against the floating-point formulas of RFC3550: within half a unit,
+// the jitter reported within 1 of the truncated formula
+void rtcp_estimate_test(void)
+{
+	int i, d, size, avg_rtcp_size = 0;
+	uint32_t jitter = 0;
+	uint64_t delay;
+	double J = 0, avg = 0, diff, dlsr;
+
+	for (i = 0; i < 20000; i++)
+	{
+		// transit time differences of a calm and a busy network at 90 kHz, either sign
+		d = rand() % ((i / 1000) % 2 ? 90000 : 100) * (rand() % 2 ? 1 : -1);
+		jitter = rtcp_jitter_update(jitter, d);
+		J += ((d < 0 ? -d : d) - J) / 16;
+		diff = jitter / 16.0 - J;
+		assert(diff >= -0.5 && diff <= 0.5);
+		assert((jitter >> 4) + 1 >= (uint32_t)J && (jitter >> 4) <= (uint32_t)J + 1);
+
+		// compound packets of a receiver report up to many report blocks
+		size = 60 + rand() % 1400 + RTCP_LOWER_HEADER_SIZE;
+		avg_rtcp_size = avg_rtcp_size ? rtcp_avg_size_update(avg_rtcp_size, size) : size * 16;
+		avg = avg ? avg + (size - avg) / 16 : size;
+		diff = avg_rtcp_size / 16.0 - avg;
+		assert(diff >= -0.5 && diff <= 0.5);
+	}
+
+	// up to the 65536 s DLSR can hold
+	for (delay = 0; delay < 65536ULL * 1000000; delay = delay * 3 + 7)
+	{
+		dlsr = delay * 65536.0 / 1000000;
+		assert(rtcp_dlsr(delay) <= dlsr && rtcp_dlsr(delay) > dlsr - 1);
+	}
+}
+#endif
@@ -4,38 +4,125 @@
 #include <assert.h>
 #include <errno.h>
 
-#define N_SOURCE 2 // unicast(1S + 1R)
+#define N_SOURCE 4 // initial capacity, unicast(1S + 1R)
+#define N_NODES_BLOCK 16 // nodes allocated at once
 
-typedef struct 
+// a member in the table, found by ssrc in its bucket and by index in items
+typedef struct rtp_member_node
 {
-	rtp_member *members[N_SOURCE];
-	rtp_member **ptr;
+	rtp_member *member;
+	int index;
+	struct rtp_member_node *next; // in the bucket, or in the free list
+} rtp_member_node;
+
+typedef struct rtp_member_block
+{
+	struct rtp_member_block *next;
+	rtp_member_node nodes[N_NODES_BLOCK];
+} rtp_member_block;
+
+typedef struct
+{
+	rtp_member_node **items;   // dense, for rtp_member_list_get()
+	rtp_member_node **buckets; // by hash of ssrc, as many as capacity
 	int count;
-	int capacity;
+	int capacity;              // power of 2
+	rtp_member_node *free;     // unused nodes of blocks
+	rtp_member_block *blocks;
 } rtp_member_list;
 
+static inline uint32_t rtp_member_list_hash(const rtp_member_list *p, uint32_t ssrc)
+{
+	// ssrc comes from the network, it is mixed so that close values don't share a bucket
+	return ((ssrc * 2654435761u) >> 16) & (p->capacity - 1);
+}
+
+static int rtp_member_list_grow(rtp_member_list *p, int capacity)
+{
+	int i;
+	uint32_t h;
+	void* items;
+	rtp_member_node **buckets;
+
+	items = realloc(p->items, capacity * sizeof(rtp_member_node*));
+	if(!items)
+		return ENOMEM;
+	p->items = (rtp_member_node **)items;
+
+	buckets = (rtp_member_node **)calloc(capacity, sizeof(rtp_member_node*));
+	if(!buckets)
+		return ENOMEM;
+	free(p->buckets);
+	p->buckets = buckets;
+	p->capacity = capacity;
+
+	for(i = 0; i < p->count; i++)
+	{
+		h = rtp_member_list_hash(p, p->items[i]->member->ssrc);
+		p->items[i]->next = p->buckets[h];
+		p->buckets[h] = p->items[i];
+	}
+	return 0;
+}
+
+static rtp_member_node* rtp_member_list_node(rtp_member_list *p)
+{
+	int i;
+	rtp_member_node *node;
+	rtp_member_block *block;
+
+	if(!p->free)
+	{
+		block = (rtp_member_block *)calloc(1, sizeof(rtp_member_block));
+		if(!block)
+			return NULL;
+		block->next = p->blocks;
+		p->blocks = block;
+		for(i = 0; i < N_NODES_BLOCK; i++)
+		{
+			block->nodes[i].next = p->free;
+			p->free = &block->nodes[i];
+		}
+	}
+
+	node = p->free;
+	p->free = node->next;
+	return node;
+}
+
 void* rtp_member_list_create()
 {
-	return (rtp_member_list *)calloc(1, sizeof(rtp_member_list));
+	rtp_member_list *p;
+	p = (rtp_member_list *)calloc(1, sizeof(rtp_member_list));
+	if(p && 0 != rtp_member_list_grow(p, N_SOURCE))
+	{
+		rtp_member_list_destroy(p);
+		return NULL;
+	}
+	return p;
 }
 
 void rtp_member_list_destroy(void* members)
 {
 	int i;
+	rtp_member_block *block;
 	rtp_member_list *p;
 	p = (rtp_member_list *)members;
 
 	for(i = 0; i < p->count; i++)
 	{
-		rtp_member_release(i >= N_SOURCE ? p->ptr[i-N_SOURCE] : p->members[i]);
+		rtp_member_release(p->items[i]->member);
 	}
 
-	if(p->ptr)
+	while(p->blocks)
 	{
-		assert(p->capacity > 0);
-		free(p->ptr);
+		block = p->blocks;
+		p->blocks = block->next;
+		free(block);
 	}
 
+	free(p->items);
+	free(p->buckets);
 	free(p);
 }
 
@@ -53,47 +140,43 @@ rtp_member* rtp_member_list_get(void* members, int index)
 	if(index >= p->count || index < 0)
 		return NULL;
 
-	return index >= N_SOURCE ? p->ptr[index-N_SOURCE] : p->members[index];
+	return p->items[index]->member;
 }
 
 rtp_member* rtp_member_list_find(void* members, uint32_t ssrc)
 {
-	int i;
-	rtp_member *s;
+	rtp_member_node *node;
 	rtp_member_list *p;
 	p = (rtp_member_list *)members;
 
-	for(i = 0; i < p->count; i++)
+	for(node = p->buckets[rtp_member_list_hash(p, ssrc)]; node; node = node->next)
 	{
-		s = i < N_SOURCE ? p->members[i] : p->ptr[i-N_SOURCE];
-		if(s->ssrc == ssrc)
-			return s;
+		if(node->member->ssrc == ssrc)
+			return node->member;
 	}
 	return NULL;
 }
 
 int rtp_member_list_add(void* members, rtp_member* s)
 {
+	uint32_t h;
+	rtp_member_node *node;
 	rtp_member_list *p;
 	p = (rtp_member_list *)members;
 
-	if(p->count >= N_SOURCE)
-	{
-		if(p->count - N_SOURCE >= p->capacity)
-		{
-			void* ptr;
-			ptr = (rtp_member **)realloc(p->ptr, (p->capacity+8)*sizeof(rtp_member*));
-			if(!ptr)
-				return ENOMEM;
-			p->ptr = ptr;
-			p->capacity += 8;
-		}
-		p->ptr[p->count - N_SOURCE] = s;
-	}
-	else
-	{
-		p->members[p->count] = s;
-	}
+	if(p->count >= p->capacity && 0 != rtp_member_list_grow(p, p->capacity * 2))
+		return ENOMEM;
+
+	node = rtp_member_list_node(p);
+	if(!node)
+		return ENOMEM;
+
+	h = rtp_member_list_hash(p, s->ssrc);
+	node->member = s;
+	node->index = p->count;
+	node->next = p->buckets[h];
+	p->buckets[h] = node;
+	p->items[p->count] = node;
 
 	rtp_member_addref(s);
 	p->count++;
@@ -102,40 +185,26 @@ int rtp_member_list_add(void* members, rtp_member* s)
 
 int rtp_member_list_delete(void* members, uint32_t ssrc)
 {
-	int i;
-	rtp_member *s;
+	rtp_member_node *node, **prev;
 	rtp_member_list *p;
 	p = (rtp_member_list *)members;
 
-	for(i = 0; i < p->count; i++)
+	for(prev = &p->buckets[rtp_member_list_hash(p, ssrc)]; *prev; prev = &(*prev)->next)
 	{
-		s = i < N_SOURCE ? p->members[i] : p->ptr[i-N_SOURCE];
-		if(s->ssrc != ssrc)
+		node = *prev;
+		if(node->member->ssrc != ssrc)
 			continue;
 
-		if(i < N_SOURCE)
-		{
-			if(i+1 < N_SOURCE)
-			{
-				memmove(p->members + i, p->members+i+1, (N_SOURCE-i-1) * sizeof(rtp_member*));
-			}
-
-			if(p->count > N_SOURCE)
-			{
-				p->members[N_SOURCE-1] = p->ptr[0];
-				memmove(p->ptr, p->ptr + 1, (p->count-N_SOURCE-1) * sizeof(rtp_member*));
-			}
-		}
-		else
-		{
-			if(i + 1 < p->count)
-			{
-				memmove(p->ptr + i - N_SOURCE, p->ptr + i + 1 - N_SOURCE, (p->count-i-1) * sizeof(rtp_member*));
-			}
-		}
+		*prev = node->next;
 
-		rtp_member_release(s);
+		// the last item takes the place of the deleted one
 		p->count--;
+		p->items[node->index] = p->items[p->count];
+		p->items[node->index]->index = node->index;
+
+		rtp_member_release(node->member);
+		node->next = p->free;
+		p->free = node;
 		return 0;
 	}
 
@@ -12,6 +12,7 @@ rtp_member* rtp_member_list_get(void* members, int index);
 rtp_member* rtp_member_list_find(void* members, uint32_t ssrc);
 
 int rtp_member_list_add(void* members, rtp_member* source);
+/// the last member takes the index of the deleted one
 int rtp_member_list_delete(void* members, uint32_t ssrc);
 
 #endif /* !_rtp_member_list_h_ */
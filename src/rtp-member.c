@@ -4,6 +4,16 @@
 #include <string.h>
 #include <assert.h>
 
+static void rtp_member_init(rtp_member *p, uint32_t ssrc)
+{
+	p->ref = 1;
+	p->ssrc = ssrc;
+	p->jitter = 0;
+	p->rtp_probation = RTP_PROBATION;
+	p->rtcp_sr.ssrc = ssrc;
+	p->rtcp_rb.ssrc = ssrc;
+}
+
 rtp_member* rtp_member_create(uint32_t ssrc)
 {
 	rtp_member* p;
@@ -11,15 +21,44 @@ rtp_member* rtp_member_create(uint32_t ssrc)
 	if(!p)
 		return NULL;
 
-	p->ref = 1;
-	p->ssrc = ssrc;
-	p->jitter = 0.0;
-	p->rtp_probation = RTP_PROBATION;
-	p->rtcp_sr.ssrc = ssrc;
-	p->rtcp_rb.ssrc = ssrc;
+	rtp_member_init(p, ssrc);
+	return p;
+}
+
+rtp_member* rtp_member_pool_alloc(rtp_member_pool_t *pool, uint32_t ssrc)
+{
+	rtp_member* p;
+	if(pool->free)
+	{
+		p = pool->free;
+		pool->free = p->next_free;
+		pool->count--;
+		memset(p, 0, sizeof(rtp_member));
+	}
+	else
+	{
+		p = (rtp_member*)calloc(1, sizeof(rtp_member));
+		if(!p)
+			return NULL;
+	}
+
+	rtp_member_init(p, ssrc);
+	p->pool = pool;
 	return p;
 }
 
+void rtp_member_pool_destroy(rtp_member_pool_t *pool)
+{
+	rtp_member* p;
+	while(pool->free)
+	{
+		p = pool->free;
+		pool->free = p->next_free;
+		free(p);
+	}
+	pool->count = 0;
+}
+
 void rtp_member_addref(rtp_member *member)
 {
 	assert(member->ref > 0);
@@ -42,6 +81,13 @@ void rtp_member_release(rtp_member *member)
 			}
 		}
 
+		if(member->pool && member->pool->count < RTP_MEMBER_POOL_MAX)
+		{
+			member->next_free = member->pool->free;
+			member->pool->free = member;
+			member->pool->count++;
+			return;
+		}
 		free(member);
 	}
 }
@@ -7,9 +7,40 @@
 #define RTP_DROPOUT		500
 #define RTP_MISORDER	100
 
-typedef struct 
+#define RTP_MEMBER_POOL_MAX	32		// released members kept by a pool for reuse
+#define RTP_QOS_HISTORY		8		// report blocks kept by rtp_qos_t, the window of the loss rate
+
+/// one report block of a receiver about us
+typedef struct rtp_qos_sample_t
+{
+	uint32_t time_ms;				// rtpclock() / 1000 when it arrived
+	uint32_t exthsn;				// extended highest sequence number received
+	int32_t cumulative;				// cumulative number of packets lost
+	uint32_t rtt_us;				// 0 if the receiver had no SR from us yet
+	uint32_t jitter_us;
+	uint8_t fraction;				// lost since its previous report, 1/256
+} rtp_qos_sample_t;
+
+/// reception quality of our stream at a receiver (RFC3550 6.4.1)
+typedef struct rtp_qos_t
+{
+	uint32_t reports;				// report blocks about us received
+	uint32_t rtt_us;				// of the newest report
+	uint32_t jitter_us;				// of the newest report
+	uint32_t loss_permille;			// packets lost over the history window, 1/1000
+	int32_t lost;					// cumulative number of packets lost
+	uint8_t head;					// history[head] is the newest report
+	uint8_t count;					// reports in history
+	rtp_qos_sample_t history[RTP_QOS_HISTORY];
+} rtp_qos_t;
+
+struct rtp_member_pool_t;
+
+typedef struct rtp_member
 {
 	int32_t ref;
+	struct rtp_member_pool_t *pool;	// where the member goes when released, NULL to free it
+	struct rtp_member *next_free;	// in the free list of pool
 
 	uint32_t ssrc;					// ssrc == rtcp_sr.ssrc == rtcp_rb.ssrc
 	rtcp_sr_t rtcp_sr;
@@ -17,6 +48,8 @@ typedef struct
 	rtcp_sdes_item_t sdes[9];		// SDES item
 
 	uint64_t rtcp_clock;			// last RTCP SR/RR packet clock(local time)
+	uint32_t rtt;					// round-trip time from the last report block about us, 1/65536 seconds
+	rtp_qos_t qos;					// from its report blocks about us
 
 	uint16_t rtp_seq;				// last send/received RTP packet RTP sequence(in packet header)
 	uint32_t rtp_timestamp;			// last send/received RTP packet RTP timestamp(in packet header)
@@ -24,7 +57,7 @@ typedef struct
 	uint32_t rtp_packets;			// send/received RTP packet count(include duplicate, late)
 	uint64_t rtp_bytes;				// send/received RTP octet count
 
-	double jitter;
+	uint32_t jitter;				// interarrival jitter in 1/16 timestamp units (RFC3550 A.8)
 	uint32_t rtp_packets0;			// last SR received RTP packets
 	uint32_t rtp_expected0;			// last SR expect RTP sequence number
 
@@ -34,7 +67,16 @@ typedef struct
 	uint32_t rtp_seq_cycles;		// high extension sequence number
 } rtp_member;
 
+/// released members of a session, so that receivers joining and leaving don't allocate
+typedef struct rtp_member_pool_t
+{
+	rtp_member *free;
+	int count;
+} rtp_member_pool_t;
+
 rtp_member* rtp_member_create(uint32_t ssrc);
+rtp_member* rtp_member_pool_alloc(rtp_member_pool_t *pool, uint32_t ssrc);
+void rtp_member_pool_destroy(rtp_member_pool_t *pool);
 void rtp_member_addref(rtp_member *member);
 void rtp_member_release(rtp_member *member);
 
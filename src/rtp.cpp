@@ -1,4 +1,5 @@
 
+#include <assert.h>
 #include <stdio.h>
 #include <string.h>
 #include "esp_log.h"
@@ -7,14 +8,12 @@
 #include "rtcp-header.h"
 #include "rtp-member.h"
 #include "rtp-member-list.h"
+#include "rtp-util.h"
+#include "send_queue.h"
+#include "udp_port_pool.h"
 
 static const char *TAG = "RTP";
 
-enum { 
-	RTP_SENDER		= 1,	/// send RTP packet
-	RTP_RECEIVER	= 2,	/// receive RTP packet
-};
-
 #define RTP_CHECK(a, str, ret_val)                       \
     if (!(a))                                                     \
     {                                                             \
@@ -25,14 +24,28 @@ enum {
 // RFC3550 6.2 RTCP Transmission Interval (p21)
 // It is recommended that the fraction of the session bandwidth added for RTCP be fixed at 5%.
 // It is also recommended that 1/4 of the RTCP bandwidth be dedicated to participants that are sending data
-#define RTCP_BANDWIDTH_FRACTION			0.05
-#define RTCP_SENDER_BANDWIDTH_FRACTION	0.25
+#define RTCP_BANDWIDTH_PERCENT			5
+#define RTCP_SENDER_BANDWIDTH_PERCENT	25
 
 #define RTCP_REPORT_INTERVAL			5000 /* milliseconds RFC3550 p25 */
 #define RTCP_REPORT_INTERVAL_MIN		2500 /* milliseconds RFC3550 p25 */
 
 #define RTP_PAYLOAD_MAX_SIZE			(10 * 1024 * 1024)
 
+#define RTP_SESSION_BANDWIDTH			(128 * 1024) /* octets per second assumed if the caller gives none */
+
+/**
+ * CNAME of all our sessions, the same for every stream so that receivers can synchronize them
+ */
+static const char *rtp_cname(void)
+{
+    static char cname[32];
+    if ('\0' == cname[0]) {
+        snprintf(cname, sizeof(cname), "esp32-rtsp-%08x", (unsigned int)GET_RANDOM());
+    }
+    return cname;
+}
+
 rtp_session_t *rtp_session_create(rtp_session_info_t *session_info, uint32_t ssrc, uint32_t timestamp, int frequence, int bandwidth, int sender)
 {
     rtp_session_t *session = (rtp_session_t *)calloc(1, sizeof(rtp_session_t));
@@ -45,7 +58,7 @@ rtp_session_t *rtp_session_create(rtp_session_info_t *session_info, uint32_t ssr
 
     session->session_info = *session_info;
 
-    session->self = rtp_member_create(ssrc);
+    session->self = rtp_member_pool_alloc(&session->member_pool, ssrc);
 	session->members = rtp_member_list_create();
 	session->senders = rtp_member_list_create();
 	if(!session->self || !session->members || !session->senders)
@@ -54,18 +67,41 @@ rtp_session_t *rtp_session_create(rtp_session_info_t *session_info, uint32_t ssr
 		return NULL;
 	}
 
-    session->self->rtp_clock = rtpclock();
-    session->self->rtp_timestamp = timestamp;
     rtp_member_list_add(session->members, session->self);
+    const char *cname = rtp_cname();
+    rtp_member_setvalue(session->self, RTCP_SDES_CNAME, (const uint8_t *)cname, strlen(cname));
 
 
     // init RTSP Session transport type (UDP or TCP) and ports for UDP transport
     if (RTP_OVER_UDP == session->session_info.transport_mode) {
-        rtp_InitUdpTransport(session);
+        if (0 == session->session_info.dest_addr) {
+            IPPORT otherport;
+            socketpeeraddr(session->session_info.socket_tcp, &session->session_info.dest_addr, &otherport);
+        }
+        if (0 != rtp_InitUdpTransport(session)) {
+            rtp_session_delete(session);
+            return NULL;
+        }
+        // the kernel keeps the route, each packet is then a plain send. A shared socket serves everyone.
+        session->rtp_connected = (NULL == session->session_info.udp_shared &&
+                                  0 == udpsocketconnect(session->RtpSocket, session->session_info.dest_addr,
+                                                        session->session_info.rtp_port));
+    } else if (RTP_OVER_MULTICAST == session->session_info.transport_mode) {
+        // one session serves all viewers of the group
+        if (0 == session->session_info.dest_addr || 0 != rtp_InitUdpTransport(session)) {
+            rtp_session_delete(session);
+            return NULL;
+        }
+        udpsocketsetmulticastttl(session->RtpSocket, session->session_info.ttl);
+        udpsocketsetmulticastttl(session->RtcpSocket, session->session_info.ttl);
+        session->rtp_connected = (0 == udpsocketconnect(session->RtpSocket, session->session_info.dest_addr,
+                                                         session->session_info.rtp_port));
     }
 
 //	session->cbparam = param;
-	session->rtcp_bw = (int)(bandwidth * RTCP_BANDWIDTH_FRACTION);
+	if (bandwidth <= 0)
+		bandwidth = RTP_SESSION_BANDWIDTH;
+	session->rtcp_bw = (int)((int64_t)bandwidth * RTCP_BANDWIDTH_PERCENT / 100);
 	session->avg_rtcp_size = 0;
 	session->frequence = frequence;
 	session->role = sender ? RTP_SENDER : RTP_RECEIVER;
@@ -79,7 +115,10 @@ rtp_session_t *rtp_session_create(rtp_session_info_t *session_info, uint32_t ssr
     session->rtphdr.pt = 0;
     session->rtphdr.seq = 0;
     session->rtphdr.ts = 0;
-    session->rtphdr.ssrc = GET_RANDOM();
+    session->rtphdr.ssrc = ssrc; // the same SSRC is reported by RTCP
+    session->ts_offset = GET_RANDOM();
+    session->self->rtp_clock = rtpclock();
+    session->self->rtp_timestamp = timestamp + session->ts_offset;
     return session;
 }
 
@@ -90,12 +129,14 @@ void rtp_session_delete(rtp_session_t *session)
         return;
     }
 
+    rtp_rtcp_send_bye(session);
     if(session->members)
 		rtp_member_list_destroy(session->members);
 	if(session->senders)
 		rtp_member_list_destroy(session->senders);
 	if(session->self)
 		rtp_member_release(session->self);
+	rtp_member_pool_destroy(&session->member_pool);
 
     rtp_ReleaseUdpTransport(session);
     free(session);
@@ -113,49 +154,101 @@ uint16_t rtp_GetRtcpServerPort(rtp_session_t *session)
 
 static int rtp_InitUdpTransport(rtp_session_t *session)
 {
-    uint16_t P = 0;
-    #define UDP_PORT_MIN 6970
-    #define UDP_PORT_MAM 7000
-
-    for (P = UDP_PORT_MIN; P < UDP_PORT_MAM; P += 2) {
-        session->RtpSocket = udpsocketcreate(P);
-        if (session->RtpSocket) {
-            // Rtp socket was bound successfully. Lets try to bind the consecutive Rtsp socket
-            session->RtcpSocket = udpsocketcreate(P + 1);
-            if (session->RtcpSocket) {
-                // allocate port pairs for RTP/RTCP ports in UDP transport mode
-                session->RtpServerPort = P;
-                session->RtcpServerPort = P + 1;
-                break;
-            } else {
-                udpsocketclose(session->RtpSocket);
-            }
-        }
+    const rtp_udp_shared_t *shared = session->session_info.udp_shared;
+    if (shared && RTP_OVER_UDP == session->session_info.transport_mode) {
+        session->RtpSocket = shared->rtp_socket;
+        session->RtcpSocket = shared->rtcp_socket;
+        session->RtpServerPort = shared->port;
+        session->RtcpServerPort = shared->port + 1;
+        return 0;
     }
-    if (P >= UDP_PORT_MAM) {
+
+    udp_port_pool_t *pool = session->session_info.port_pool;
+    uint16_t port;
+    if (NULL == pool || 0 != udp_port_pool_alloc(pool, &session->RtpSocket, &session->RtcpSocket, &port)) {
         ESP_LOGE(TAG, "Can't create udp socket for RTP and RTCP");
         return -1;
     }
+    session->RtpServerPort = port;
+    session->RtcpServerPort = port + 1;
     return 0;
 }
 
 static void rtp_ReleaseUdpTransport(rtp_session_t *session)
 {
+    // the port pair goes back to the pool for the next SETUP
+    bool shared = session->session_info.udp_shared && RTP_OVER_UDP == session->session_info.transport_mode;
+    if (RTP_OVER_TCP != session->session_info.transport_mode && session->RtpServerPort && !shared) {
+        udp_port_pool_release(session->session_info.port_pool, session->RtpServerPort,
+                              session->RtpSocket, session->RtcpSocket);
+    }
     session->RtpServerPort = 0;
     session->RtcpServerPort = 0;
-    if (RTP_OVER_UDP == session->session_info.transport_mode) {
-        udpsocketclose(session->RtpSocket);
-        udpsocketclose(session->RtcpSocket);
-    }
-
     session->RtpSocket = NULLSOCKET;
     session->RtcpSocket = NULLSOCKET;
 }
 
+/**
+ * Destination address of RTP over UDP or multicast, 0 if the socket is connected to it
+ */
+static inline IPADDRESS rtp_udp_destaddr(rtp_session_t *session)
+{
+    return session->rtp_connected ? 0 : session->session_info.dest_addr;
+}
+
+/**
+ * Send a RTP packet which header is ready, its data starts with RTP_TCP_HEAD_SIZE bytes of headroom.
+ * Over TCP the packet is queued, the payload is referenced by train or copied if train is NULL.
+ */
+static int rtp_transmit(rtp_session_t *session, rtp_packet_t *packet, rtp_packet_train_t *train)
+{
+    int ret = -1;
+    uint8_t *RtpBuf = packet->data;
+    uint32_t RtpPacketSize = packet->size + RTP_HEADER_SIZE;
+
+    // Send RTP packet
+    if (RTP_OVER_TCP == session->session_info.transport_mode) {
+        RtpBuf[0] = '$'; // magic number
+        RtpBuf[1] = session->session_info.rtsp_channel;   // number of multiplexed subchannel on RTPS connection - here the RTP channel
+        RtpBuf[2] = (RtpPacketSize & 0x0000FF00) >> 8;
+        RtpBuf[3] = (RtpPacketSize & 0x000000FF);
+
+        // RTP over RTSP - we send the buffer + 4 byte additional header.
+        // The headers are copied since the slot of a shared train is patched by the next subscriber.
+        ret = send_queue_push_packet(session->session_info.send_queue, RtpBuf, RTP_TCP_HEAD_SIZE + RTP_HEADER_SIZE,
+                                     packet, train);
+    } else {
+        udpsocket_msg_t msg;
+        msg.socket = session->RtpSocket;
+        msg.destaddr = rtp_udp_destaddr(session);
+        msg.destport = session->session_info.rtp_port;
+        msg.iovcnt = 2;
+        msg.iov[0].iov_base = RtpBuf + RTP_TCP_HEAD_SIZE;
+        msg.iov[0].iov_len = RTP_HEADER_SIZE + packet->header_size;
+        msg.iov[1].iov_base = (void *)packet->payload;
+        msg.iov[1].iov_len = packet->payload_size;
+        udpsocketsendbatch(&msg, 1);
+        ret = 0;
+    }
+
+    return ret;
+}
+
+/**
+ * Count a sent packet for the sender report, the caller updates rtp_clock once per frame
+ */
+static inline void rtp_sent(rtp_session_t *session, const rtp_packet_t *packet)
+{
+    rtp_member *self = session->self;
+    self->rtp_packets++;
+    self->rtp_bytes += packet->size;
+    self->rtp_seq = session->sn;
+    self->rtp_timestamp = packet->timestamp + session->ts_offset;
+}
+
 //在具体的数据类型文件中将其打包成packet
 int rtp_send_packet(rtp_session_t *session, rtp_packet_t *packet)
 {
-    int ret = -1;
     uint8_t *RtpBuf = packet->data; // Note: we assume single threaded, this large buf we keep off of the tiny stack
     uint8_t *udp_buf = RtpBuf + RTP_TCP_HEAD_SIZE;
 
@@ -165,124 +258,292 @@ int rtp_send_packet(rtp_session_t *session, rtp_packet_t *packet)
     rtphdr->m = packet->is_last; // RTP marker bit must be set on last fragment
     rtphdr->pt = packet->type;
     rtphdr->seq = session->sn;
-    rtphdr->ts = packet->timestamp;
+    rtphdr->ts = packet->timestamp + session->ts_offset;
 
    // rtphdr=packet->rtp;
     mem_swap32_copy(udp_buf, (uint8_t *)rtphdr, RTP_HEADER_SIZE);//udp_buf指向rtp头开始的数据包
-    uint32_t RtpPacketSize = packet->size + RTP_HEADER_SIZE;//数据大小+RTP_HEADER大小
 
-    // Send RTP packet
-    if (RTP_OVER_UDP == session->session_info.transport_mode) {
-        IPADDRESS otherip;
-        IPPORT otherport;
-        socketpeeraddr(session->session_info.socket_tcp, &otherip, &otherport);
-        udpsocketsend(session->RtpSocket, udp_buf, RtpPacketSize, otherip, session->session_info.rtp_port);
-    } else if (RTP_OVER_TCP == session->session_info.transport_mode) {
-        RtpBuf[0] = '$'; // magic number
-        RtpBuf[1] = session->session_info.rtsp_channel;   // number of multiplexed subchannel on RTPS connection - here the RTP channel
-        RtpBuf[2] = (RtpPacketSize & 0x0000FF00) >> 8;
-        RtpBuf[3] = (RtpPacketSize & 0x000000FF);
-      
-        // RTP over RTSP - we send the buffer + 4 byte additional header
-        socketsend(session->session_info.socket_tcp, RtpBuf, RtpPacketSize + RTP_TCP_HEAD_SIZE);
-    } else {
-#define MULTICAST_IP        "239.255.255.11"
-        // #define MULTICAST_PORT      9832
-        struct sockaddr_in addr;
-        memset(&addr, 0, sizeof(addr));
-        inet_aton(MULTICAST_IP, &addr.sin_addr);
-        IPADDRESS otherip = addr.sin_addr.s_addr;
-        // IPPORT otherport;
-        // socketpeeraddr(session->session_info.socket_tcp, &otherip, &otherport);
-        udpsocketsend(session->RtpSocket, udp_buf, RtpPacketSize, otherip, session->session_info.rtp_port);
-    }
+    int ret = rtp_transmit(session, packet, NULL);
+    rtp_sent(session, packet);
+    session->self->rtp_clock = rtpclock();
     session->sn++;
+    if (RTP_OVER_TCP == session->session_info.transport_mode) {
+        send_queue_flush(session->session_info.send_queue);
+    }
 
     return ret;
 }
 
-//rtcp packet 有很多种类型
-int rtcp_send_packet(rtp_session_t *session, rtcp_packet_t *packet)
+rtp_packet_train_t *rtp_packet_train_create(uint32_t capacity, uint32_t stride)
 {
-    int ret = -1;
-    uint32_t RTCP_SIZE;
-    uint8_t *udp_buf;
+    rtp_packet_train_t *train = (rtp_packet_train_t *)calloc(1, sizeof(rtp_packet_train_t));
+    RTP_CHECK(NULL != train, "memory for packet train is not enough", NULL);
+
+    train->ref = 1;
+    train->stride = stride;
+    train->capacity = capacity;
+    train->buffer = (uint8_t *)malloc(capacity * stride);
+    train->packets = (rtp_packet_t *)calloc(capacity, sizeof(rtp_packet_t));
+    if (NULL == train->buffer || NULL == train->packets) {
+        free(train->buffer);
+        free(train->packets);
+        free(train);
+        ESP_LOGE(TAG, "memory for packet train buffer is insufficient");
+        return NULL;
+    }
+    return train;
+}
 
-    // Initialize RTP header
-    rtcp_hdr_t *rtcphdr = &session->rtcphdr;    
+void rtp_packet_train_addref(rtp_packet_train_t *train)
+{
+    assert(train->ref > 0);
+    ++train->ref;
+}
 
-    rtcphdr->count = packet->count;
+void rtp_packet_train_release(rtp_packet_train_t *train)
+{
+    assert(train->ref > 0);
+    if (0 == --train->ref) {
+        free(train->payloads);
+        free(train->buffer);
+        free(train->packets);
+        free(train);
+    }
+}
 
-    rtcphdr->pt = packet->type;
-    rtcphdr->length = packet->size;
+rtp_packet_t *rtp_packet_train_alloc(rtp_packet_train_t *train)
+{
+    if (train->count >= train->capacity) {
+        uint32_t capacity = train->capacity * 2;
+        uint8_t *buffer = (uint8_t *)realloc(train->buffer, capacity * train->stride);
+        RTP_CHECK(NULL != buffer, "memory for packet train is not enough", NULL);
+        train->buffer = buffer;
+        rtp_packet_t *packets = (rtp_packet_t *)realloc(train->packets, capacity * sizeof(rtp_packet_t));
+        RTP_CHECK(NULL != packets, "memory for packet train is not enough", NULL);
+        train->packets = packets;
+        train->capacity = capacity;
+        // the buffer may have moved
+        for (uint32_t i = 0; i < train->count; i++) {
+            train->packets[i].data = train->buffer + i * train->stride;
+        }
+    }
 
-    switch(rtcphdr.pt)
-	{
-	case RTCP_SR:
-		RTCP_SIZE=rtcp_sr_pack(session, udp_buf, packet->size);
-		break;
+    rtp_packet_t *packet = &train->packets[train->count];
+    memset(packet, 0, sizeof(rtp_packet_t));
+    packet->data = train->buffer + train->count * train->stride;
+    train->count++;
+    return packet;
+}
 
-	case RTCP_RR:
-		RTCP_SIZE=rtcp_rr_pack(session, udp_buf, packet->size);
-		break;
+void rtp_packet_train_reset(rtp_packet_train_t *train)
+{
+    free(train->payloads);
+    train->payloads = NULL;
+    train->count = 0;
+}
 
-	case RTCP_SDES:
-        RTCP_SIZE=rtcp_sdes_pack(session, udp_buf, packet->size);
-		break;
+int rtp_packet_train_detach(rtp_packet_train_t *train)
+{
+    if (NULL != train->payloads) {
+        return 0;
+    }
+    uint32_t bytes = 0;
+    for (uint32_t i = 0; i < train->count; i++) {
+        bytes += train->packets[i].payload_size;
+    }
+    train->payloads = (uint8_t *)malloc(bytes ? bytes : 1);
+    RTP_CHECK(NULL != train->payloads, "memory for payloads of packet train is not enough", -1);
+
+    uint8_t *p = train->payloads;
+    for (uint32_t i = 0; i < train->count; i++) {
+        rtp_packet_t *packet = &train->packets[i];
+        memcpy(p, packet->payload, packet->payload_size);
+        packet->payload = p;
+        p += packet->payload_size;
+    }
+    return 0;
+}
 
-	case RTCP_BYE:
-        RTCP_SIZE=rtcp_bye_pack(session, udp_buf, packet->size);
-		break;
+void rtp_packet_train_write_headers(rtp_packet_train_t *train)
+{
+    for (uint32_t i = 0; i < train->count; i++) {
+        rtp_packet_t *packet = &train->packets[i];
+        rtp_header_t header = {};
+        header.v = RTP_VERSION;
+        header.m = packet->is_last; // RTP marker bit must be set on last fragment
+        header.pt = packet->type;
+        header.timestamp = packet->timestamp;
+        nbo_write_rtp_header(packet->data + RTP_TCP_HEAD_SIZE, &header);
+    }
+}
 
-	case RTCP_APP:
-        RTCP_SIZE=rtcp_app_pack(session, udp_buf, packet->size);
-		break;
+rtp_udp_batch_t *rtp_udp_batch_create(uint32_t capacity)
+{
+    rtp_udp_batch_t *batch = (rtp_udp_batch_t *)calloc(1, sizeof(rtp_udp_batch_t));
+    RTP_CHECK(NULL != batch, "memory for udp batch is not enough", NULL);
+    batch->capacity = capacity;
+    batch->msgs = (udpsocket_msg_t *)calloc(capacity, sizeof(udpsocket_msg_t));
+    batch->heads = (uint8_t *)malloc(capacity * RTP_HEADER_SIZE);
+    if (NULL == batch->msgs || NULL == batch->heads) {
+        rtp_udp_batch_delete(batch);
+        ESP_LOGE(TAG, "memory for udp batch is insufficient");
+        return NULL;
+    }
+    return batch;
+}
 
-	default:
-		assert(0);
-	}
+void rtp_udp_batch_delete(rtp_udp_batch_t *batch)
+{
+    free(batch->msgs);
+    free(batch->heads);
+    free(batch);
+}
 
-    // Send RTCP packet
-    if (RTP_OVER_UDP == session->session_info.transport_mode) {
-        IPADDRESS otherip;
-        IPPORT otherport;
-        socketpeeraddr(session->session_info.socket_tcp, &otherip, &otherport);
-        udpsocketsend(session->RtcpSocket, udp_buf, RTCP_SIZE, otherip, session->session_info.rtcp_port);
+static int rtp_udp_batch_reserve(rtp_udp_batch_t *batch, uint32_t count)
+{
+    if (count <= batch->capacity) {
+        return 0;
     }
-    session->sn++;
+    uint32_t capacity = batch->capacity * 2 > count ? batch->capacity * 2 : count;
+    udpsocket_msg_t *msgs = (udpsocket_msg_t *)realloc(batch->msgs, capacity * sizeof(udpsocket_msg_t));
+    RTP_CHECK(NULL != msgs, "memory for udp batch is not enough", -1);
+    batch->msgs = msgs;
+    uint8_t *heads = (uint8_t *)realloc(batch->heads, capacity * RTP_HEADER_SIZE);
+    RTP_CHECK(NULL != heads, "memory for udp batch is not enough", -1);
+    batch->heads = heads;
+    batch->capacity = capacity;
+    return 0;
+}
 
-    return ret;
+int rtp_udp_batch_flush(rtp_udp_batch_t *batch)
+{
+    // heads may have moved while the batch grew, point to them only now
+    for (uint32_t i = 0; i < batch->count; i++) {
+        batch->msgs[i].iov[0].iov_base = batch->heads + i * RTP_HEADER_SIZE;
+    }
+    batch->syscalls = batch->count ? udpsocketsendbatch(batch->msgs, batch->count) : 0;
+    batch->count = 0;
+    return batch->syscalls;
+}
+
+/**
+ * Add packets of train to batch, each one gets its own copy of the RTP header
+ */
+static int rtp_batch_packet_train(rtp_session_t *session, rtp_packet_train_t *train, rtp_udp_batch_t *batch)
+{
+    if (0 != rtp_udp_batch_reserve(batch, batch->count + train->count)) {
+        return -1;
+    }
+
+    IPADDRESS otherip = rtp_udp_destaddr(session);
+    for (uint32_t i = 0; i < train->count; i++) {
+        rtp_packet_t *packet = &train->packets[i];
+        uint8_t *head = batch->heads + batch->count * RTP_HEADER_SIZE;
+        memcpy(head, packet->data + RTP_TCP_HEAD_SIZE, RTP_HEADER_SIZE);
+        nbo_w16(head + 2, session->sn);
+        nbo_w32(head + 4, packet->timestamp + session->ts_offset);
+        nbo_w32(head + 8, session->rtphdr.ssrc);
+
+        udpsocket_msg_t *msg = &batch->msgs[batch->count++];
+        msg->socket = session->RtpSocket;
+        msg->destaddr = otherip;
+        msg->destport = session->session_info.rtp_port;
+        msg->iovcnt = 3;
+        msg->iov[0].iov_len = RTP_HEADER_SIZE;
+        msg->iov[1].iov_base = packet->data + RTP_TCP_HEAD_SIZE + RTP_HEADER_SIZE;
+        msg->iov[1].iov_len = packet->header_size;
+        msg->iov[2].iov_base = (void *)packet->payload;
+        msg->iov[2].iov_len = packet->payload_size;
+        rtp_sent(session, packet);
+        session->sn++;
+    }
+    session->self->rtp_clock = rtpclock();
+    return 0;
+}
+
+bool rtp_has_room(rtp_session_t *session, uint32_t packets, uint32_t bytes)
+{
+    if (RTP_OVER_TCP != session->session_info.transport_mode) {
+        return true;
+    }
+    return send_queue_has_room(session->session_info.send_queue, packets,
+                               bytes + packets * (RTP_HEADER_SIZE + RTP_TCP_HEAD_SIZE));
+}
+
+int rtp_send_packet_train(rtp_session_t *session, rtp_packet_train_t *train, rtp_udp_batch_t *batch, bool admitted)
+{
+    send_queue_t *queue = session->session_info.send_queue;
+    if (RTP_OVER_TCP == session->session_info.transport_mode && !admitted) {
+        // a slow viewer skips whole frames rather than getting broken ones
+        uint32_t bytes = 0;
+        for (uint32_t i = 0; i < train->count; i++) {
+            bytes += train->packets[i].size;
+        }
+        if (!rtp_has_room(session, train->count, bytes)) {
+            queue->dropped += train->count;
+            ESP_LOGD(TAG, "send queue is full (%u bytes pending), drop frame", send_queue_depth(queue));
+            return -1;
+        }
+    } else if (batch) {
+        return rtp_batch_packet_train(session, train, batch);
+    }
+
+    for (uint32_t i = 0; i < train->count; i++) {
+        rtp_packet_t *packet = &train->packets[i];
+        uint8_t *udp_buf = packet->data + RTP_TCP_HEAD_SIZE;
+
+        // only the fields which differ between subscribers are patched
+        nbo_w16(udp_buf + 2, session->sn);
+        nbo_w32(udp_buf + 4, packet->timestamp + session->ts_offset);
+        nbo_w32(udp_buf + 8, session->rtphdr.ssrc);
+        rtp_transmit(session, packet, train);
+        rtp_sent(session, packet);
+        session->sn++;
+    }
+    session->self->rtp_clock = rtpclock();
+    if (RTP_OVER_TCP == session->session_info.transport_mode) {
+        send_queue_flush(queue);
+    }
+    return 0;
+}
+
+/**
+ * Whether we sent RTP during the last two report intervals
+ */
+static inline int rtp_we_sent(rtp_session_t *session)
+{
+	return (session->self->rtp_clock + 2*RTCP_REPORT_INTERVAL*1000 > rtpclock()) ? 1 : 0;
 }
 
 int rtp_onreceived(void* rtp, const void* data, int bytes)
 {
-	struct rtp_context *session = (struct rtp_context *)rtp;
+	rtp_session_t *session = (rtp_session_t *)rtp;
 	return rtcp_input_rtp(session, data, bytes);
 }
 
 int rtp_onreceived_rtcp(void* rtp, const void* rtcp, int bytes)
 {
-	struct rtp_context *session = (struct rtp_context *)rtp;
-	return rtcp_input_rtcp(session, rtcp, bytes);
+	rtp_session_t *session = (rtp_session_t *)rtp;
+	int r = rtcp_input_rtcp(session, rtcp, bytes);
+	if(r >= 0)
+	{
+		session->rtcp_received = rtpclock(); // the peer is alive, e.g. it sent a receiver report
+	}
+	return r;
 }
 
 int rtp_rtcp_report(void* rtp, void* data, int bytes)
 {
 	int n;
-	struct rtp_context *session = (struct rtp_context *)rtp;
-
-#pragma message("update we_sent flag")
-	// don't send packet in 2T
-	//session->role = RTP_RECEIVER
+	rtp_session_t *session = (rtp_session_t *)rtp;
 
-	if(RTP_SENDER == session->role)
+	// a sender which didn't send RTP in 2T reports as a receiver (RFC3550 6.4)
+	if(RTP_SENDER == session->role && rtp_we_sent(session))
 	{
-		// send RTP in 2T
 		n = rtcp_sr_pack(session, (uint8_t*)data, bytes);
 	}
 	else
 	{
-		assert(RTP_RECEIVER == session->role);
 		n = rtcp_rr_pack(session, (uint8_t*)data, bytes);
 	}
 
@@ -298,36 +559,243 @@ int rtp_rtcp_report(void* rtp, void* data, int bytes)
 
 int rtp_rtcp_bye(void* rtp, void* data, int bytes)
 {
-	struct rtp_context *session = (struct rtp_context *)rtp;
+	rtp_session_t *session = (rtp_session_t *)rtp;
 	return rtcp_bye_pack(session, (uint8_t*)data, bytes);
 }
 
 int rtp_rtcp_interval(void* rtp)
 {
-	double interval;
-	struct rtp_context *session = (struct rtp_context *)rtp;
-	interval = rtcp_interval(rtp_member_list_count(session->members),
+	rtp_session_t *session = (rtp_session_t *)rtp;
+	return rtcp_interval(rtp_member_list_count(session->members),
 		rtp_member_list_count(session->senders) + ((RTP_SENDER==session->role) ? 1 : 0),
 		session->rtcp_bw, 
-		(session->self->rtp_clock + 2*RTCP_REPORT_INTERVAL*1000 > rtpclock()) ? 1 : 0,
+		rtp_we_sent(session),
 		session->avg_rtcp_size,
 		session->init);
-
-	return (int)(interval * 1000);
 }
 
 const char* rtp_get_cname(void* rtp, uint32_t ssrc)
 {
 	rtp_member *member;
-	struct rtp_context *session = (struct rtp_context *)rtp;
+	rtp_session_t *session = (rtp_session_t *)rtp;
 	member = rtp_member_list_find(session->members, ssrc);
 	return member ? (char*)member->sdes[RTCP_SDES_CNAME].data : NULL;
 }
 
+int rtp_get_qos(void* rtp, rtp_qos_t *qos)
+{
+	int i;
+	rtp_member *member, *last;
+	rtp_session_t *session = (rtp_session_t *)rtp;
+
+	last = NULL;
+	for(i = 0; i < rtp_member_list_count(session->members); i++)
+	{
+		member = rtp_member_list_get(session->members, i);
+		if(member->qos.reports > 0 && (NULL == last ||
+			(int32_t)(member->qos.history[member->qos.head].time_ms - last->qos.history[last->qos.head].time_ms) > 0))
+			last = member;
+	}
+	if(NULL == last)
+		return -1;
+
+	memcpy(qos, &last->qos, sizeof(rtp_qos_t));
+	return 0;
+}
+
 const char* rtp_get_name(void* rtp, uint32_t ssrc)
 {
 	rtp_member *member;
-	struct rtp_context *session = (struct rtp_context *)rtp;
+	rtp_session_t *session = (rtp_session_t *)rtp;
 	member = rtp_member_list_find(session->members, ssrc);
 	return member ? (char*)member->sdes[RTCP_SDES_NAME].data : NULL;
 }
+
+/**
+ * Send the compound RTCP packet of bytes which is built in rtcp_buffer after RTP_TCP_HEAD_SIZE bytes of headroom
+ */
+static int rtp_rtcp_transmit(rtp_session_t *session, int bytes)
+{
+    int ret = -1;
+    uint8_t *RtcpBuf = session->rtcp_buffer;
+
+    if (RTP_OVER_TCP == session->session_info.transport_mode) {
+        RtcpBuf[0] = '$';
+        RtcpBuf[1] = session->session_info.rtcp_channel;
+        RtcpBuf[2] = (bytes & 0x0000FF00) >> 8;
+        RtcpBuf[3] = (bytes & 0x000000FF);
+        ret = send_queue_push(session->session_info.send_queue, RtcpBuf, RTP_TCP_HEAD_SIZE + bytes);
+        if (0 == ret) {
+            send_queue_flush(session->session_info.send_queue);
+        }
+    } else if (session->session_info.rtcp_mux) {
+        // RFC 5761 RTCP shares the ports of RTP
+        if (udpsocketsend(session->RtpSocket, RtcpBuf + RTP_TCP_HEAD_SIZE, bytes,
+                          session->session_info.dest_addr, session->session_info.rtp_port) == bytes) {
+            ret = 0;
+        }
+    } else if (udpsocketsend(session->RtcpSocket, RtcpBuf + RTP_TCP_HEAD_SIZE, bytes,
+                             session->session_info.dest_addr, session->session_info.rtcp_port) == bytes) {
+        ret = 0;
+    }
+
+    // RFC3550 6.3.3 avg_rtcp_size = 1/16 * packet_size + 15/16 * avg_rtcp_size
+    bytes += RTCP_LOWER_HEADER_SIZE;
+    session->avg_rtcp_size = session->avg_rtcp_size ? rtcp_avg_size_update(session->avg_rtcp_size, bytes) : bytes * 16;
+    return ret;
+}
+
+int rtp_rtcp_timer(rtp_session_t *session)
+{
+    if (session->rtcp_bye) {
+        return RTCP_REPORT_INTERVAL;
+    }
+
+    uint64_t clock = rtpclock();
+    if (0 != session->rtcp_next && clock < session->rtcp_next) {
+        return (int)((session->rtcp_next - clock + 999) / 1000);
+    }
+
+    if (0 != session->rtcp_next) {
+        // RFC3550 6.3.6 timer reconsideration, a group which has grown moves the report later
+        rtcp_expire_members(session, clock);
+        uint64_t next = session->rtcp_last + (uint64_t)rtp_rtcp_interval(session) * 1000;
+        if (next > clock) {
+            session->rtcp_next = next;
+            return (int)((next - clock + 999) / 1000);
+        }
+
+        int n = rtp_rtcp_report(session, session->rtcp_buffer + RTP_TCP_HEAD_SIZE, RTCP_PACKET_MAX_SIZE);
+        if (n > 0 && n <= RTCP_PACKET_MAX_SIZE) {
+            rtp_rtcp_transmit(session, n);
+        }
+    }
+
+    int interval = rtp_rtcp_interval(session);
+    session->rtcp_next = clock + (uint64_t)interval * 1000;
+    session->rtcp_last = clock;
+    session->rtcp_pmembers = rtp_member_list_count(session->members);
+    return interval;
+}
+
+int rtp_rtcp_send_bye(rtp_session_t *session)
+{
+    // RFC3550 6.3.7 a participant which never sent RTP or RTCP must not send BYE,
+    // avg_rtcp_size stays 0 until the first report is sent
+    if (session->rtcp_bye || NULL == session->self || (0 == session->self->rtp_packets && 0 == session->avg_rtcp_size)) {
+        return 0;
+    }
+    session->rtcp_bye = 1;
+
+    uint8_t *rtcp = session->rtcp_buffer + RTP_TCP_HEAD_SIZE;
+    int n = rtp_rtcp_report(session, rtcp, RTCP_PACKET_MAX_SIZE);
+    if (n <= 0 || n > RTCP_PACKET_MAX_SIZE - 8) {
+        return -1;
+    }
+    n += rtp_rtcp_bye(session, rtcp + n, RTCP_PACKET_MAX_SIZE - n);
+    return rtp_rtcp_transmit(session, n);
+}
+
+#if defined(_DEBUG) || defined(DEBUG)
+#define RTP_TEST_POOL_BASE   56980
+#define RTP_TEST_POOL_PAIRS  16 // pairs taken by others are skipped
+#define RTP_TEST_PT          26 // JPEG
+
+// a frame of 3 packets to 2 viewers on the loopback goes out with one flush, each viewer with its own header.
+// It needs the TCP/IP stack, so it is run on the host rather than by the example.
+void rtp_udp_batch_test(void)
+{
+    static const uint8_t payload[3][100] = { { 1 }, { 2 }, { 3 } };
+    UDPSOCKET viewer = udpsocketcreate(0);
+    udp_port_pool_t *pool = udp_port_pool_create(RTP_TEST_POOL_BASE, RTP_TEST_POOL_PAIRS, false);
+    rtp_packet_train_t *train = rtp_packet_train_create(2, RTP_PACKET_SLOT_SIZE);
+    rtp_udp_batch_t *batch = rtp_udp_batch_create(2);
+    assert(viewer && pool && train && batch);
+
+    // any free port for the viewer
+    struct sockaddr_in bound;
+    socklen_t bound_len = sizeof(bound);
+    assert(0 == getsockname(viewer, (struct sockaddr *)&bound, &bound_len));
+    uint16_t viewer_port = ntohs(bound.sin_port);
+
+    rtp_session_t *session[2];
+    uint16_t sn[2];
+    for (uint32_t i = 0; i < 2; i++) {
+        rtp_session_info_t info = {
+            .transport_mode = RTP_OVER_UDP,
+            .socket_tcp = NULLSOCKET,
+            .send_queue = NULL,
+            .dest_addr = htonl(INADDR_LOOPBACK),
+            .rtp_port = viewer_port,
+            .rtcp_port = (uint16_t)(viewer_port + 1),
+            .rtsp_channel = 0,
+            .rtcp_channel = 0,
+            .ttl = 0,
+            .port_pool = pool,
+            .udp_shared = NULL,
+            .rtcp_mux = 0,
+        };
+        session[i] = rtp_session_create(&info, 0x1000 + i, 0, 90000, 0, 1);
+        assert(session[i]);
+        sn[i] = session[i]->sn;
+    }
+
+    // the train grows beyond its capacity, the payload header stays in the packet slot
+    for (uint32_t i = 0; i < 3; i++) {
+        rtp_packet_t *packet = rtp_packet_train_alloc(train);
+        assert(packet);
+        packet->header_size = 2;
+        packet->data[RTP_TCP_HEAD_SIZE + RTP_HEADER_SIZE] = 0xA0;
+        packet->data[RTP_TCP_HEAD_SIZE + RTP_HEADER_SIZE + 1] = (uint8_t)i;
+        packet->payload = payload[i];
+        packet->payload_size = sizeof(payload[i]);
+        packet->size = packet->header_size + packet->payload_size;
+        packet->timestamp = 9000;
+        packet->type = RTP_TEST_PT;
+        packet->is_last = (2 == i);
+    }
+    rtp_packet_train_write_headers(train);
+    assert(0 == rtp_send_packet_train(session[0], train, batch, false));
+    assert(0 == rtp_send_packet_train(session[1], train, batch, false));
+    assert(6 == batch->count);
+    int calls = rtp_udp_batch_flush(batch);
+#if (CONFIG_IDF_TARGET_ESP32 || CONFIG_IDF_TARGET_ESP32S2 || CONFIG_IDF_TARGET_ESP32S3)
+    assert(6 == calls && 0 == batch->count); // lwip has no sendmmsg()
+#else
+    assert(2 == calls && 0 == batch->count); // one sendmmsg() for the packets of each session socket
+#endif
+
+    // loopback datagrams may arrive after the send returns
+    socketpoll_t *poll = socketpollcreate(1);
+    assert(poll && 0 == socketpolladd(poll, viewer, SOCKETPOLL_READ, NULL));
+    uint32_t received[2] = { 0 };
+    uint8_t buf[200];
+    socketpoll_event_t event;
+    while (received[0] + received[1] < 6 && socketpollwait(poll, &event, 1, 1000) > 0) {
+        IPADDRESS addr;
+        IPPORT port;
+        ssize_t len;
+        while ((len = udpsocketrecv(viewer, buf, sizeof(buf), &addr, &port)) > 0) {
+            uint32_t ssrc = nbo_r32(buf + 8);
+            assert(ssrc == 0x1000 || ssrc == 0x1001);
+            uint32_t s = ssrc - 0x1000;
+            uint32_t i = received[s]++;
+            assert(RTP_HEADER_SIZE + 2 + 100 == len);
+            assert(0x80 == buf[0] && (buf[1] & 0x7F) == RTP_TEST_PT && (buf[1] >> 7) == (2 == i));
+            assert(nbo_r16(buf + 2) == (uint16_t)(sn[s] + i));
+            assert(nbo_r32(buf + 4) == 9000 + session[s]->ts_offset);
+            assert(0xA0 == buf[RTP_HEADER_SIZE] && i == buf[RTP_HEADER_SIZE + 1]);
+            assert(0 == memcmp(buf + RTP_HEADER_SIZE + 2, payload[i], 100));
+        }
+    }
+    assert(3 == received[0] && 3 == received[1]);
+
+    socketpolldelete(poll);
+    rtp_session_delete(session[0]);
+    rtp_session_delete(session[1]);
+    rtp_udp_batch_delete(batch);
+    rtp_packet_train_release(train);
+    udp_port_pool_delete(pool);
+    udpsocketclose(viewer);
+}
+#endif
@@ -2,6 +2,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "platglue.h"
 #include "rtcp-header.h"
 #include "rtp.h"
@@ -84,33 +85,83 @@ typedef struct {
 	const void* payload; // payload
 	int payloadlen; // payload length in bytes
 */	
-	uint8_t *data;
-    uint32_t size;	//RTP packet size in byte
+	uint8_t *data;          // TCP prefix, RTP header, then header_size bytes of payload header
+    uint32_t size;	//RTP payload size in byte, header_size + payload_size
+    uint32_t header_size;   // payload header in data, e.g. RFC 2435 JPEG header
+    const uint8_t *payload; // payload bytes referenced in place, not copied into data
+    uint32_t payload_size;
     uint32_t timestamp;
     uint8_t  type;
     uint8_t is_last;
 
 } rtp_packet_t;
 
+/**
+ * Packets of one frame, built once and shared by all subscribers of a stream.
+ * Every packet owns a slot of `stride` bytes: TCP prefix, RTP header and payload header.
+ * Payloads point into the frame of the caller until rtp_packet_train_detach().
+ */
+typedef struct {
+    int32_t ref;
+    uint32_t count;       // packets in use
+    uint32_t capacity;    // packets allocated
+    uint32_t stride;      // bytes of one packet slot
+    uint8_t *buffer;
+    uint8_t *payloads;    // payloads copied by rtp_packet_train_detach()
+    rtp_packet_t *packets;
+} rtp_packet_train_t;
+
+/**
+ * UDP datagrams gathered from several sessions, sent together by rtp_udp_batch_flush()
+ */
+typedef struct {
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t syscalls;    // send calls made by the last flush
+    udpsocket_msg_t *msgs;
+    uint8_t *heads;       // RTP_HEADER_SIZE bytes of each message, patched for its session
+} rtp_udp_batch_t;
+
+/**
+ * RTP and RTCP sockets of the server shared by all UDP tracks, viewers are told apart by address and SSRC
+ */
+typedef struct {
+    UDPSOCKET rtp_socket;
+    UDPSOCKET rtcp_socket;
+    uint16_t port;         // RTP port, RTCP uses port + 1
+} rtp_udp_shared_t;
+
 //传输模式，套接字，                                                                  
 typedef struct {
     transport_mode_t transport_mode;
     SOCKET socket_tcp;// tcp
+    struct send_queue_t *send_queue; // output queue of socket_tcp, used for rtp over tcp
+    IPADDRESS dest_addr; // udp, resolved once at SETUP, 0 means the peer of socket_tcp; multicast group
     uint16_t rtp_port;// udp
 	uint16_t rtcp_port;// udp
     uint16_t rtsp_channel; //channel for rtsp over tcp
+    uint16_t rtcp_channel; // interleaved channel of RTCP over tcp
+    uint8_t ttl;           // multicast, time to live of the datagrams
+    struct udp_port_pool_t *port_pool; // udp and multicast, where the server port pair is taken from
+    const rtp_udp_shared_t *udp_shared; // udp, sockets used instead of a pair of port_pool, NULL if none
+    uint8_t rtcp_mux;      // udp, RTCP goes over the RTP ports (RFC 5761)
 
 } rtp_session_info_t;
 
+#define RTP_HEADER_SIZE        12  // size of the RTP header
+#define RTP_TCP_HEAD_SIZE      4
+#define RTCP_PACKET_MAX_SIZE   256 // compound report sent by us: SR or RR, SDES and BYE
+
 typedef struct {
     rtp_session_info_t session_info;
     rtp_hdr_t rtphdr;
-	rtcp_hdr_t rtcphdr;
     int RtpServerPort;
     int RtcpServerPort;
     int RtpSocket;
     int RtcpSocket;
+    uint8_t rtp_connected; // RtpSocket is connected to the destination
     uint16_t sn;
+    uint32_t ts_offset;   // random offset added to media timestamp
 
 //	void* cbparam;
 
@@ -119,19 +170,26 @@ typedef struct {
 	rtp_member *self;
 
 	// RTP/RTCP
-	int avg_rtcp_size;  //计算interval时用到
+	int avg_rtcp_size;  //计算interval时用到, in 1/16 octets
 	int rtcp_bw;
 	int rtcp_cycle; // for RTCP SDES
 	int frequence;
 	int init;
 	int role;  //sender or receiver 
+	uint64_t rtcp_next;  // rtpclock() when the next report is due, 0 if not scheduled yet
+	uint64_t rtcp_last;  // rtpclock() of the last report, tp of RFC3550 6.3
+	int rtcp_pmembers;   // members when rtcp_next was computed
+	rtp_member_pool_t member_pool; // members of the sources, reused as receivers come and go
+	uint8_t rtcp_bye;    // BYE was sent, no more reports
+	uint64_t rtcp_received; // rtpclock() when a valid RTCP packet of a peer was last received, 0 if never
+	uint8_t rtcp_buffer[RTP_TCP_HEAD_SIZE + RTCP_PACKET_MAX_SIZE];
 
 }rtp_session_t;
 
-#define RTP_HEADER_SIZE        12  // size of the RTP header
 #define MAX_RTP_PAYLOAD_SIZE   1420 //1460  1500-20-12-8
 #define RTP_VERSION            2
-#define RTP_TCP_HEAD_SIZE      4
+#define MAX_RTP_PAYLOAD_HEADER_SIZE 144 // RFC 2435 main, restart marker and quantization table headers
+#define RTP_PACKET_SLOT_SIZE   (RTP_TCP_HEAD_SIZE + RTP_HEADER_SIZE + MAX_RTP_PAYLOAD_HEADER_SIZE)
 
 #define RTCP_SR_RR_HEADER_SIZE   8
 #define MAX_RTCP1_PAYLOAD_SIZE   1420 //1460  1500-20-8-8
@@ -161,6 +219,61 @@ uint16_t rtp_GetRtcpServerPort(rtp_session_t *session);
 //rtp发送包
 int rtp_send_packet(rtp_session_t *session, rtp_packet_t *packet);
 
+rtp_packet_train_t *rtp_packet_train_create(uint32_t capacity, uint32_t stride);
+
+void rtp_packet_train_addref(rtp_packet_train_t *train);
+
+void rtp_packet_train_release(rtp_packet_train_t *train);
+
+/**
+ * Take the next free packet slot of train, the train grows when it is full
+ *
+ * @return packet with data pointing to the slot, NULL if out of memory
+ */
+rtp_packet_t *rtp_packet_train_alloc(rtp_packet_train_t *train);
+
+/**
+ * Empty the train for the next frame
+ */
+void rtp_packet_train_reset(rtp_packet_train_t *train);
+
+/**
+ * Copy the payloads into the train, so that it outlives the frame of the caller.
+ * Needed only while someone else still references the train, e.g. a send queue.
+ */
+int rtp_packet_train_detach(rtp_packet_train_t *train);
+
+/**
+ * Write the RTP header fields shared by all subscribers, once per frame
+ */
+void rtp_packet_train_write_headers(rtp_packet_train_t *train);
+
+/**
+ * Check whether packets with bytes of payload headers and payloads can be sent now, always true but over TCP
+ */
+bool rtp_has_room(rtp_session_t *session, uint32_t packets, uint32_t bytes);
+
+/**
+ * Send all packets of train, patching only sequence number, timestamp and SSRC of this session
+ *
+ * @param batch if not NULL, UDP packets are added to it instead of being sent,
+ *              the train must stay untouched until the batch is flushed
+ * @param admitted the frame was already found to fit, e.g. by media_stream_parts_begin() for a part of it,
+ *                 so a TCP send queue takes the packets whatever its room
+ */
+int rtp_send_packet_train(rtp_session_t *session, rtp_packet_train_t *train, rtp_udp_batch_t *batch, bool admitted);
+
+rtp_udp_batch_t *rtp_udp_batch_create(uint32_t capacity);
+
+void rtp_udp_batch_delete(rtp_udp_batch_t *batch);
+
+/**
+ * Send and empty the batch
+ *
+ * @return number of send calls made
+ */
+int rtp_udp_batch_flush(rtp_udp_batch_t *batch);
+
 /// RTP receive notify
 /// @param[in] rtp RTP object
 /// @param[in] data RTP packet(include RTP Header)
@@ -191,9 +304,47 @@ int rtp_rtcp_bye(void* rtp, void* rtcp, int bytes);
 
 /// get RTCP interval
 /// @param[in] rtp RTP object
-/// 0-ok, <0-error
+/// @return milliseconds until the next report, randomized as RFC3550 6.3.1
 int rtp_rtcp_interval(void* rtp);
 
+/// get the reception quality at the receiver which reported last
+/// @param[in] rtp RTP object
+/// @param[out] qos copy of its quality record
+/// @return 0-ok, -1 if no receiver reported about us yet
+int rtp_get_qos(void* rtp, rtp_qos_t *qos);
+
+/**
+ * Send the compound SR/RR and SDES report of session when it is due
+ *
+ * @return milliseconds until the next report is due
+ */
+int rtp_rtcp_timer(rtp_session_t *session);
+
+/**
+ * Say goodbye with a compound report and BYE, once, reports stop afterwards
+ */
+int rtp_rtcp_send_bye(rtp_session_t *session);
+
+/**
+ * Socket of the server where RTCP of the viewer arrives
+ */
+static inline UDPSOCKET rtp_rtcp_socket(rtp_session_t *session)
+{
+    return session->session_info.rtcp_mux ? session->RtpSocket : session->RtcpSocket;
+}
+
+/**
+ * Microseconds of a monotonic clock, the time base of reports and rtcp_received
+ */
+uint64_t rtpclock(void);
+
+#if defined(_DEBUG) || defined(DEBUG)
+void rtp_udp_batch_test(void);
+void rtp_time_test(void);
+void rtcp_interval_test(void);
+void rtcp_estimate_test(void);
+#endif
+
 
 
 #ifdef __cplusplus
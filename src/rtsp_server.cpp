@@ -2,23 +2,506 @@
 #include <stdio.h>
 #include <string.h>
 #include "esp_log.h"
-#include "esp_timer.h"
-#include "rtp.h"
-#include "media_mjpeg.h"
+#include "rtsp_server.h"
 
 static const char *TAG = "rtsp_server";
 
-typedef struct {
+#define RTSP_SERVER_CHECK(a, str, ret_val)                       \
+    if (!(a))                                                     \
+    {                                                             \
+        ESP_LOGE(TAG, "%s(%d): %s", __FUNCTION__, __LINE__, str); \
+        return (ret_val);                                         \
+    }
 
-}rtsp_server_t;
+rtsp_server_t *rtsp_server_create(uint16_t port, uint8_t max_clients)
+{
+    rtsp_server_t *server = (rtsp_server_t *)calloc(1, sizeof(rtsp_server_t));
+    RTSP_SERVER_CHECK(NULL != server, "memory for rtsp server is not enough", NULL);
+
+    server->port = (0 == port) ? 554 : port;
+    server->max_clients = (0 == max_clients) ? RTSP_SERVER_MAX_CLIENTS : max_clients;
+    server->max_client_sessions = 2 * server->max_clients;
+    SLIST_INIT(&server->session_list);
+    LIST_INIT(&server->client_list);
+    // one session per bucket when all are in use
+    server->session_buckets = 1;
+    while (server->session_buckets < server->max_client_sessions) {
+        server->session_buckets <<= 1;
+    }
+    server->client_sessions = (struct rtsp_client_sessions_list_t *)malloc(server->session_buckets *
+                              sizeof(struct rtsp_client_sessions_list_t));
+    if (NULL == server->client_sessions) {
+        ESP_LOGE(TAG, "memory for rtsp sessions is not enough");
+        free(server);
+        return NULL;
+    }
+    for (size_t i = 0; i < server->session_buckets; i++) {
+        LIST_INIT(&server->client_sessions[i]);
+    }
+    for (size_t i = 0; i < RTSP_SERVER_ROUTE_BUCKETS; i++) {
+        LIST_INIT(&server->udp_routes[i]);
+    }
+
+    sockaddr_in ServerAddr;                                 // server address parameters
+    ServerAddr.sin_family      = AF_INET;
+    ServerAddr.sin_addr.s_addr = INADDR_ANY;
+    ServerAddr.sin_port        = htons(server->port); // listen on RTSP port
+    server->listen_socket      = socket(AF_INET, SOCK_STREAM, 0);
+    if (server->listen_socket < 0) {
+        ESP_LOGE(TAG, "error can't create socket errno=%d", errno);
+        free(server->client_sessions);
+        free(server);
+        return NULL;
+    }
+
+    int enable = 1;
+    if (setsockopt(server->listen_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0) {
+        ESP_LOGE(TAG, "setsockopt(SO_REUSEADDR) failed");
+        goto err;
+    }
+
+    // bind our listen socket to the RTSP port and listen for client connections
+    if (bind(server->listen_socket, (sockaddr *)&ServerAddr, sizeof(ServerAddr)) != 0) {
+        ESP_LOGE(TAG, "error can't bind port errno=%d", errno);
+        goto err;
+    }
+    if (listen(server->listen_socket, 5) != 0) {
+        ESP_LOGE(TAG, "error can't listen socket errno=%d", errno);
+        goto err;
+    }
+    if (socketsetnonblocking(server->listen_socket) != 0) {
+        goto err;
+    }
+
+    server->port_pool = udp_port_pool_create(UDP_PORT_POOL_BASE, server->max_client_sessions * RTSP_MAX_MEDIA_STREAM, false);
+    if (NULL == server->port_pool) {
+        goto err;
+    }
+
+    // listen socket, RTSP socket of each client, RTCP sockets of each session and the shared sockets
+    server->poll = socketpollcreate(server->max_clients + server->max_client_sessions * RTSP_MAX_MEDIA_STREAM + 3);
+    if (NULL == server->poll) {
+        goto err;
+    }
+    server->poll_ctx.type = RTSP_POLL_LISTEN;
+    server->poll_ctx.owner = server;
+    if (socketpolladd(server->poll, server->listen_socket, SOCKETPOLL_READ, &server->poll_ctx) != 0) {
+        socketpolldelete(server->poll);
+        goto err;
+    }
+    ESP_LOGI(TAG, "RTSP server listening on port %hu", server->port);
+    return server;
+
+err:
+    if (server->port_pool) {
+        udp_port_pool_delete(server->port_pool);
+    }
+    closesocket(server->listen_socket);
+    free(server->client_sessions);
+    free(server);
+    return NULL;
+}
+
+static void rtsp_server_close_client(rtsp_server_t *server, rtsp_client_t *client)
+{
+    socketpollremove(server->poll, client->client_socket);
+    LIST_REMOVE(client, next);
+    server->client_num--;
+    rtsp_client_delete(client);
+}
+
+int rtsp_server_delete(rtsp_server_t *server)
+{
+    while (!LIST_EMPTY(&server->client_list)) {
+        rtsp_server_close_client(server, LIST_FIRST(&server->client_list));
+    }
+    for (size_t i = 0; i < server->session_buckets; i++) {
+        while (!LIST_EMPTY(&server->client_sessions[i])) {
+            rtsp_client_session_delete(LIST_FIRST(&server->client_sessions[i]));
+        }
+    }
+    while (!SLIST_EMPTY(&server->session_list)) {
+        rtsp_session_t *session = SLIST_FIRST(&server->session_list);
+        SLIST_REMOVE_HEAD(&server->session_list, next);
+        rtsp_session_delete(session);
+    }
+
+    udp_port_pool_delete(server->port_pool);
+    if (server->udp_shared.port) {
+        socketpollremove(server->poll, server->udp_shared.rtp_socket);
+        socketpollremove(server->poll, server->udp_shared.rtcp_socket);
+        udpsocketclose(server->udp_shared.rtp_socket);
+        udpsocketclose(server->udp_shared.rtcp_socket);
+    }
+    socketpolldelete(server->poll);
+    closesocket(server->listen_socket);
+    free(server->client_sessions);
+    free(server);
+    return 0;
+}
+
+int rtsp_server_set_udp_ports(rtsp_server_t *server, uint16_t base, uint16_t pairs, bool prebind)
+{
+    RTSP_SERVER_CHECK(0 == server->client_session_num, "ports are in use", -1);
+    udp_port_pool_t *pool = udp_port_pool_create(base, pairs, prebind);
+    RTSP_SERVER_CHECK(NULL != pool, "can't create port pool", -1);
+    udp_port_pool_delete(server->port_pool);
+    server->port_pool = pool;
+    return 0;
+}
+
+int rtsp_server_set_shared_udp(rtsp_server_t *server, uint16_t port)
+{
+    RTSP_SERVER_CHECK(0 == server->client_session_num, "ports are in use", -1);
+    RTSP_SERVER_CHECK(0 == server->udp_shared.port, "shared sockets are already set", -1);
+    RTSP_SERVER_CHECK(0 != port && 0 == (port & 1), "RTP port must be even", -1);
+    UDPSOCKET rtp_socket = udpsocketcreate(port);
+    RTSP_SERVER_CHECK(NULLSOCKET != rtp_socket, "can't bind shared RTP socket", -1);
+    UDPSOCKET rtcp_socket = udpsocketcreate(port + 1);
+    if (NULLSOCKET == rtcp_socket) {
+        udpsocketclose(rtp_socket);
+        ESP_LOGE(TAG, "can't bind shared RTCP socket");
+        return -1;
+    }
+    socketsetnonblocking(rtp_socket);
+    socketsetnonblocking(rtcp_socket);
+    server->udp_shared_poll_ctx.type = RTSP_POLL_SHARED;
+    server->udp_shared_poll_ctx.owner = server;
+    if (socketpolladd(server->poll, rtp_socket, SOCKETPOLL_READ, &server->udp_shared_poll_ctx) != 0 ||
+            socketpolladd(server->poll, rtcp_socket, SOCKETPOLL_READ, &server->udp_shared_poll_ctx) != 0) {
+        socketpollremove(server->poll, rtp_socket);
+        udpsocketclose(rtp_socket);
+        udpsocketclose(rtcp_socket);
+        return -1;
+    }
+    server->udp_shared.rtp_socket = rtp_socket;
+    server->udp_shared.rtcp_socket = rtcp_socket;
+    server->udp_shared.port = port;
+    return 0;
+}
+
+static inline uint32_t rtsp_server_route_bucket(IPADDRESS addr)
+{
+    uint32_t h = addr ^ (addr >> 16);
+    return (h ^ (h >> 8)) & (RTSP_SERVER_ROUTE_BUCKETS - 1);
+}
+
+void rtsp_server_add_udp_route(rtsp_server_t *server, rtsp_udp_route_t *route)
+{
+    IPADDRESS addr = route->rtp_session->session_info.dest_addr;
+    LIST_INSERT_HEAD(&server->udp_routes[rtsp_server_route_bucket(addr)], route, next);
+}
+
+void rtsp_server_remove_udp_route(rtsp_server_t *server, rtsp_udp_route_t *route)
+{
+    LIST_REMOVE(route, next);
+    route->rtp_session = NULL;
+}
+
+int rtsp_server_add_session(rtsp_server_t *server, rtsp_session_t *session)
+{
+    RTSP_SERVER_CHECK(NULL != session, "session is invalid", -1);
+    SLIST_INSERT_HEAD(&server->session_list, session, next);
+
+    tcpip_adapter_ip_info_t if_ip_info;
+    tcpip_adapter_get_ip_info(TCPIP_ADAPTER_IF_STA, &if_ip_info);
+    ESP_LOGI(TAG, "Add RTSP session [rtsp://%d.%d.%d.%d:%hu/%s]", IP2STR(&if_ip_info.ip), server->port, session->resource_url);
+    return 0;
+}
 
-rtsp_server_t* rtsp_server_create()
+rtsp_session_t *rtsp_server_find_session(rtsp_server_t *server, const char *url_suffix)
 {
+    rtsp_session_t *session;
+    SLIST_FOREACH(session, &server->session_list, next) {
+        size_t len = strlen(session->resource_url);
+        // the url may be the session itself or one of its tracks
+        if (0 == strncmp(url_suffix, session->resource_url, len) && ('\0' == url_suffix[len] || '/' == url_suffix[len])) {
+            return session;
+        }
+    }
     return NULL;
 }
 
-int rtsp_server_add_session(const char* session_name)
+uint32_t rtsp_server_session_hash(const char *id)
 {
+    // FNV-1a, ids come from requests and are not trusted to be random
+    uint32_t hash = 2166136261u;
+    while (*id) {
+        hash = (hash ^ (uint8_t)*id++) * 16777619u;
+    }
+    return hash;
+}
+
+int rtsp_server_add_client_session(rtsp_server_t *server, rtsp_client_session_t *cs)
+{
+    RTSP_SERVER_CHECK(server->client_session_num < server->max_client_sessions, "too many sessions", -1);
+    LIST_INSERT_HEAD(&server->client_sessions[cs->hash & (server->session_buckets - 1)], cs, next);
+    server->client_session_num++;
     return 0;
 }
 
+void rtsp_server_remove_client_session(rtsp_server_t *server, rtsp_client_session_t *cs)
+{
+    LIST_REMOVE(cs, next);
+    server->client_session_num--;
+}
+
+rtsp_client_session_t *rtsp_server_find_client_session(rtsp_server_t *server, const char *id)
+{
+    uint32_t hash = rtsp_server_session_hash(id);
+    rtsp_client_session_t *cs;
+    LIST_FOREACH(cs, &server->client_sessions[hash & (server->session_buckets - 1)], next) {
+        if (cs->hash == hash && 0 == strcmp(cs->id, id)) {
+            return cs;
+        }
+    }
+    return NULL;
+}
+
+static void rtsp_server_accept(rtsp_server_t *server)
+{
+    while (1) {
+        sockaddr_in ClientAddr;                                   // address parameters of a new RTSP client
+        socklen_t ClientAddrLen = sizeof(ClientAddr);
+        SOCKET client_socket = accept(server->listen_socket, (struct sockaddr *)&ClientAddr, &ClientAddrLen);
+        if (client_socket < 0) {
+            break; // no more pending connections
+        }
+
+        if (server->client_num >= server->max_clients) {
+            ESP_LOGW(TAG, "Too many clients, reject %s", inet_ntoa(ClientAddr.sin_addr));
+            closesocket(client_socket);
+            continue;
+        }
+
+        if (socketsetnonblocking(client_socket) != 0) {
+            closesocket(client_socket);
+            continue;
+        }
+        rtsp_client_t *client = rtsp_client_create(server, client_socket);
+        if (NULL == client) {
+            closesocket(client_socket);
+            continue;
+        }
+        client->poll_events = SOCKETPOLL_READ;
+        client->poll_ctx.type = RTSP_POLL_CLIENT;
+        client->poll_ctx.owner = client;
+        if (socketpolladd(server->poll, client_socket, client->poll_events, &client->poll_ctx) != 0) {
+            rtsp_client_delete(client);
+            continue;
+        }
+        LIST_INSERT_HEAD(&server->client_list, client, next);
+        server->client_num++;
+        ESP_LOGI(TAG, "Client connected. Client address: %s", inet_ntoa(ClientAddr.sin_addr));
+    }
+}
+
+/**
+ * Watch writability only for clients with pending output, media is queued between polls
+ */
+static void rtsp_server_update_interest(rtsp_server_t *server)
+{
+    rtsp_client_t *client;
+    LIST_FOREACH(client, &server->client_list, next) {
+        uint32_t events = SOCKETPOLL_READ;
+        if (send_queue_depth(client->send_queue)) {
+            events |= SOCKETPOLL_WRITE;
+        }
+        if (events != client->poll_events) {
+            socketpollmodify(server->poll, client->client_socket, events, &client->poll_ctx);
+            client->poll_events = events;
+        }
+    }
+}
+
+/**
+ * On ports shared with RTP, RTCP packet types are 192-223 (RFC 5761 4)
+ */
+static inline bool rtsp_server_is_rtcp(const uint8_t *data, ssize_t n)
+{
+    return n >= 8 && data[1] >= 192 && data[1] <= 223;
+}
+
+/**
+ * SSRC of the first report block of a SR or RR, i.e. our SSRC of the track reported on, 0 if there is none
+ */
+static uint32_t rtsp_server_rtcp_reportee(const uint8_t *data, ssize_t n)
+{
+    uint8_t pt = data[1];
+    uint32_t offset = (RTCP_SR == pt) ? 28 : 8; // SR carries the sender info first
+    if ((RTCP_SR != pt && RTCP_RR != pt) || 0 == (data[0] & 0x1f) || n < (ssize_t)offset + 4) {
+        return 0;
+    }
+    const uint8_t *p = data + offset;
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/**
+ * Feed the RTCP datagrams of a UDP track to its rtp session
+ */
+static void rtsp_server_recv_rtcp(rtsp_server_t *server, rtp_session_t *rtp_session)
+{
+    while (1) {
+        IPADDRESS addr;
+        IPPORT port;
+        ssize_t n = udpsocketrecv(rtp_rtcp_socket(rtp_session), server->buffer, sizeof(server->buffer), &addr, &port);
+        if (n < 0) {
+            break;
+        }
+        // only the viewer of the track reports on it, from its RTCP port or about our SSRC when a NAT changed the port
+        const rtp_session_info_t *info = &rtp_session->session_info;
+        if (addr != info->dest_addr || !rtsp_server_is_rtcp(server->buffer, n)) {
+            continue;
+        }
+        uint32_t ssrc = rtsp_server_rtcp_reportee(server->buffer, n);
+        if (port == (info->rtcp_mux ? info->rtp_port : info->rtcp_port) || (ssrc && ssrc == rtp_session->self->ssrc)) {
+            rtp_onreceived_rtcp(rtp_session, server->buffer, n);
+        }
+    }
+}
+
+/**
+ * Find the track a datagram on the shared sockets reports on, by the address and port of the viewer,
+ * or by the reported SSRC when a NAT changed the port
+ */
+static rtp_session_t *rtsp_server_find_udp_route(rtsp_server_t *server, IPADDRESS addr, IPPORT port,
+                                                 const uint8_t *data, ssize_t n)
+{
+    uint32_t ssrc = rtsp_server_rtcp_reportee(data, n);
+    rtp_session_t *by_ssrc = NULL;
+    rtsp_udp_route_t *route;
+    LIST_FOREACH(route, &server->udp_routes[rtsp_server_route_bucket(addr)], next) {
+        rtp_session_info_t *info = &route->rtp_session->session_info;
+        if (addr != info->dest_addr) {
+            continue;
+        }
+        if (port == (info->rtcp_mux ? info->rtp_port : info->rtcp_port)) {
+            return route->rtp_session;
+        }
+        if (ssrc && ssrc == route->rtp_session->self->ssrc) {
+            by_ssrc = route->rtp_session;
+        }
+    }
+    return by_ssrc;
+}
+
+/**
+ * Feed the RTCP datagrams of the shared sockets to the rtp sessions of their viewers
+ */
+static void rtsp_server_recv_shared(rtsp_server_t *server)
+{
+    UDPSOCKET sockets[2] = {server->udp_shared.rtp_socket, server->udp_shared.rtcp_socket};
+    for (size_t i = 0; i < 2; i++) {
+        while (1) {
+            IPADDRESS addr;
+            IPPORT port;
+            ssize_t n = udpsocketrecv(sockets[i], server->buffer, sizeof(server->buffer), &addr, &port);
+            if (n < 0) {
+                break;
+            }
+            if (!rtsp_server_is_rtcp(server->buffer, n)) {
+                continue; // e.g. a keepalive of a NAT
+            }
+            rtp_session_t *rtp_session = rtsp_server_find_udp_route(server, addr, port, server->buffer, n);
+            if (rtp_session) {
+                rtp_onreceived_rtcp(rtp_session, server->buffer, n);
+            }
+        }
+    }
+}
+
+/**
+ * Delete the expired sessions and run the RTCP timers of all streams
+ *
+ * @return milliseconds until the next report or expiry, -1 if nothing is scheduled
+ */
+static int rtsp_server_timer(rtsp_server_t *server)
+{
+    int next = -1;
+    for (size_t i = 0; i < server->session_buckets; i++) {
+        rtsp_client_session_t *cs = LIST_FIRST(&server->client_sessions[i]);
+        while (cs) {
+            rtsp_client_session_t *cs_next = LIST_NEXT(cs, next);
+            int left = rtsp_client_session_time_left(cs);
+            if (left <= 0) {
+                // the viewer is gone or did TEARDOWN, its ports and buffers are released and BYE is sent
+                if (!cs->closing) {
+                    ESP_LOGW(TAG, "session %s timed out", cs->id);
+                }
+                rtsp_client_session_delete(cs);
+                cs = cs_next;
+                continue;
+            }
+            int ms = rtsp_client_session_rtcp_timer(cs);
+            if (ms >= 0 && ms < left) {
+                left = ms;
+            }
+            if (next < 0 || left < next) {
+                next = left;
+            }
+            cs = cs_next;
+        }
+    }
+    rtsp_session_t *session;
+    SLIST_FOREACH(session, &server->session_list, next) {
+        int ms = rtsp_session_rtcp_timer(session);
+        if (ms >= 0 && (next < 0 || ms < next)) {
+            next = ms;
+        }
+    }
+    return next;
+}
+
+int rtsp_server_poll(rtsp_server_t *server, int timeout_ms)
+{
+    socketpoll_event_t events[RTSP_SERVER_MAX_EVENTS];
+    // reports are sent and sessions expired before waiting, the wait ends in time for the next one
+    int timer_ms = rtsp_server_timer(server);
+    if (timer_ms >= 0 && (timeout_ms < 0 || timer_ms < timeout_ms)) {
+        timeout_ms = timer_ms;
+    }
+    rtsp_server_update_interest(server);
+    int n = socketpollwait(server->poll, events, RTSP_SERVER_MAX_EVENTS, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        rtsp_poll_ctx_t *ctx = (rtsp_poll_ctx_t *)events[i].ctx;
+        if (RTSP_POLL_LISTEN == ctx->type) {
+            rtsp_server_accept(server);
+            continue;
+        }
+        if (RTSP_POLL_RTCP == ctx->type) {
+            rtsp_server_recv_rtcp(server, (rtp_session_t *)ctx->owner);
+            continue;
+        }
+        if (RTSP_POLL_SHARED == ctx->type) {
+            rtsp_server_recv_shared(server);
+            continue;
+        }
+
+        rtsp_client_t *client = (rtsp_client_t *)ctx->owner;
+        if (client->state & RTSP_CLIENT_STATE_CLOSING) {
+            continue;
+        }
+        if (events[i].events & SOCKETPOLL_WRITE) {
+            if (send_queue_flush(client->send_queue) < 0) {
+                client->state |= RTSP_CLIENT_STATE_CLOSING;
+                continue;
+            }
+        }
+        if (events[i].events & SOCKETPOLL_READ) {
+            if (-3 == rtsp_client_handle_requests(client)) {
+                client->state |= RTSP_CLIENT_STATE_CLOSING;
+            }
+        }
+    }
+
+    // clients are closed after all events are handled, events may still refer to them
+    rtsp_client_t *client = LIST_FIRST(&server->client_list);
+    while (client) {
+        rtsp_client_t *next = LIST_NEXT(client, next);
+        if (client->state & RTSP_CLIENT_STATE_CLOSING) {
+            rtsp_server_close_client(server, client);
+        }
+        client = next;
+    }
+    return n;
+}
@@ -1,11 +1,109 @@
-
 #pragma once
 
+#include <sys/queue.h>
+#include "rtsp_session.h"
+#include "udp_port_pool.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#define RTSP_SERVER_MAX_CLIENTS  12      // default of max concurrent clients
+#define RTSP_SERVER_MAX_EVENTS   16      // events handled by one poll
+#define RTSP_SERVER_ROUTE_BUCKETS   16   // buckets of the viewers on the shared UDP sockets, power of 2
+
+typedef struct rtsp_server_t {
+    SOCKET listen_socket;                             // socket that listens for RTSP client connections
+    uint16_t port;
+    socketpoll_t *poll;
+    rtsp_poll_ctx_t poll_ctx;                         // of listen_socket
+    uint8_t buffer[RTSP_BUFFER_SIZE];                 // responses and RTCP datagrams, one event at a time
+    uint8_t max_clients;
+    uint8_t client_num;
+    uint16_t max_client_sessions;                     // twice max_clients, sessions may outlive connections
+    uint16_t client_session_num;
+    uint16_t session_buckets;                         // of client_sessions, the power of 2 from max_client_sessions
+    udp_port_pool_t *port_pool;                       // server ports of UDP and multicast tracks
+    rtp_udp_shared_t udp_shared;                      // port is 0 unless all UDP tracks share two sockets
+    rtsp_poll_ctx_t udp_shared_poll_ctx;              // of both shared sockets
+    struct rtsp_udp_routes_list_t udp_routes[RTSP_SERVER_ROUTE_BUCKETS]; // by address of the viewer
+    SLIST_HEAD(rtsp_sessions_list_t, rtsp_session_t) session_list;
+    LIST_HEAD(rtsp_clients_list_t, rtsp_client_t) client_list;
+    struct rtsp_client_sessions_list_t *client_sessions; // by hash of Session ID
+} rtsp_server_t;
+
+/**
+ * @brief Create a RTSP server listening on the port
+ *
+ * @param port RTSP port, 0 means default port 554
+ * @param max_clients max concurrent clients, 0 means RTSP_SERVER_MAX_CLIENTS
+ */
+rtsp_server_t *rtsp_server_create(uint16_t port, uint8_t max_clients);
+
+int rtsp_server_delete(rtsp_server_t *server);
+
+/**
+ * @brief Set the server ports of UDP tracks, before any client sets up a track
+ *
+ * The default is a pair for every track of all sessions, from UDP_PORT_POOL_BASE.
+ *
+ * @param base even RTP port of the first pair
+ * @param pairs number of port pairs, i.e. max UDP and multicast tracks
+ * @param prebind bind all sockets now, SETUP then takes a pair without any system call
+ */
+int rtsp_server_set_udp_ports(rtsp_server_t *server, uint16_t base, uint16_t pairs, bool prebind);
+
+/**
+ * @brief Send all UDP tracks from one RTP socket and take their RTCP on one RTCP socket,
+ * before any client sets up a track. Viewers are told apart by address and SSRC.
+ *
+ * @param port even RTP port, RTCP uses port + 1, both outside the range of rtsp_server_set_udp_ports()
+ */
+int rtsp_server_set_shared_udp(rtsp_server_t *server, uint16_t port);
+
+/**
+ * @brief Route the RTCP of a UDP track on the shared sockets to its rtp session
+ */
+void rtsp_server_add_udp_route(rtsp_server_t *server, rtsp_udp_route_t *route);
+
+void rtsp_server_remove_udp_route(rtsp_server_t *server, rtsp_udp_route_t *route);
+
+/**
+ * @brief Publish a session on the server, the server takes the ownership of it
+ */
+int rtsp_server_add_session(rtsp_server_t *server, rtsp_session_t *session);
+
+/**
+ * @brief Find the session which a request url suffix (e.g. "mjpeg/1/trackID=0") belongs to
+ */
+rtsp_session_t *rtsp_server_find_session(rtsp_server_t *server, const char *url_suffix);
+
+/**
+ * @brief Hash of a Session ID, which selects its bucket
+ */
+uint32_t rtsp_server_session_hash(const char *id);
+
+/**
+ * @brief Register a session set up by a client, its id and hash must be set
+ *
+ * @return 0 on success, -1 if the server has too many sessions
+ */
+int rtsp_server_add_client_session(rtsp_server_t *server, rtsp_client_session_t *cs);
+
+void rtsp_server_remove_client_session(rtsp_server_t *server, rtsp_client_session_t *cs);
+
+/**
+ * @brief Find a session by the Session ID of a request
+ */
+rtsp_client_session_t *rtsp_server_find_client_session(rtsp_server_t *server, const char *id);
+
+/**
+ * @brief Wait for socket events and serve all ready clients
+ *
+ * @param timeout_ms max time to wait, e.g. time left until next media frame
+ * @return number of handled events, <0 on error
+ */
+int rtsp_server_poll(rtsp_server_t *server, int timeout_ms);
 
 #ifdef __cplusplus
 }
@@ -1,8 +1,12 @@
 
 #include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <time.h>
 #include "esp_log.h"
 #include "rtsp_session.h"
+#include "rtsp_server.h"
 #include "media_mjpeg.h"
 
 
@@ -113,344 +117,705 @@ static const char *METHOD_GET_PARAMETER = "GET_PARAMETER";
 static const char *METHOD_SET_PARAMETER = "SET_PARAMETER";
 
 
-static char *FindFirstCrlf(const char *str)
+/**
+ * Method of a request line in constant time, the length and first letter leave one candidate
+ */
+static rtsp_method_t rtsp_method_lookup(const char *name, uint32_t len)
 {
-    while (*str) {
-        if (str[0] == '\r' && str[1] == '\n') {
-            return (char *)str;
+    const char *candidate = NULL;
+    rtsp_method_t method = RTSP_UNKNOWN;
+    switch (len) {
+    case 4: candidate = METHOD_PLAY; method = RTSP_PLAY; break;
+    case 5:
+        if ('P' == name[0]) {
+            candidate = METHOD_PAUSE; method = RTSP_PAUSE;
+        } else {
+            candidate = METHOD_SETUP; method = RTSP_SETUP;
+        }
+        break;
+    case 6: candidate = METHOD_RECORD; method = RTSP_RECORD; break;
+    case 7: candidate = METHOD_OPTIONS; method = RTSP_OPTIONS; break;
+    case 8:
+        if ('D' == name[0]) {
+            candidate = METHOD_DESCRIBE; method = RTSP_DESCRIBE;
+        } else if ('A' == name[0]) {
+            candidate = METHOD_ANNOUNCE; method = RTSP_ANNOUNCE;
+        } else {
+            candidate = METHOD_TEARDOWN; method = RTSP_TEARDOWN;
+        }
+        break;
+    case 13:
+        if ('G' == name[0]) {
+            candidate = METHOD_GET_PARAMETER; method = RTSP_GET_PARAMETER;
+        } else {
+            candidate = METHOD_SET_PARAMETER; method = RTSP_SET_PARAMETER;
         }
-        str++;
+        break;
+    default: break;
     }
-    return NULL;
+    return (candidate && 0 == memcmp(name, candidate, len)) ? method : RTSP_UNKNOWN;
 }
 
-static int ParseRequestLine(rtsp_session_t *session, const char *message)
+/**
+ * Case insensitive match of a token which is not terminated against name
+ */
+static inline bool rtsp_token_is(const char *token, uint32_t len, const char *name)
 {
-    char method[32] = {0};
-    char *url = session->url;
-    char version[32] = {0};
+    return 0 == strncasecmp(token, name, len) && '\0' == name[len];
+}
 
-    if (sscanf(message, "%s %s %s", method, url, version) != 3) {
-        return 1;
-    }
-    char *url_end = &url[strlen(url) - 1];
-    if (*url_end == '/') {
-        *url_end = '\0'; // The character '/' at the end of url may cause some trouble in later processing, remove it.
+/**
+ * Parse the digits at p, before end
+ *
+ * @return position after the digits, NULL if there are none or the value doesn't fit in 32 bits
+ */
+static const char *rtsp_parse_uint(const char *p, const char *end, uint32_t *value)
+{
+    const char *start = p;
+    *value = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        uint32_t digit = *p++ - '0';
+        if (*value > (UINT32_MAX - digit) / 10) {
+            return NULL;
+        }
+        *value = *value * 10 + digit;
     }
+    return p == start ? NULL : p;
+}
 
-    // Get rtsp method
-    if (strstr(method, METHOD_OPTIONS)) {
-        session->method = RTSP_OPTIONS;
-    } else if (strstr(method, METHOD_DESCRIBE)) {
-        session->method = RTSP_DESCRIBE;
-    } else if (strstr(method, METHOD_SETUP)) {
-        session->method = RTSP_SETUP;
-    } else if (strstr(method, METHOD_PLAY)) {
-        session->method = RTSP_PLAY;
-    } else if (strstr(method, METHOD_TEARDOWN)) {
-        session->method = RTSP_TEARDOWN;
-    } else if (strstr(method, METHOD_PAUSE)) {
-        session->method = RTSP_PAUSE;
-    } else if (strstr(method, METHOD_ANNOUNCE)) {
-        session->method = RTSP_ANNOUNCE;
-    } else if (strstr(method, METHOD_GET_PARAMETER)) {
-        session->method = RTSP_GET_PARAMETER;
-    } else if (strstr(method, METHOD_SET_PARAMETER)) {
-        session->method = RTSP_SET_PARAMETER;
-    } else {
-        session->method = RTSP_UNKNOWN;
-        return 1;
+/**
+ * Parse a range like "5000-5001", the second number is optional
+ *
+ * @return number of values found
+ */
+static int rtsp_parse_range(const char *p, const char *end, uint32_t *first, uint32_t *second)
+{
+    p = rtsp_parse_uint(p, end, first);
+    if (NULL == p) {
+        return 0;
     }
-
-    if (strncmp(url, "rtsp://", 7) != 0) {
-        return 1;
+    if (p < end && '-' == *p && rtsp_parse_uint(p + 1, end, second)) {
+        return 2;
     }
+    return 1;
+}
 
-    // parse url
-    if (sscanf(url + 7, "%[^:]:%hu/%s", session->url_ip, &session->url_port, session->url_suffix) == 3) {
-
-    } else if (sscanf(url + 7, "%[^/]/%s", session->url_ip, session->url_suffix) == 2) {
-        session->url_port = 554; // set to default port
-    } else {
-        return 1;
+/**
+ * Parse the first transport specification of a Transport header, e.g. "RTP/AVP;unicast;client_port=5000-5001"
+ */
+static void rtsp_parse_transport(rtsp_client_t *client, const char *value, const char *end)
+{
+    client->transport_mode = RTP_OVER_UDP;
+    client->rtcp_mux = 0;
+    bool first = true;
+    const char *p = value;
+    while (p < end && ',' != *p) {
+        const char *param = p;
+        while (p < end && ';' != *p && ',' != *p) {
+            p++;
+        }
+        uint32_t len = p - param;
+        const char *eq = (const char *)memchr(param, '=', len);
+        uint32_t name_len = eq ? eq - param : len;
+        uint32_t a = 0, b = 0;
+
+        if (first) {
+            if (rtsp_token_is(param, len, "RTP/AVP/TCP")) {
+                client->transport_mode = RTP_OVER_TCP;
+            }
+        } else if (rtsp_token_is(param, len, "multicast")) {
+            client->transport_mode = RTP_OVER_MULTICAST;
+        } else if (rtsp_token_is(param, len, "RTCP-mux")) {
+            client->rtcp_mux = 1;
+        } else if (eq && (rtsp_token_is(param, name_len, "client_port") || rtsp_token_is(param, name_len, "port"))) {
+            int n = rtsp_parse_range(eq + 1, p, &a, &b);
+            if (n > 0) {
+                client->m_ClientRTPPort = a;
+                client->m_ClientRTCPPort = (2 == n) ? b : a + 1;
+                ESP_LOGI(TAG, "rtsp client port %d-%d", client->m_ClientRTPPort, client->m_ClientRTCPPort);
+            }
+        } else if (eq && rtsp_token_is(param, name_len, "interleaved")) {
+            int n = rtsp_parse_range(eq + 1, p, &a, &b);
+            if (n > 0) {
+                client->rtp_channel = a;
+                client->rtcp_channel = (2 == n) ? b : a + 1;
+                ESP_LOGI(TAG, "RTP channel=%d, RTCP channel=%d", client->rtp_channel, client->rtcp_channel);
+            }
+        }
+        first = false;
+        if (p < end && ';' == *p) {
+            p++;
+        }
     }
-    ESP_LOGD(TAG, "url:%s", session->url);
-    ESP_LOGD(TAG, "url_suffix:%s", session->url_suffix);
-    return 0;
 }
 
-static int ParseHeadersLine(rtsp_session_t *session, const char *message)
+/**
+ * Split the url of the request line into host, port and suffix, e.g. "rtsp://192.168.1.2:8554/mjpeg/1"
+ *
+ * @return 0 on success, RTSP status code otherwise
+ */
+static int rtsp_parse_url(rtsp_client_t *client, const char *url, uint32_t len)
 {
-    ESP_LOGD(TAG, "<%s>", message);
-    char *TmpPtr = NULL;
-    TmpPtr = (char *)strstr(message, "CSeq: ");
-    if (TmpPtr) {
-        session->CSeq  = atoi(TmpPtr + 6);
-        return 0;
+    if (len >= RTSP_PARAM_STRING_MAX) {
+        return 414;
     }
-
-    if (session->method == RTSP_DESCRIBE || session->method == RTSP_SETUP || session->method == RTSP_PLAY) {
-        // ParseAuthorization(message);
+    memcpy(client->url, url, len);
+    // The character '/' at the end of url may cause some trouble in later processing, remove it.
+    if (len && '/' == client->url[len - 1]) {
+        len--;
     }
-
-    if (session->method == RTSP_OPTIONS) {
-        session->parse_state = PARSE_STATE_GOTALL;
-        return 0;
+    client->url[len] = '\0';
+    client->url_ip[0] = '\0';
+    client->url_suffix[0] = '\0';
+    client->url_port = 554; // default port
+    if (1 == len && '*' == url[0]) {
+        return 0; // the server itself, e.g. OPTIONS *
     }
-
-    if (session->method == RTSP_DESCRIBE) {
-        session->parse_state = PARSE_STATE_GOTALL;
-        return 0;
+    if (len < 7 || 0 != strncasecmp(url, "rtsp://", 7)) {
+        return 400;
     }
 
-    if (session->method == RTSP_SETUP) {
-        TmpPtr = (char *)strstr(message, "Transport");
-        if (TmpPtr) { // parse transport header
-            TmpPtr = (char *)strstr(TmpPtr, "RTP/AVP/TCP");
-            if (TmpPtr) {
-                session->transport_mode = RTP_OVER_TCP;
-            } else {
-                session->transport_mode = RTP_OVER_UDP;
-            }
+    const char *host = client->url + 7;
+    const char *end = client->url + len;
+    const char *slash = (const char *)memchr(host, '/', end - host);
+    const char *host_end = slash ? slash : end;
+    const char *colon = (const char *)memchr(host, ':', host_end - host);
+    if (colon) {
+        uint32_t port;
+        if (rtsp_parse_uint(colon + 1, host_end, &port) != host_end || port > 0xffff) {
+            return 400;
+        }
+        client->url_port = port;
+    }
+    uint32_t host_len = (colon ? colon : host_end) - host;
+    if (host_len >= sizeof(client->url_ip)) {
+        return 400;
+    }
+    memcpy(client->url_ip, host, host_len);
+    client->url_ip[host_len] = '\0';
+    if (slash) {
+        strcpy(client->url_suffix, slash + 1);
+    }
+    ESP_LOGD(TAG, "url:%s", client->url);
+    ESP_LOGD(TAG, "url_suffix:%s", client->url_suffix);
+    return 0;
+}
 
-            TmpPtr = (char *)strstr(message, "multicast");
-            if (TmpPtr) {
-                session->transport_mode = RTP_OVER_MULTICAST;
-                ESP_LOGD(TAG, "multicast");
-            } else {
-                ESP_LOGD(TAG, "unicast");
-            }
+/**
+ * Parse the head of a request in a single pass, in place without modifying it.
+ * The head is the request line and headers up to and including the empty line.
+ *
+ * @param content_length set to the size of the body following the head
+ * @return 0 on success, RTSP status code to answer otherwise, 413 if the body doesn't fit in the receive buffer
+ */
+static int rtsp_parse_request(rtsp_client_t *client, const char *head, uint32_t size, uint32_t *content_length)
+{
+    const char *end = head + size;
+    const char *line_end = (const char *)memchr(head, '\r', size);
+    ESP_LOGD(TAG, "<%.*s>", (int)(line_end - head), head);
+
+    // request line: method SP url SP version
+    const char *sp1 = (const char *)memchr(head, ' ', line_end - head);
+    const char *sp2 = sp1 ? (const char *)memchr(sp1 + 1, ' ', line_end - sp1 - 1) : NULL;
+    client->method = RTSP_UNKNOWN;
+    client->CSeq = 0;
+    client->session_id[0] = '\0';
+    *content_length = 0;
+    int status = 0;
+    if (NULL == sp2) {
+        status = 400;
+    } else {
+        client->method = rtsp_method_lookup(head, sp1 - head);
+        status = rtsp_parse_url(client, sp1 + 1, sp2 - sp1 - 1);
+        if (0 == status && (line_end - sp2 - 1 < 7 || 0 != memcmp(sp2 + 1, "RTSP/1.", 7))) {
+            status = 505;
+        }
+    }
 
-            char *ClientPortPtr = NULL;
-            if (RTP_OVER_UDP == session->transport_mode) {
-                ClientPortPtr = (char *)strstr(message, "client_port=");
-            } else if (RTP_OVER_MULTICAST == session->transport_mode) {
-                ClientPortPtr = (char *)strstr(message, "port=");
+    // headers: name ':' value CRLF, until the empty line
+    const char *line = line_end + 2;
+    while (line < end) {
+        line_end = (const char *)memchr(line, '\r', end - line);
+        if (NULL == line_end || line_end == line) {
+            break;
+        }
+        const char *colon = (const char *)memchr(line, ':', line_end - line);
+        if (colon) {
+            uint32_t name_len = colon - line;
+            const char *value = colon + 1;
+            while (value < line_end && ' ' == *value) {
+                value++;
             }
-            if (ClientPortPtr) {
-                ClientPortPtr += (RTP_OVER_UDP == session->transport_mode) ? 12 : 5;
-                char cp[16] = {0};
-                char *p = strchr(ClientPortPtr, '-');
-                if (p) {
-                    strncpy(cp, ClientPortPtr, p - ClientPortPtr);
-                    session->m_ClientRTPPort  = atoi(cp);
-                    session->m_ClientRTCPPort = session->m_ClientRTPPort + 1;
-                    ESP_LOGI(TAG, "rtsp client port %d-%d", session->m_ClientRTPPort, session->m_ClientRTCPPort);
-                } else {
-                    return 1;
+            uint32_t n;
+            switch (name_len) {
+            case 4:
+                if (rtsp_token_is(line, name_len, "CSeq") && rtsp_parse_uint(value, line_end, &n)) {
+                    client->CSeq = n;
                 }
-            }
-
-            if (RTP_OVER_TCP == session->transport_mode) {
-                TmpPtr = (char *)strstr(message, "interleaved=");
-                if (TmpPtr) {
-                    if (sscanf(TmpPtr += 12, "%hu-%hu", &session->rtp_channel, &session->rtcp_channel) == 2) {
-                        ESP_LOGI(TAG, "RTP channel=%d, RTCP channel=%d", session->rtp_channel, session->rtcp_channel);
+                break;
+            case 7:
+                if (rtsp_token_is(line, name_len, "Session")) {
+                    // the id ends at the parameters, e.g. ";timeout=60"
+                    const char *id_end = value;
+                    while (id_end < line_end && ';' != *id_end && ' ' != *id_end) {
+                        id_end++;
+                    }
+                    // an id longer than ours is cut to a length no session has
+                    uint32_t id_len = id_end - value;
+                    if (id_len >= sizeof(client->session_id)) {
+                        id_len = sizeof(client->session_id) - 1;
+                    }
+                    memcpy(client->session_id, value, id_len);
+                    client->session_id[id_len] = '\0';
+                }
+                break;
+            case 9:
+                if (rtsp_token_is(line, name_len, "Transport")) {
+                    rtsp_parse_transport(client, value, line_end);
+                }
+                break;
+            case 14:
+                if (rtsp_token_is(line, name_len, "Content-Length")) {
+                    if (NULL == rtsp_parse_uint(value, line_end, &n) || n > RTSP_BUFFER_SIZE - size) {
+                        return 413; // where the next request starts is not known
                     }
+                    *content_length = n;
                 }
+                break;
+            default: break; // ignored
             }
-
-            session->parse_state = PARSE_STATE_GOTALL;
         }
-        return 0;
+        line = line_end + 2;
     }
 
-    if (session->method == RTSP_PLAY) {
-        session->parse_state = PARSE_STATE_GOTALL;
-        return 0;
+    if (0 == status && RTSP_UNKNOWN == client->method) {
+        status = 501;
     }
+    return status;
+}
 
-    if (session->method == RTSP_TEARDOWN) {
-        session->parse_state = PARSE_STATE_GOTALL;
-        return 0;
-    }
+/**
+ * Whether the request is about the server or its session rather than a stream, e.g. OPTIONS * or
+ * GET_PARAMETER * as a keepalive of the session
+ */
+static inline bool rtsp_request_is_server_wide(const rtsp_client_t *client)
+{
+    return '\0' == client->url_suffix[0] &&
+           (RTSP_OPTIONS == client->method || (RTSP_GET_PARAMETER == client->method && client->session_id[0]));
+}
 
-    if (session->method == RTSP_GET_PARAMETER) {
-        session->parse_state = PARSE_STATE_GOTALL;
-        return 0;
+/**
+ * Cursor over an output buffer, data beyond the end is cut off
+ */
+typedef struct {
+    char *pos;
+    char *end;
+} rtsp_writer_t;
+
+static inline void rtsp_write(rtsp_writer_t *w, const char *data, uint32_t len)
+{
+    if (len > (uint32_t)(w->end - w->pos)) {
+        len = w->end - w->pos;
     }
+    memcpy(w->pos, data, len);
+    w->pos += len;
+}
 
-    return 1;
+static inline void rtsp_write_str(rtsp_writer_t *w, const char *str)
+{
+    rtsp_write(w, str, strlen(str));
 }
 
-static int ParseRtspRequest(rtsp_session_t *session, const char *aRequest, uint32_t aRequestSize)
+static void rtsp_write_uint(rtsp_writer_t *w, uint32_t value)
 {
-    printf("[%s]\n", aRequest);
-    if (aRequestSize < 5) {
-        printf("[%x, %x, %x, %x, %x]\n", aRequest[0], aRequest[1], aRequest[2], aRequest[3], aRequest[4]);
+    char digits[10];
+    uint32_t n = 0;
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    while (n && w->pos < w->end) {
+        *w->pos++ = digits[--n];
     }
+}
 
-    if (aRequest[0] == '$') {
-        session->method = RTSP_UNKNOWN;
-        return 0;
+/**
+ * Date header of responses, formatted again only when the second changes
+ */
+static void rtsp_write_date(rtsp_writer_t *w)
+{
+    static char date[48];
+    static uint32_t date_len;
+    static time_t date_time;
+    time_t now = time(NULL);
+    if (now != date_time || 0 == date_len) {
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        date_len = strftime(date, sizeof(date), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+        date_time = now;
     }
+    rtsp_write(w, date, date_len);
+}
 
-    session->method = RTSP_UNKNOWN;
-    session->CSeq = 0;
-    memset(session->url, 0x00, RTSP_PARAM_STRING_MAX);
-    session->parse_state = PARSE_STATE_REQUESTLINE;
-
-    int ret = 0;
-    char *string = (char *)aRequest;
-    char const *end = string + aRequestSize;
-    while (string < end) {
-        switch (session->parse_state) {
-        case PARSE_STATE_REQUESTLINE: {
-            char *firstCrlf = FindFirstCrlf((const char *)string);
-            if (firstCrlf != nullptr) {
-                firstCrlf[0] = '\0';
-                ret = ParseRequestLine(session, string);
-                string = firstCrlf + 2;
-            }
+/**
+ * Status line, CSeq and Date, the start of every response
+ */
+static void rtsp_write_status(rtsp_writer_t *w, rtsp_client_t *client, uint32_t code)
+{
+    rtsp_write_str(w, RTSP_VERSION);
+    rtsp_write(w, " ", 1);
+    rtsp_write_str(w, rtsp_get_status(code));
+    rtsp_write_str(w, "\r\nCSeq: ");
+    rtsp_write_uint(w, client->CSeq);
+    rtsp_write(w, "\r\n", 2);
+    rtsp_write_date(w);
+}
 
-            if (0 == ret) {
-                session->parse_state = PARSE_STATE_HEADERSLINE;
-            } else {
-                string = (char *)end;
-                ret = 1;
-            }
-        } break;
-
-        case PARSE_STATE_HEADERSLINE: {
-            char *firstCrlf = FindFirstCrlf((const char *)string);
-            if (firstCrlf != nullptr) {
-                firstCrlf[0] = '\0';
-                ret = ParseHeadersLine(session, string);
-                string = firstCrlf + 2;
-            } else {
-                string = (char *)end;
-                ret = 1;
-            }
-        } break;
+static void rtsp_write_session(rtsp_writer_t *w, rtsp_client_session_t *cs)
+{
+    rtsp_write_str(w, "Session: ");
+    rtsp_write_str(w, cs->id);
+    rtsp_write_str(w, ";timeout=");
+    rtsp_write_uint(w, cs->timeout);
+    rtsp_write(w, "\r\n", 2);
+}
+
+static void rtsp_write_end(rtsp_writer_t *w, char *Response, uint32_t *length)
+{
+    rtsp_write(w, "\r\n", 2);
+    *length = w->pos - Response;
+}
 
-        case PARSE_STATE_GOTALL: {
-            string = (char *)end;
-            ret = 0;
-        } break;
+static void Handle_RtspStatus(rtsp_client_t *client, uint32_t code, char *Response, uint32_t *length)
+{
+    rtsp_writer_t w = {Response, Response + *length};
+    rtsp_write_status(&w, client, code);
+    rtsp_write_end(&w, Response, length);
+}
 
-        default:
-            ret = 1;
-            break;
+static void Handle_RtspOPTION(rtsp_client_t *client, char *Response, uint32_t *length)
+{
+    rtsp_writer_t w = {Response, Response + *length};
+    rtsp_write_status(&w, client, 200);
+    rtsp_write_str(&w, "Public: OPTIONS, DESCRIBE, SETUP, TEARDOWN, PLAY, PAUSE, GET_PARAMETER\r\n");
+    rtsp_write_end(&w, Response, length);
+}
+
+/**
+ * Build the SDP of the session after the origin line, it is kept until a track changes
+ */
+static int rtsp_session_update_sdp(rtsp_session_t *session)
+{
+    char *sdp = (char *)malloc(RTSP_SDP_MAX_SIZE);
+    RTSP_SESSION_CHECK(NULL != sdp, "memory for sdp is not enough", -1);
+    rtsp_writer_t w = {sdp, sdp + RTSP_SDP_MAX_SIZE};
+
+    rtsp_write_str(&w, "s=Unnamed\r\n"
+                   "t=0 0\r\n"
+                   "a=control:*\r\n");
+    if (session->multicast_addr) {
+        rtsp_write_str(&w, "a=type:broadcast\r\n"
+                       "a=rtcp-unicast: reflection\r\n");
+    }
+
+    char str_buf[128];
+    media_streams_t *it;
+    SLIST_FOREACH(it, &session->media_list, next) {
+        if (session->multicast_addr) {
+            struct in_addr group;
+            group.s_addr = session->multicast_addr;
+            it->media_stream->get_description(it->media_stream, str_buf, sizeof(str_buf),
+                                              session->multicast_port + 2 * it->trackid);
+            rtsp_write_str(&w, str_buf);
+            rtsp_write_str(&w, "\r\nc=IN IP4 ");
+            rtsp_write_str(&w, inet_ntoa(group));
+            rtsp_write(&w, "/", 1);
+            rtsp_write_uint(&w, session->multicast_ttl);
+            rtsp_write(&w, "\r\n", 2);
+        } else {
+            it->media_stream->get_description(it->media_stream, str_buf, sizeof(str_buf), 0);
+            rtsp_write_str(&w, str_buf);
+            rtsp_write(&w, "\r\n", 2);
         }
+
+        it->media_stream->get_attribute(it->media_stream, str_buf, sizeof(str_buf));
+        rtsp_write_str(&w, str_buf);
+        rtsp_write_str(&w, "\r\na=control:trackID=");
+        rtsp_write_uint(&w, it->trackid);
+        rtsp_write(&w, "\r\n", 2);
+    }
+    if (w.pos == w.end) {
+        free(sdp);
+        ESP_LOGE(TAG, "sdp of [%s] is too large", session->resource_url);
+        return -1;
     }
 
-    return ret;
+    free(session->sdp);
+    session->sdp_len = w.pos - sdp;
+    session->sdp = (char *)realloc(sdp, session->sdp_len);
+    if (NULL == session->sdp) {
+        session->sdp = sdp; // shrinking failed, keep the large buffer
+    }
+    session->sdp_version++;
+    return 0;
 }
 
-static char const *DateHeader(char *buf, uint32_t length)
+/**
+ * Drop the cached SDP, it is built again by the next DESCRIBE
+ */
+static void rtsp_session_invalidate_sdp(rtsp_session_t *session)
 {
-    time_t tt = time(NULL);
-    strftime(buf, length, "Date: %a, %b %d %Y %H:%M:%S GMT", gmtime(&tt));
-    return buf;
+    free(session->sdp);
+    session->sdp = NULL;
+    session->sdp_len = 0;
 }
 
-static void Handle_RtspOPTION(rtsp_session_t *session, char *Response, uint32_t *length)
+/**
+ * Version and origin lines of the SDP, the only part which depends on the request,
+ * o=<username> <session id> <version> <network type> <address type> <address>
+ */
+static uint32_t rtsp_get_sdp_origin(rtsp_client_t *client, char *buf, uint32_t buf_len)
 {
-    char time_str[64];
-    if (0 != strcmp(session->url_suffix, session->resource_url)) {
-        ESP_LOGE(TAG, "[%s] Stream Not Found", session->url);
-        // Stream not available
-        int len = snprintf(Response, *length,
-                           "%s %s\r\n"
-                           "CSeq: %u\r\n"
-                           "%s\r\n",
-                           RTSP_VERSION,
-                           rtsp_get_status(404),
-                           session->CSeq,
-                           DateHeader(time_str, sizeof(time_str)));
-        if (len > 0) {
-            *length = len;
-        }
+    rtsp_writer_t w = {buf, buf + buf_len};
+    rtsp_write_str(&w, "v=0\r\no=- ");
+    rtsp_write_uint(&w, client->session->sdp_id);
+    rtsp_write(&w, " ", 1);
+    rtsp_write_uint(&w, client->session->sdp_version);
+    rtsp_write_str(&w, " IN IP4 ");
+    rtsp_write_str(&w, client->url_ip);
+    rtsp_write(&w, "\r\n", 2);
+    return w.pos - buf;
+}
+
+static void Handle_RtspDESCRIBE(rtsp_client_t *client, char *Response, uint32_t *length)
+{
+    rtsp_session_t *session = client->session;
+    if (NULL == session->sdp && 0 != rtsp_session_update_sdp(session)) {
+        Handle_RtspStatus(client, 500, Response, length);
         return;
     }
 
-    int len = snprintf(Response, *length,
-                       "%s %s\r\n"
-                       "CSeq: %u\r\n"
-                       "Public: DESCRIBE, SETUP, TEARDOWN, PLAY, PAUSE\r\n\r\n",
-                       RTSP_VERSION,
-                       rtsp_get_status(200),
-                       session->CSeq);
-    if (len > 0) {
-        *length = len;
+    char origin[64];
+    uint32_t origin_len = rtsp_get_sdp_origin(client, origin, sizeof(origin));
+
+    rtsp_writer_t w = {Response, Response + *length};
+    rtsp_write_status(&w, client, 200);
+    rtsp_write_str(&w, "Content-Base: ");
+    rtsp_write_str(&w, client->url);
+    rtsp_write_str(&w, "/\r\n"
+                   "Content-Type: application/sdp\r\n"
+                   "Content-Length: ");
+    rtsp_write_uint(&w, origin_len + session->sdp_len);
+    rtsp_write(&w, "\r\n\r\n", 4);
+    rtsp_write(&w, origin, origin_len);
+    rtsp_write(&w, session->sdp, session->sdp_len);
+    *length = w.pos - Response;
+}
+
+static inline bool rtsp_rtp_is_multicast(rtp_session_t *rtp_session)
+{
+    return RTP_OVER_MULTICAST == rtp_session->session_info.transport_mode;
+}
+
+/**
+ * Get the multicast rtp session of a track, it is created by the first client
+ */
+static rtp_session_t *rtsp_session_get_multicast(rtsp_session_t *session, media_streams_t *it, udp_port_pool_t *port_pool)
+{
+    uint32_t track = it->trackid;
+    if (NULL == session->multicast_rtp[track]) {
+        rtp_session_info_t session_info = {
+            .transport_mode = RTP_OVER_MULTICAST,
+            .socket_tcp = NULLSOCKET,
+            .send_queue = NULL,
+            .dest_addr = session->multicast_addr,
+            .rtp_port = (uint16_t)(session->multicast_port + 2 * track),
+            .rtcp_port = (uint16_t)(session->multicast_port + 2 * track + 1),
+            .rtsp_channel = 0,
+            .rtcp_channel = 0,
+            .ttl = session->multicast_ttl,
+            .port_pool = port_pool,
+            .udp_shared = NULL,
+            .rtcp_mux = 0,
+        };
+        session->multicast_rtp[track] = rtp_session_create(&session_info, GET_RANDOM(), it->media_stream->Timestamp,
+                                                           it->media_stream->clock_rate, 0, 1);
+        RTSP_SESSION_CHECK(NULL != session->multicast_rtp[track], "can't create multicast rtp session", NULL);
     }
+    session->multicast_clients[track]++;
+    return session->multicast_rtp[track];
 }
 
-static void GetSdpMessage(rtsp_session_t *session, char *buf, uint32_t buf_len, const char *session_name)
+/**
+ * Release the multicast rtp session of a track, the last client deletes it
+ */
+static void rtsp_session_put_multicast(rtsp_session_t *session, uint32_t track)
 {
-    snprintf(buf, buf_len,
-             "v=0\r\n"
-             "o=- 9%u 1 IN IP4 %s\r\n" //o=<username> <session id> <version> <network type> <address type> <address>
-             "t=0 0\r\n"
-             "a=control:*\r\n",
-             GET_RANDOM(), session->url_ip);
+    if (0 == --session->multicast_clients[track]) {
+        rtp_session_delete(session->multicast_rtp[track]);
+        session->multicast_rtp[track] = NULL;
+    }
+}
 
-    if (session_name) {
-        snprintf(buf + strlen(buf), buf_len - strlen(buf), "s=%s\r\n", session_name);
-    } else {
-        snprintf(buf + strlen(buf), buf_len - strlen(buf), "s=Unnamed\r\n");
+/**
+ * Move the session to the list of another connection, NULL detaches it
+ */
+static void rtsp_client_session_attach(rtsp_client_session_t *cs, rtsp_client_t *client)
+{
+    if (cs->client) {
+        LIST_REMOVE(cs, client_next);
+    }
+    cs->client = client;
+    if (client) {
+        LIST_INSERT_HEAD(&client->sessions, cs, client_next);
     }
+}
 
-    if (RTP_OVER_MULTICAST == session->transport_mode) {
-        snprintf(buf + strlen(buf), buf_len - strlen(buf),
-                 "a=type:broadcast\r\n"
-                 "a=rtcp-unicast: reflection\r\n");
+static rtsp_client_session_t *rtsp_client_session_create(rtsp_client_t *client)
+{
+    rtsp_client_session_t *cs = (rtsp_client_session_t *)calloc(1, sizeof(rtsp_client_session_t));
+    RTSP_SESSION_CHECK(NULL != cs, "memory for rtsp client session is not enough", NULL);
+
+    cs->server = client->server;
+    cs->session = client->session;
+    cs->timeout = RTSP_SESSION_TIMEOUT;
+    cs->last_active = rtpclock();
+    do {
+        snprintf(cs->id, sizeof(cs->id), "%08X%08X", (unsigned int)GET_RANDOM(), (unsigned int)GET_RANDOM());
+    } while (rtsp_server_find_client_session(cs->server, cs->id));
+    cs->hash = rtsp_server_session_hash(cs->id);
+    if (0 != rtsp_server_add_client_session(cs->server, cs)) {
+        free(cs);
+        return NULL;
     }
+    rtsp_client_session_attach(cs, client);
+    ESP_LOGI(TAG, "session %s created", cs->id);
+    return cs;
+}
 
-    char str_buf[128];
+/**
+ * Attach the rtp sessions to the media streams, or detach them
+ */
+static void rtsp_client_session_set_playing(rtsp_client_session_t *cs, bool playing)
+{
+    rtsp_session_t *session = cs->session;
     media_streams_t *it;
     SLIST_FOREACH(it, &session->media_list, next) {
-        if (RTP_OVER_MULTICAST == session->transport_mode) {
-            it->media_stream->get_description(it->media_stream, str_buf, sizeof(str_buf), 0);
-            snprintf(buf + strlen(buf), buf_len - strlen(buf),
-                     "%s\r\n", str_buf);
-
-            snprintf(buf + strlen(buf), buf_len - strlen(buf),
-                     "c=IN IP4 %s/255\r\n", "0.0.0.0"/*multicast_ip_.c_str()*/);
+        rtp_session_t *rtp_session = cs->rtp_session[it->trackid];
+        uint8_t bit = 1 << it->trackid;
+        if (NULL == rtp_session || playing == !!(cs->subscribed & bit)) {
+            continue;
+        }
+        cs->subscribed ^= bit;
+        if (rtsp_rtp_is_multicast(rtp_session)) {
+            // the shared session is subscribed while at least one client plays
+            uint16_t *n = &session->multicast_playing[it->trackid];
+            if (playing && 0 == (*n)++) {
+                media_stream_add_subscriber(it->media_stream, rtp_session);
+            } else if (!playing && 0 == --(*n)) {
+                media_stream_remove_subscriber(it->media_stream, rtp_session);
+            }
+        } else if (playing) {
+            media_stream_add_subscriber(it->media_stream, rtp_session);
         } else {
-            it->media_stream->get_description(it->media_stream, str_buf, sizeof(str_buf), 0);
-            snprintf(buf + strlen(buf), buf_len - strlen(buf),
-                     "%s\r\n", str_buf);
+            media_stream_remove_subscriber(it->media_stream, rtp_session);
         }
+    }
+    cs->playing = playing;
+}
 
-        it->media_stream->get_attribute(it->media_stream, str_buf, sizeof(str_buf));
-        snprintf(buf + strlen(buf), buf_len - strlen(buf),
-                 "%s\r\n", str_buf);
-        snprintf(buf + strlen(buf), buf_len - strlen(buf),
-                 "a=control:trackID=%d\r\n", it->trackid);
+void rtsp_client_session_delete(rtsp_client_session_t *cs)
+{
+    ESP_LOGI(TAG, "session %s deleted", cs->id);
+    rtsp_client_session_set_playing(cs, false);
+    for (size_t i = 0; i < RTSP_MAX_MEDIA_STREAM; i++) {
+        // unicast tracks say goodbye when deleted, a shared multicast one when its last client leaves
+        if (cs->rtp_session[i] && rtsp_rtp_is_multicast(cs->rtp_session[i])) {
+            rtsp_session_put_multicast(cs->session, i);
+        } else if (cs->rtp_session[i]) {
+            if (cs->udp_route[i].rtp_session) {
+                rtsp_server_remove_udp_route(cs->server, &cs->udp_route[i]);
+            } else if (RTP_OVER_UDP == cs->rtp_session[i]->session_info.transport_mode) {
+                socketpollremove(cs->server->poll, rtp_rtcp_socket(cs->rtp_session[i]));
+            }
+            rtp_session_delete(cs->rtp_session[i]);
+        }
+        cs->rtp_session[i] = NULL;
     }
+    rtsp_client_session_attach(cs, NULL);
+    rtsp_server_remove_client_session(cs->server, cs);
+    free(cs);
 }
 
-static void Handle_RtspDESCRIBE(rtsp_session_t *session, char *Response, uint32_t *length)
+/**
+ * Whether a track of the session is sent over the RTSP connection
+ */
+static bool rtsp_client_session_is_interleaved(rtsp_client_session_t *cs)
 {
-    char time_str[64];
-    char SDPBuf[256];
-    GetSdpMessage(session, SDPBuf, sizeof(SDPBuf), NULL);
-    int len = snprintf(Response, *length,
-                       "%s %s\r\n"
-                       "CSeq: %u\r\n"
-                       "%s\r\n"
-                       "Content-Base: %s/\r\n"
-                       "Content-Type: application/sdp\r\n"
-                       "Content-Length: %d\r\n\r\n"
-                       "%s",
-                       RTSP_VERSION,
-                       rtsp_get_status(200),
-                       session->CSeq,
-                       DateHeader(time_str, sizeof(time_str)),
-                       session->url,
-                       (int) strlen(SDPBuf),
-                       SDPBuf);
+    for (size_t i = 0; i < RTSP_MAX_MEDIA_STREAM; i++) {
+        if (cs->rtp_session[i] && RTP_OVER_TCP == cs->rtp_session[i]->session_info.transport_mode) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Create the rtp session of a track with the transport of the request
+ *
+ * @return 0 on success, RTSP status code otherwise
+ */
+static int rtsp_client_session_setup_track(rtsp_client_session_t *cs, rtsp_client_t *client, media_streams_t *it)
+{
+    uint32_t track = it->trackid;
+    if (NULL != cs->rtp_session[track]) {
+        // the transport of a track can't be changed once set up
+        bool multicast = RTP_OVER_MULTICAST == client->transport_mode;
+        return multicast != rtsp_rtp_is_multicast(cs->rtp_session[track]) ? 455 : 0;
+    }
+    if (RTP_OVER_MULTICAST == client->transport_mode) {
+        cs->rtp_session[track] = rtsp_session_get_multicast(cs->session, it, cs->server->port_pool);
+        return cs->rtp_session[track] ? 0 : 500;
+    }
 
-    if (len > 0) {
-        *length = len;
+    rtp_session_info_t session_info = {
+        .transport_mode = client->transport_mode,
+        .socket_tcp = client->client_socket,
+        .send_queue = client->send_queue,
+        .dest_addr = 0, // resolved by rtp_session_create()
+        .rtp_port = client->m_ClientRTPPort,
+        .rtcp_port = client->m_ClientRTCPPort,
+        .rtsp_channel = client->rtp_channel,
+        .rtcp_channel = client->rtcp_channel,
+        .ttl = 0,
+        .port_pool = cs->server->port_pool,
+        .udp_shared = cs->server->udp_shared.port ? &cs->server->udp_shared : NULL,
+        .rtcp_mux = (uint8_t)(RTP_OVER_UDP == client->transport_mode && client->rtcp_mux),
+    };
+    rtp_session_t *rtp_session = rtp_session_create(&session_info, GET_RANDOM(), it->media_stream->Timestamp,
+                                                    it->media_stream->clock_rate, 0, 1);
+    if (NULL == rtp_session) {
+        return 500;
+    }
+    cs->rtp_session[track] = rtp_session;
+    if (RTP_OVER_UDP == client->transport_mode && session_info.udp_shared) {
+        cs->udp_route[track].rtp_session = rtp_session;
+        rtsp_server_add_udp_route(cs->server, &cs->udp_route[track]);
+    } else if (RTP_OVER_UDP == client->transport_mode) {
+        rtsp_poll_ctx_t *ctx = &cs->rtcp_poll_ctx[track];
+        ctx->type = RTSP_POLL_RTCP;
+        ctx->owner = rtp_session;
+        if (socketpolladd(cs->server->poll, rtp_rtcp_socket(rtp_session), SOCKETPOLL_READ, ctx) != 0) {
+            ESP_LOGW(TAG, "RTCP of track %d won't be received", track);
+        }
     }
+    return 0;
 }
 
-static void Handle_RtspSETUP(rtsp_session_t *session, char *Response, uint32_t *length)
+static void Handle_RtspSETUP(rtsp_client_t *client, rtsp_client_session_t *cs, char *Response, uint32_t *length)
 {
     int32_t trackID = 0;
-    char *p = strstr(session->url_suffix, "trackID=");
+    char *p = strstr(client->url_suffix, "trackID=");
     if (p) {
         trackID = atoi(p + 8);
     } else {
@@ -459,72 +824,217 @@ static void Handle_RtspSETUP(rtsp_session_t *session, char *Response, uint32_t *
 
     ESP_LOGI(TAG, "trackID=%d", trackID);
 
-    rtp_session_info_t session_info = {
-        .transport_mode = session->transport_mode,
-        .socket_tcp = session->client_socket,
-        .rtp_port = session->m_ClientRTPPort,
-        .rtsp_channel = session->rtp_channel,
-    };
     media_streams_t *it;
-    SLIST_FOREACH(it, &session->media_list, next) {
+    SLIST_FOREACH(it, &client->session->media_list, next) {
         if (it->trackid == trackID) {
-            // it->media_stream->rtp_session = rtp_session_create(&session_info);
             break;
         }
     }
+    if (NULL == it || trackID < 0 || trackID >= RTSP_MAX_MEDIA_STREAM) {
+        ESP_LOGE(TAG, "[%s] Track Not Found", client->url);
+        Handle_RtspStatus(client, 404, Response, length);
+        return;
+    }
 
-    char Transport[128];
-    char time_str[64];
-    if (RTP_OVER_TCP == session->transport_mode) {
-        snprintf(Transport, sizeof(Transport), "RTP/AVP/TCP;unicast;interleaved=%i-%i", session->rtp_channel, session->rtcp_channel);
+    if (RTP_OVER_MULTICAST == client->transport_mode && 0 == client->session->multicast_addr) {
+        Handle_RtspStatus(client, 461, Response, length);
+        return;
+    }
+    if (cs && RTP_OVER_TCP == client->transport_mode && cs->client != client) {
+        // interleaved packets can only go over the connection using the session
+        Handle_RtspStatus(client, 455, Response, length);
+        return;
+    }
+
+    // the first SETUP creates the session, later ones add tracks to it
+    bool created = false;
+    if (NULL == cs) {
+        cs = rtsp_client_session_create(client);
+        if (NULL == cs) {
+            Handle_RtspStatus(client, 503, Response, length);
+            return;
+        }
+        created = true;
+    }
+    int status = rtsp_client_session_setup_track(cs, client, it);
+    if (0 != status) {
+        if (created) {
+            rtsp_client_session_delete(cs);
+        }
+        Handle_RtspStatus(client, status, Response, length);
+        return;
+    }
+    rtp_session_t *rtp_session = cs->rtp_session[trackID];
+
+    rtsp_writer_t w = {Response, Response + *length};
+    rtsp_write_status(&w, client, 200);
+    if (RTP_OVER_TCP == client->transport_mode) {
+        rtsp_write_str(&w, "Transport: RTP/AVP/TCP;unicast;interleaved=");
+        rtsp_write_uint(&w, client->rtp_channel);
+        rtsp_write(&w, "-", 1);
+        rtsp_write_uint(&w, client->rtcp_channel);
+    } else if (RTP_OVER_MULTICAST == client->transport_mode) {
+        struct in_addr group;
+        group.s_addr = rtp_session->session_info.dest_addr;
+        rtsp_write_str(&w, "Transport: RTP/AVP;multicast;destination=");
+        rtsp_write_str(&w, inet_ntoa(group));
+        rtsp_write_str(&w, ";port=");
+        rtsp_write_uint(&w, rtp_session->session_info.rtp_port);
+        rtsp_write(&w, "-", 1);
+        rtsp_write_uint(&w, rtp_session->session_info.rtcp_port);
+        rtsp_write_str(&w, ";ttl=");
+        rtsp_write_uint(&w, rtp_session->session_info.ttl);
     } else {
-        snprintf(Transport, sizeof(Transport),
-                 "RTP/AVP;unicast;client_port=%i-%i;server_port=%i-%i",
-                 session->m_ClientRTPPort,
-                 session->m_ClientRTCPPort,
-                 rtp_GetRtpServerPort(it->media_stream->rtp_session),
-                 rtp_GetRtcpServerPort(it->media_stream->rtp_session));
-    }
-    int len = snprintf(Response, *length,
-                       "%s %s\r\n"
-                       "CSeq: %u\r\n"
-                       "%s\r\n"
-                       "Transport: %s\r\n"
-                       "Session: %s\r\n\r\n",
-                       RTSP_VERSION,
-                       rtsp_get_status(200),
-                       session->CSeq,
-                       DateHeader(time_str, sizeof(time_str)),
-                       Transport,
-                       session->session_id);
+        rtsp_write_str(&w, "Transport: RTP/AVP;unicast;client_port=");
+        rtsp_write_uint(&w, client->m_ClientRTPPort);
+        rtsp_write(&w, "-", 1);
+        rtsp_write_uint(&w, client->m_ClientRTCPPort);
+        rtsp_write_str(&w, ";server_port=");
+        rtsp_write_uint(&w, rtp_GetRtpServerPort(rtp_session));
+        rtsp_write(&w, "-", 1);
+        rtsp_write_uint(&w, rtp_GetRtcpServerPort(rtp_session));
+        if (rtp_session->session_info.rtcp_mux) {
+            rtsp_write_str(&w, ";RTCP-mux");
+        }
+    }
+    rtsp_write(&w, "\r\n", 2);
+    rtsp_write_session(&w, cs);
+    rtsp_write_end(&w, Response, length);
+}
 
-    if (len > 0) {
-        *length = len;
+static void Handle_RtspPLAY(rtsp_client_t *client, rtsp_client_session_t *cs, char *Response, uint32_t *length)
+{
+    if (NULL == cs) {
+        Handle_RtspStatus(client, 454, Response, length);
+        return;
     }
+    rtsp_client_session_set_playing(cs, true);
+    rtsp_writer_t w = {Response, Response + *length};
+    rtsp_write_status(&w, client, 200);
+    rtsp_write_str(&w, "Range: npt=0.000-\r\n");
+    rtsp_write_session(&w, cs);
+    rtsp_write_end(&w, Response, length);
 }
 
-static void Handle_RtspPLAY(rtsp_session_t *session, char *Response, uint32_t *length)
+static void Handle_RtspPAUSE(rtsp_client_t *client, rtsp_client_session_t *cs, char *Response, uint32_t *length)
 {
-    char time_str[64];
-    int len = snprintf(Response, *length,
-                       "%s %s\r\n"
-                       "CSeq: %u\r\n"
-                       "%s\r\n"
-                       "Range: npt=0.000-\r\n"
-                       "Session: %s\r\n"
-                       "\r\n",
-                       RTSP_VERSION,
-                       rtsp_get_status(200),
-                       session->CSeq,
-                       DateHeader(time_str, sizeof(time_str)),
-                       session->session_id);
-    if (len > 0) {
-        *length = len;
+    if (NULL == cs) {
+        Handle_RtspStatus(client, 454, Response, length);
+        return;
+    }
+    rtsp_client_session_set_playing(cs, false);
+    rtsp_writer_t w = {Response, Response + *length};
+    rtsp_write_status(&w, client, 200);
+    rtsp_write_session(&w, cs);
+    rtsp_write_end(&w, Response, length);
+}
+
+static void Handle_RtspTEARDOWN(rtsp_client_t *client, rtsp_client_session_t *cs, char *Response, uint32_t *length)
+{
+    if (NULL == cs) {
+        Handle_RtspStatus(client, 454, Response, length);
+        return;
+    }
+    rtsp_writer_t w = {Response, Response + *length};
+    rtsp_write_status(&w, client, 200);
+    rtsp_write_session(&w, cs);
+    rtsp_write_end(&w, Response, length);
+    // events of this poll may still refer to its RTCP sockets
+    rtsp_client_session_set_playing(cs, false);
+    cs->closing = true;
+}
+
+// a qos line with every number at its longest, the ms with 7 digits and 3 decimals
+#define RTSP_QOS_LINE_MAX (sizeof("qos: trackID=;rtt_ms=;jitter_ms=;loss_permille=;lost=;reports=\r\n") - 1 + 4 * 10 + 2 * 11)
+
+/**
+ * Microseconds as milliseconds with 3 decimals
+ */
+static void rtsp_write_ms(rtsp_writer_t *w, uint32_t us)
+{
+    char frac[4] = {'.', (char)('0' + us / 100 % 10), (char)('0' + us / 10 % 10), (char)('0' + us % 10)};
+    rtsp_write_uint(w, us / 1000);
+    rtsp_write(w, frac, sizeof(frac));
+}
+
+/**
+ * Value of the qos parameter, a line for every unicast track which has receiver reports
+ */
+static void rtsp_write_qos(rtsp_writer_t *w, rtsp_client_session_t *cs)
+{
+    rtp_qos_t qos;
+    for (uint32_t i = 0; i < RTSP_MAX_MEDIA_STREAM; i++) {
+        if (0 != rtsp_client_session_get_qos(cs, i, &qos)) {
+            continue;
+        }
+        rtsp_write_str(w, "qos: trackID=");
+        rtsp_write_uint(w, i);
+        rtsp_write_str(w, ";rtt_ms=");
+        rtsp_write_ms(w, qos.rtt_us);
+        rtsp_write_str(w, ";jitter_ms=");
+        rtsp_write_ms(w, qos.jitter_us);
+        rtsp_write_str(w, ";loss_permille=");
+        rtsp_write_uint(w, qos.loss_permille);
+        rtsp_write_str(w, ";lost=");
+        rtsp_write_uint(w, qos.lost > 0 ? qos.lost : 0);
+        rtsp_write_str(w, ";reports=");
+        rtsp_write_uint(w, qos.reports);
+        rtsp_write(w, "\r\n", 2);
+    }
+}
+
+static void Handle_RtspGET_PARAMETER(rtsp_client_t *client, rtsp_client_session_t *cs, const char *body, uint32_t body_len,
+                                     char *Response, uint32_t *length)
+{
+    // an empty body is a keepalive, the only parameter known is qos
+    bool qos = false;
+    const char *end = body + body_len;
+    while (body < end) {
+        const char *line_end = (const char *)memchr(body, '\n', end - body);
+        const char *next = line_end ? line_end + 1 : end;
+        line_end = line_end ? line_end : end;
+        while (body < line_end && isspace((unsigned char)*body)) {
+            body++;
+        }
+        while (line_end > body && isspace((unsigned char)line_end[-1])) {
+            line_end--;
+        }
+        if (line_end > body) {
+            if (!rtsp_token_is(body, line_end - body, "qos")) {
+                Handle_RtspStatus(client, 451, Response, length);
+                return;
+            }
+            qos = true;
+        }
+        body = next;
     }
+    if (qos && NULL == cs) {
+        Handle_RtspStatus(client, 454, Response, length);
+        return;
+    }
+
+    rtsp_writer_t w = {Response, Response + *length};
+    rtsp_write_status(&w, client, 200);
+    if (cs) {
+        rtsp_write_session(&w, cs);
+    }
+    if (qos) {
+        char value[RTSP_MAX_MEDIA_STREAM * RTSP_QOS_LINE_MAX];
+        rtsp_writer_t v = {value, value + sizeof(value)};
+        rtsp_write_qos(&v, cs);
+        rtsp_write_str(&w, "Content-Type: text/parameters\r\n"
+                       "Content-Length: ");
+        rtsp_write_uint(&w, v.pos - value);
+        rtsp_write(&w, "\r\n\r\n", 4);
+        rtsp_write(&w, value, v.pos - value);
+        *length = w.pos - Response;
+        return;
+    }
+    rtsp_write_end(&w, Response, length);
 }
 
 
-static int get_optionReq(rtsp_session_t *session, char *buf, int buf_size)
+static int get_optionReq(rtsp_client_t *client, char *buf, int buf_size)
 {
     memset((void *)buf, 0, buf_size);
     int ret = snprintf(buf, buf_size,
@@ -532,20 +1042,23 @@ static int get_optionReq(rtsp_session_t *session, char *buf, int buf_size)
                        "CSeq: %u\r\n"
                        "User-Agent: %s\r\n"
                        "\r\n",
-                       METHOD_OPTIONS, session->url, RTSP_VERSION,
-                       session->CSeq + 1,
+                       METHOD_OPTIONS, client->url, RTSP_VERSION,
+                       client->CSeq + 1,
                        USER_AGENT);
 
-    session->method = RTSP_OPTIONS;
+    client->method = RTSP_OPTIONS;
     return ret;
 }
 
-static int get_announceReq(rtsp_session_t *session, char *buf, int buf_size, const char *sdp)
+static int get_announceReq(rtsp_client_t *client, char *buf, int buf_size, const char *sdp)
 {
     memset((void *)buf, 0, buf_size);
-    char time_str[64];
-    char SDPBuf[256];
-    GetSdpMessage(session, SDPBuf, sizeof(SDPBuf), NULL);
+    char SDPBuf[RTSP_SDP_MAX_SIZE];
+    if (NULL == client->session->sdp && 0 != rtsp_session_update_sdp(client->session)) {
+        return -1;
+    }
+    uint32_t len = rtsp_get_sdp_origin(client, SDPBuf, sizeof(SDPBuf) - 1);
+    len += snprintf(SDPBuf + len, sizeof(SDPBuf) - len, "%.*s", (int)client->session->sdp_len, client->session->sdp);
     int ret = snprintf(buf, buf_size,
                        "%s %s %s\r\n"
                        "Content-Type: application/sdp\r\n"
@@ -555,18 +1068,18 @@ static int get_announceReq(rtsp_session_t *session, char *buf, int buf_size, con
                        "Content-Length: %d\r\n"
                        "\r\n"
                        "%s",
-                       METHOD_ANNOUNCE, session->url, RTSP_VERSION,
-                       session->CSeq + 1,
+                       METHOD_ANNOUNCE, client->url, RTSP_VERSION,
+                       client->CSeq + 1,
                        USER_AGENT,
-                       session->session_id,
+                       client->session_id,
                        (int)strlen(SDPBuf),
                        SDPBuf);
 
-    session->method = RTSP_ANNOUNCE;
+    client->method = RTSP_ANNOUNCE;
     return ret;
 }
 
-static int get_describeReq(rtsp_session_t *session, char *buf, int buf_size)
+static int get_describeReq(rtsp_client_t *client, char *buf, int buf_size)
 {
     memset((void *)buf, 0, buf_size);
     int ret = snprintf(buf, buf_size,
@@ -575,15 +1088,15 @@ static int get_describeReq(rtsp_session_t *session, char *buf, int buf_size)
                        "Accept: application/sdp\r\n"
                        "User-Agent: %s\r\n"
                        "\r\n",
-                       METHOD_DESCRIBE, session->url, RTSP_VERSION,
-                       session->CSeq + 1,
+                       METHOD_DESCRIBE, client->url, RTSP_VERSION,
+                       client->CSeq + 1,
                        USER_AGENT);
 
-    session->method = RTSP_DESCRIBE;
+    client->method = RTSP_DESCRIBE;
     return ret;
 }
 
-static int get_setupTcpReq(rtsp_session_t *session, char *buf, int buf_size, int trackId)
+static int get_setupTcpReq(rtsp_client_t *client, char *buf, int buf_size, int trackId)
 {
     int interleaved[2] = { 0, 1 };
     if (trackId == 1) {
@@ -599,17 +1112,17 @@ static int get_setupTcpReq(rtsp_session_t *session, char *buf, int buf_size, int
                        "User-Agent: %s\r\n"
                        "Session: %s\r\n"
                        "\r\n",
-                       METHOD_SETUP, session->url, trackId, RTSP_VERSION,
+                       METHOD_SETUP, client->url, trackId, RTSP_VERSION,
                        interleaved[0], interleaved[1],
-                       session->CSeq + 1,
+                       client->CSeq + 1,
                        USER_AGENT,
-                       session->session_id);
+                       client->session_id);
 
-    session->method = RTSP_SETUP;
+    client->method = RTSP_SETUP;
     return ret;
 }
 
-static int get_recordReq(rtsp_session_t *session, const char *buf, int buf_size)
+static int get_recordReq(rtsp_client_t *client, const char *buf, int buf_size)
 {
     memset((void *)buf, 0, buf_size);
     int ret = snprintf((char *)buf, buf_size,
@@ -619,58 +1132,22 @@ static int get_recordReq(rtsp_session_t *session, const char *buf, int buf_size)
                        "User-Agent: %s\r\n"
                        "Session: %s\r\n"
                        "\r\n",
-                       METHOD_RECORD, session->url, RTSP_VERSION,
-                       session->CSeq + 1,
+                       METHOD_RECORD, client->url, RTSP_VERSION,
+                       client->CSeq + 1,
                        USER_AGENT,
-                       session->session_id);
+                       client->session_id);
 
-    session->method = RTSP_RECORD;
+    client->method = RTSP_RECORD;
     return ret;
 }
 
-rtsp_session_t *rtsp_session_create(const char *url, uint16_t port)
+rtsp_session_t *rtsp_session_create(const char *url)
 {
     rtsp_session_t *session = (rtsp_session_t *)calloc(1, sizeof(rtsp_session_t));
     RTSP_SESSION_CHECK(NULL != session, "memory for rtsp session is not enough", NULL);
 
-    strcpy(session->resource_url, url);
-    port = (0 == port) ? 554 : port;
-
-    sockaddr_in ServerAddr;                                 // server address parameters
-    ServerAddr.sin_family      = AF_INET;
-    ServerAddr.sin_addr.s_addr = INADDR_ANY;
-    ServerAddr.sin_port        = htons(port); // listen on RTSP port
-    session->MasterSocket      = socket(AF_INET, SOCK_STREAM, 0);
-
-    tcpip_adapter_ip_info_t if_ip_info;
-    char ip_str[64] = {0};
-    tcpip_adapter_get_ip_info(TCPIP_ADAPTER_IF_STA, &if_ip_info);
-    sprintf(ip_str, "rtsp://%d.%d.%d.%d", IP2STR(&if_ip_info.ip));
-    ESP_LOGI(TAG, "Creating RTSP session [%s:%hu/%s]", ip_str, port, url);
-
-    int enable = 1;
-    if (setsockopt(session->MasterSocket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0) {
-        ESP_LOGE(TAG, "setsockopt(SO_REUSEADDR) failed");
-        free(session);
-        return NULL;
-    }
-
-    // bind our master socket to the RTSP port and listen for a client connection
-    if (bind(session->MasterSocket, (sockaddr *)&ServerAddr, sizeof(ServerAddr)) != 0) {
-        ESP_LOGE(TAG, "error can't bind port errno=%d", errno);
-        free(session);
-        return NULL;
-    }
-    if (listen(session->MasterSocket, 5) != 0) {
-        ESP_LOGE(TAG, "error can't listen socket errno=%d", errno);
-        free(session);
-        return NULL;
-    }
-    snprintf(session->session_id, sizeof(session->session_id), "%X",  GET_RANDOM()); // create a session ID
-    session->m_ClientRTPPort  =  0;
-    session->m_ClientRTCPPort =  0;
-    session->transport_mode =  RTP_OVER_UDP;
-    session->state = 0;
+    strncpy(session->resource_url, url, sizeof(session->resource_url) - 1);
+    session->sdp_id = GET_RANDOM();
     SLIST_INIT(&session->media_list);
     return session;
 }
@@ -678,93 +1155,354 @@ rtsp_session_t *rtsp_session_create(const char *url, uint16_t port)
 
 int rtsp_session_delete(rtsp_session_t *session)
 {
-    media_streams_t *it;
-    SLIST_FOREACH(it, &session->media_list, next) {
+    while (!SLIST_EMPTY(&session->media_list)) {
+        media_streams_t *it = SLIST_FIRST(&session->media_list);
+        SLIST_REMOVE_HEAD(&session->media_list, next);
         it->media_stream->delete_media(it->media_stream);
         free(it);
     }
+    for (size_t i = 0; i < RTSP_MAX_MEDIA_STREAM; i++) {
+        if (session->multicast_rtp[i]) {
+            rtp_session_delete(session->multicast_rtp[i]);
+        }
+    }
 
-    closesocket(session->MasterSocket);
+    free(session->sdp);
     free(session);
     return 0;
 }
 
-int rtsp_session_accept(rtsp_session_t *session)
+int rtsp_session_set_multicast(rtsp_session_t *session, const char *group, uint16_t port, uint8_t ttl)
 {
-    sockaddr_in ClientAddr;                                   // address parameters of a new RTSP client
-    socklen_t ClientAddrLen = sizeof(ClientAddr);
-    session->client_socket = accept(session->MasterSocket, (struct sockaddr *)&ClientAddr, &ClientAddrLen);
-    session->state |= 0x01;
-    ESP_LOGI(TAG, "Client connected. Client address: %s", inet_ntoa(ClientAddr.sin_addr));
-    return 0;
-}
-
-int rtsp_session_terminate(rtsp_session_t *session)
-{
-    ESP_LOGI(TAG, "closing RTSP session");
-    media_streams_t *it;
-    SLIST_FOREACH(it, &session->media_list, next) {
-        rtp_session_delete(it->media_stream->rtp_session);
-    }
-    closesocket(session->client_socket);
+    struct in_addr addr;
+    RTSP_SESSION_CHECK(0 != inet_aton(group, &addr) && IN_MULTICAST(ntohl(addr.s_addr)), "invalid multicast group", -1);
+    RTSP_SESSION_CHECK(0 == (port & 1), "multicast RTP port must be even", -1);
+    session->multicast_addr = addr.s_addr;
+    session->multicast_port = port;
+    session->multicast_ttl = ttl ? ttl : 1;
+    rtsp_session_invalidate_sdp(session);
     return 0;
 }
 
 int rtsp_session_add_media_stream(rtsp_session_t *session, media_stream_t *media)
 {
+    RTSP_SESSION_CHECK(session->media_stream_num < RTSP_MAX_MEDIA_STREAM, "too many media streams", -1);
     media_streams_t *it = (media_streams_t *) calloc(1, sizeof(media_streams_t));
     RTSP_SESSION_CHECK(NULL != it, "memory for rtsp media is not enough", -1);
     it->media_stream = media;
     it->trackid = session->media_stream_num++;
     it->next.sle_next = NULL;
     SLIST_INSERT_HEAD(&session->media_list, it, next);
+    rtsp_session_invalidate_sdp(session);
     return 0;
 }
 
-/**
-   Read from our socket, parsing commands as possible.
- */
-int rtsp_handle_requests(rtsp_session_t *session, uint32_t readTimeoutMs)
-{
-    if (!(session->state & 0x01)) {
-        return -1;    // Already closed down
-    }
-    char *buffer = (char *)session->RecvBuf;
-    memset(buffer, 0x00, RTSP_BUFFER_SIZE);
-    int res = socketread(session->client_socket, buffer, RTSP_BUFFER_SIZE, readTimeoutMs);
-    if (res > 0) {
-        if (0 == ParseRtspRequest(session, buffer, res)) {
-            uint32_t length = RTSP_BUFFER_SIZE;
-            switch (session->method) {
-            case RTSP_OPTIONS: Handle_RtspOPTION(session, buffer, &length);
-                break;
+rtsp_client_t *rtsp_client_create(struct rtsp_server_t *server, SOCKET client_socket)
+{
+    rtsp_client_t *client = (rtsp_client_t *)calloc(1, sizeof(rtsp_client_t));
+    RTSP_SESSION_CHECK(NULL != client, "memory for rtsp client is not enough", NULL);
 
-            case RTSP_DESCRIBE: Handle_RtspDESCRIBE(session, buffer, &length);
-                break;
+    client->send_queue = send_queue_create(client_socket, RTSP_SEND_QUEUE_ITEMS, RTSP_SEND_QUEUE_BYTES);
+    if (NULL == client->send_queue) {
+        free(client);
+        return NULL;
+    }
+    client->server = server;
+    client->client_socket = client_socket;
+    LIST_INIT(&client->sessions);
+    client->m_ClientRTPPort  =  0;
+    client->m_ClientRTCPPort =  0;
+    client->transport_mode =  RTP_OVER_UDP;
+    client->state = RTSP_CLIENT_STATE_CONNECTED;
+    return client;
+}
 
-            case RTSP_SETUP: Handle_RtspSETUP(session, buffer, &length);
-                break;
+int rtsp_client_delete(rtsp_client_t *client)
+{
+    ESP_LOGI(TAG, "closing RTSP client");
+    rtsp_client_session_t *cs = LIST_FIRST(&client->sessions);
+    while (cs) {
+        rtsp_client_session_t *next = LIST_NEXT(cs, client_next);
+        if (rtsp_client_session_is_interleaved(cs)) {
+            rtsp_client_session_delete(cs);
+        } else {
+            // UDP and multicast streams don't need the connection, another one may continue the session
+            rtsp_client_session_attach(cs, NULL);
+        }
+        cs = next;
+    }
+    send_queue_delete(client->send_queue);
+    closesocket(client->client_socket);
+    free(client);
+    return 0;
+}
 
-            case RTSP_PLAY: Handle_RtspPLAY(session, buffer, &length);
-                break;
+int rtsp_client_session_rtcp_timer(rtsp_client_session_t *cs)
+{
+    int next = -1;
+    for (size_t i = 0; i < RTSP_MAX_MEDIA_STREAM; i++) {
+        rtp_session_t *rtp_session = cs->rtp_session[i];
+        if (NULL == rtp_session || !(cs->subscribed & (1 << i)) || rtsp_rtp_is_multicast(rtp_session)) {
+            continue;
+        }
+        int ms = rtp_rtcp_timer(rtp_session);
+        if (next < 0 || ms < next) {
+            next = ms;
+        }
+    }
+    return next;
+}
+
+int rtsp_client_session_time_left(rtsp_client_session_t *cs)
+{
+    if (cs->closing) {
+        return 0;
+    }
+    uint64_t last = cs->last_active;
+    for (size_t i = 0; i < RTSP_MAX_MEDIA_STREAM; i++) {
+        // a shared multicast session hears from all viewers, it can't tell whether this one is alive
+        rtp_session_t *rtp_session = cs->rtp_session[i];
+        if (rtp_session && !rtsp_rtp_is_multicast(rtp_session) && rtp_session->rtcp_received > last) {
+            last = rtp_session->rtcp_received;
+        }
+    }
+    int64_t left = (int64_t)(last + (uint64_t)cs->timeout * 1000000) - (int64_t)rtpclock();
+    return left > 0 ? (int)((left + 999) / 1000) : 0;
+}
 
-            default: break;
+int rtsp_client_session_get_qos(rtsp_client_session_t *cs, uint32_t track, rtp_qos_t *qos)
+{
+    // a shared multicast session can't tell which viewer a report comes from
+    if (track >= RTSP_MAX_MEDIA_STREAM || NULL == cs->rtp_session[track] || rtsp_rtp_is_multicast(cs->rtp_session[track])) {
+        return -1;
+    }
+    return rtp_get_qos(cs->rtp_session[track], qos);
+}
+
+int rtsp_session_rtcp_timer(rtsp_session_t *session)
+{
+    int next = -1;
+    for (size_t i = 0; i < RTSP_MAX_MEDIA_STREAM; i++) {
+        if (NULL == session->multicast_rtp[i] || 0 == session->multicast_playing[i]) {
+            continue;
+        }
+        int ms = rtp_rtcp_timer(session->multicast_rtp[i]);
+        if (next < 0 || ms < next) {
+            next = ms;
+        }
+    }
+    return next;
+}
+
+/**
+ * Hand an interleaved frame to the track of its channel, RFC 2326 10.12
+ *
+ * @return bytes of the frame, 0 if incomplete, -1 if it can't fit in RecvBuf
+ */
+static int rtsp_client_handle_interleaved(rtsp_client_t *client, const uint8_t *frame, uint32_t len)
+{
+    if (len < 4) {
+        return 0;
+    }
+    uint8_t channel = frame[1];
+    uint32_t size = ((uint32_t)frame[2] << 8) | frame[3];
+    RTSP_SESSION_CHECK(4 + size <= RTSP_BUFFER_SIZE, "interleaved frame is too large", -1);
+    if (len < 4 + size) {
+        return 0;
+    }
+
+    rtsp_client_session_t *cs;
+    LIST_FOREACH(cs, &client->sessions, client_next) {
+        for (size_t i = 0; i < RTSP_MAX_MEDIA_STREAM; i++) {
+            rtp_session_t *rtp_session = cs->rtp_session[i];
+            if (rtp_session && RTP_OVER_TCP == rtp_session->session_info.transport_mode &&
+                    channel == rtp_session->session_info.rtcp_channel) {
+                rtp_onreceived_rtcp(rtp_session, frame + 4, size);
+                return 4 + size;
             }
-            socketsend(session->client_socket, buffer, length);
-        } else {
-            ESP_LOGE(TAG, "rtsp request parse failed");
         }
-        if (session->method == RTSP_PLAY) {
-            session->state |= 0x02;
-        } else if (session->method == RTSP_TEARDOWN) {
-            session->state &= ~(0x02);
+    }
+    return 4 + size;
+}
+
+/**
+ * Handle a request and queue its response
+ *
+ * @return bytes of the request, 0 if incomplete, -3 if the response can't be sent
+ */
+static int rtsp_client_handle_request(rtsp_client_t *client, const uint8_t *data, uint32_t len)
+{
+    // look for the end of the head where the previous read stopped, the CRLFCRLF may be split
+    uint32_t i = client->RecvScan > 3 ? client->RecvScan - 3 : 0;
+    while (i + 4 <= len && 0 != memcmp(data + i, "\r\n\r\n", 4)) {
+        i++;
+    }
+    if (i + 4 > len) {
+        client->RecvScan = len;
+        return 0;
+    }
+    uint32_t size = i + 4;
+    uint32_t content_length;
+    char *buffer = (char *)client->server->buffer;
+    uint32_t length = RTSP_BUFFER_SIZE;
+    int status = rtsp_parse_request(client, (const char *)data, size, &content_length);
+    if (413 == status) {
+        // the body can't be skipped, the connection is closed after the answer
+        ESP_LOGE(TAG, "request body is too large");
+        Handle_RtspStatus(client, status, buffer, &length);
+        if (0 == send_queue_push(client->send_queue, buffer, length)) {
+            send_queue_flush(client->send_queue);
         }
-    } else if (res == 0) {
+        return -3;
+    }
+    if (len < size + content_length) {
+        client->RecvScan = i; // the head is parsed again once the body is complete
+        return 0;
+    }
+    client->RecvScan = 0;
+
+    // only GET_PARAMETER uses the body
+    rtsp_session_t *session = NULL;
+    rtsp_client_session_t *cs = NULL;
+    bool server_wide = 0 == status && rtsp_request_is_server_wide(client);
+    if (0 != status) {
+        ESP_LOGE(TAG, "rtsp request parse failed");
+        Handle_RtspStatus(client, status, buffer, &length);
+    } else if (client->session_id[0] &&
+               (NULL == (cs = rtsp_server_find_client_session(client->server, client->session_id)) || cs->closing)) {
+        ESP_LOGE(TAG, "Session %s Not Found", client->session_id);
+        Handle_RtspStatus(client, 454, buffer, &length);
+    } else if (!server_wide && NULL == (session = rtsp_server_find_session(client->server, client->url_suffix))) {
+        ESP_LOGE(TAG, "[%s] Stream Not Found", client->url);
+        Handle_RtspStatus(client, 404, buffer, &length);
+    } else if (!server_wide && cs && cs->session != session) {
+        // streams of the session belong to another resource
+        Handle_RtspStatus(client, 455, buffer, &length);
+    } else {
+        if (session) {
+            client->session = session;
+        }
+        if (cs && NULL == cs->client) {
+            rtsp_client_session_attach(cs, client); // continued by this connection
+        }
+        if (cs) {
+            cs->last_active = rtpclock(); // any request naming the session keeps it alive
+        }
+        switch (client->method) {
+        case RTSP_OPTIONS: Handle_RtspOPTION(client, buffer, &length);
+            break;
+
+        case RTSP_DESCRIBE: Handle_RtspDESCRIBE(client, buffer, &length);
+            break;
+
+        case RTSP_SETUP: Handle_RtspSETUP(client, cs, buffer, &length);
+            break;
+
+        case RTSP_PLAY: Handle_RtspPLAY(client, cs, buffer, &length);
+            break;
+
+        case RTSP_PAUSE: Handle_RtspPAUSE(client, cs, buffer, &length);
+            break;
+
+        case RTSP_TEARDOWN: Handle_RtspTEARDOWN(client, cs, buffer, &length);
+            break;
+
+        case RTSP_GET_PARAMETER: Handle_RtspGET_PARAMETER(client, cs, (const char *)data + size, content_length, buffer, &length);
+            break;
+
+        default: Handle_RtspStatus(client, 501, buffer, &length);
+            break;
+        }
+    }
+    if (0 != send_queue_push(client->send_queue, buffer, length)) {
+        ESP_LOGE(TAG, "client is too slow to take the response");
+        return -3;
+    }
+    return size + content_length;
+}
+
+int rtsp_client_handle_requests(rtsp_client_t *client)
+{
+    int res = socketrecv(client->client_socket, (char *)client->RecvBuf + client->RecvLen,
+                         RTSP_BUFFER_SIZE - client->RecvLen);
+    if (res == 0) {
         ESP_LOGI(TAG, "client closed socket, exiting");
-        session->state = 0;
+        client->state &= ~RTSP_CLIENT_STATE_CONNECTED;
+        return -3;
+    } else if (res < 0) {
+        return -1;
+    }
+    client->RecvLen += res;
+
+    // requests and interleaved frames may be pipelined in one read, or split over several
+    uint32_t offset = 0;
+    while (offset < client->RecvLen) {
+        const uint8_t *data = client->RecvBuf + offset;
+        uint32_t len = client->RecvLen - offset;
+        int used = ('$' == data[0]) ? rtsp_client_handle_interleaved(client, data, len)
+                   : rtsp_client_handle_request(client, data, len);
+        if (used < 0) {
+            return -3;
+        }
+        if (0 == used) {
+            break;
+        }
+        offset += used;
+    }
+    if (offset) {
+        client->RecvLen -= offset;
+        memmove(client->RecvBuf, client->RecvBuf + offset, client->RecvLen);
+    }
+    if (RTSP_BUFFER_SIZE == client->RecvLen) {
+        ESP_LOGE(TAG, "request is too large");
+        return -3;
+    }
+    // responses of all pipelined requests go out together
+    if (send_queue_flush(client->send_queue) < 0) {
         return -3;
-    } else  {
-        return -2;
     }
     return 0;
 }
+
+#if defined(_DEBUG) || defined(DEBUG)
+#include <assert.h>
+void rtsp_session_test(void)
+{
+    static rtsp_client_t client;
+    static const struct {
+        const char *content_length;
+        int status;
+    } cases[] = {
+        {"4", 0}, {"0", 0}, {"4096", 413}, {"4294967295", 413}, {"4294967296", 413}, {"99999999999999999999", 413},
+    };
+    char head[128];
+    uint32_t n;
+
+    assert(rtsp_parse_uint("4294967295", "4294967295" + 10, &n) && 0xFFFFFFFF == n);
+    assert(NULL == rtsp_parse_uint("4294967296", "4294967296" + 10, &n));
+    for (uint32_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        int size = snprintf(head, sizeof(head), "GET_PARAMETER rtsp://10.0.0.1/mjpeg/1 RTSP/1.0\r\nCSeq: 2\r\n"
+                            "Content-Length: %s\r\n\r\n", cases[i].content_length);
+        int status = rtsp_parse_request(&client, head, size, &n);
+        assert(status == cases[i].status);
+        // a body which is accepted fits in the receive buffer after the head
+        assert(0 != status || (n == strtoul(cases[i].content_length, NULL, 10) && size + n <= RTSP_BUFFER_SIZE));
+    }
+
+    // * is the server, it names no stream; a keepalive by GET_PARAMETER needs the session
+    static const struct {
+        const char *head;
+        bool server_wide;
+    } requests[] = {
+        {"OPTIONS * RTSP/1.0\r\nCSeq: 1\r\n\r\n", true},
+        {"GET_PARAMETER * RTSP/1.0\r\nCSeq: 3\r\nSession: 12345678\r\n\r\n", true},
+        {"GET_PARAMETER * RTSP/1.0\r\nCSeq: 3\r\n\r\n", false},
+        {"DESCRIBE * RTSP/1.0\r\nCSeq: 2\r\n\r\n", false},
+        {"OPTIONS rtsp://10.0.0.1/mjpeg/1 RTSP/1.0\r\nCSeq: 1\r\n\r\n", false},
+    };
+    for (uint32_t i = 0; i < sizeof(requests) / sizeof(requests[0]); i++) {
+        assert(0 == rtsp_parse_request(&client, requests[i].head, strlen(requests[i].head), &n));
+        assert(rtsp_request_is_server_wide(&client) == requests[i].server_wide);
+    }
+}
+#endif
@@ -2,6 +2,7 @@
 
 #include <sys/queue.h>
 #include "media_stream.h"
+#include "send_queue.h"
 
 
 #ifdef __cplusplus
@@ -10,6 +11,12 @@ extern "C" {
 
 #define RTSP_BUFFER_SIZE       4096    // for incoming requests, and outgoing responses
 #define RTSP_PARAM_STRING_MAX  128
+#define RTSP_SDP_MAX_SIZE      2048    // SDP of all tracks of a session
+#define RTSP_MAX_MEDIA_STREAM  4       // max tracks of one session
+#define RTSP_SEND_QUEUE_ITEMS  128     // max pending writes of one client
+#define RTSP_SEND_QUEUE_BYTES  (64 * 1024) // max pending bytes of one client before frames are dropped
+#define RTSP_SESSION_ID_LEN    16      // hex digits of the Session IDs given out by SETUP
+#define RTSP_SESSION_TIMEOUT   60      // default seconds a session is kept without requests
 
 
 // supported command types
@@ -27,12 +34,6 @@ typedef enum {
     RTSP_UNKNOWN
 } rtsp_method_t;
 
-typedef enum  {
-    PARSE_STATE_REQUESTLINE,
-    PARSE_STATE_HEADERSLINE,
-    PARSE_STATE_GOTALL,
-} parse_state_t;
-
 typedef struct media_streams_t {
     media_stream_t *media_stream;
     uint32_t trackid;
@@ -40,43 +41,187 @@ typedef struct media_streams_t {
     SLIST_ENTRY(media_streams_t) next;
 } media_streams_t;
 
+/**
+ * What a socket in the poll of the server belongs to, the context of its events
+ */
+typedef enum {
+    RTSP_POLL_LISTEN,
+    RTSP_POLL_CLIENT,
+    RTSP_POLL_RTCP,
+    RTSP_POLL_SHARED,                                 // UDP sockets of the server shared by all viewers
+} rtsp_poll_type_t;
+
 typedef struct {
+    rtsp_poll_type_t type;
+    void *owner;                                      // rtsp_server_t, rtsp_client_t or rtp_session_t
+} rtsp_poll_ctx_t;
+
+#define RTSP_CLIENT_STATE_CONNECTED  0x01
+#define RTSP_CLIENT_STATE_CLOSING    0x04    // closed at the end of the current event loop iteration
+
+/**
+ * A media resource which can be requested by url, e.g. "mjpeg/1"
+ */
+typedef struct rtsp_session_t {
     SLIST_HEAD(media_streams_list_t, media_streams_t) media_list;
     uint8_t media_stream_num;
 
-    char session_id[32];
-    SOCKET MasterSocket;                                      // our masterSocket(socket that listens for RTSP client connections)
-    SOCKET client_socket;                                      // RTSP socket of that session
-    IPPORT m_ClientRTPPort;                                  // client port for UDP based RTP transport
-    IPPORT m_ClientRTCPPort;                                 // client port for UDP based RTCP transport
+    char resource_url[RTSP_PARAM_STRING_MAX];         // registered url
+
+    IPADDRESS multicast_addr;                         // group for multicast transport, 0 if disabled
+    uint16_t multicast_port;                          // RTP port of track 0, track n uses port + 2 * n
+    uint8_t multicast_ttl;
+    rtp_session_t *multicast_rtp[RTSP_MAX_MEDIA_STREAM]; // one per track, shared by all multicast clients
+    uint16_t multicast_clients[RTSP_MAX_MEDIA_STREAM];   // clients which did SETUP of the track
+    uint16_t multicast_playing[RTSP_MAX_MEDIA_STREAM];   // clients of them in play state
+
+    char *sdp;                                        // cached SDP after the origin line, NULL until DESCRIBE
+    uint32_t sdp_len;
+    uint32_t sdp_id;                                  // session id and version of the origin line
+    uint32_t sdp_version;
+    /* Next session entry in the singly linked list of server */
+    SLIST_ENTRY(rtsp_session_t) next;
+} rtsp_session_t;
+
+struct rtsp_server_t;
+struct rtsp_client_t;
+
+/**
+ * A UDP track on the shared sockets of the server, RTCP from its viewer is routed by address
+ */
+typedef struct rtsp_udp_route_t {
+    rtp_session_t *rtp_session;                       // NULL if the track is not routed
+    /* Next route entry in the bucket of server */
+    LIST_ENTRY(rtsp_udp_route_t) next;
+} rtsp_udp_route_t;
+
+LIST_HEAD(rtsp_udp_routes_list_t, rtsp_udp_route_t);
+
+/**
+ * Streams set up by SETUP and identified by a Session ID, RFC 2326 12.37.
+ * The session is kept when its connection closes, unless a track is interleaved on that connection.
+ */
+typedef struct rtsp_client_session_t {
+    struct rtsp_server_t *server;
+    struct rtsp_client_t *client;                     // connection which uses the session, NULL if none
+    rtsp_session_t *session;                          // resource the tracks belong to
+    char id[RTSP_SESSION_ID_LEN + 1];
+    uint32_t hash;                                    // of id, selects the bucket in the table of server
+    uint32_t timeout;                                 // seconds, advertised in the Session header
+    uint64_t last_active;                             // rtpclock() of the last request naming the session
+    rtp_session_t *rtp_session[RTSP_MAX_MEDIA_STREAM]; // indexed by trackID
+    uint8_t subscribed;                               // bit n is set while track n is subscribed
+    bool playing;
+    bool closing;                                     // torn down, deleted before the next poll like an expired one
+    rtsp_poll_ctx_t rtcp_poll_ctx[RTSP_MAX_MEDIA_STREAM]; // of the RTCP sockets of UDP tracks
+    rtsp_udp_route_t udp_route[RTSP_MAX_MEDIA_STREAM]; // of UDP tracks on the shared sockets
+    /* Next session entry in the bucket of server, and in the list of client */
+    LIST_ENTRY(rtsp_client_session_t) next;
+    LIST_ENTRY(rtsp_client_session_t) client_next;
+} rtsp_client_session_t;
+
+LIST_HEAD(rtsp_client_sessions_list_t, rtsp_client_session_t);
+
+/**
+ * Connection state of one RTSP client
+ */
+typedef struct rtsp_client_t {
+    struct rtsp_server_t *server;
+    rtsp_session_t *session;                          // resource requested by the client
+    struct rtsp_client_sessions_list_t sessions;      // sessions used by this connection
+
+    SOCKET client_socket;                             // RTSP socket of that client
+    send_queue_t *send_queue;                         // responses and interleaved packets to client_socket
+    uint32_t poll_events;                             // SOCKETPOLL_xxx registered for client_socket
+    rtsp_poll_ctx_t poll_ctx;                         // of client_socket
+    IPPORT m_ClientRTPPort;                           // client port for UDP based RTP transport
+    IPPORT m_ClientRTCPPort;                          // client port for UDP based RTCP transport
     transport_mode_t transport_mode;
     uint16_t rtp_channel;                             // only used for rtp over tcp
     uint16_t rtcp_channel;                            // only used for rtp over tcp
+    uint8_t rtcp_mux;                                 // RTCP-mux was offered in the Transport header
 
-    uint8_t RecvBuf[RTSP_BUFFER_SIZE];
+    uint8_t RecvBuf[RTSP_BUFFER_SIZE];                // requests and interleaved frames not handled yet
+    uint32_t RecvLen;
+    uint32_t RecvScan;                                // bytes of the pending request searched for its end
     rtsp_method_t method;                             // method of the current request
     uint32_t CSeq;                                    // RTSP command sequence number
-    char url[RTSP_PARAM_STRING_MAX];                // stream url
+    char session_id[RTSP_SESSION_ID_LEN + 2];         // Session header of the request, empty if none
+    char url[RTSP_PARAM_STRING_MAX];                  // stream url
     uint16_t url_port;                                // port in url
     char url_ip[20];
     char url_suffix[RTSP_PARAM_STRING_MAX];
-    char resource_url[RTSP_PARAM_STRING_MAX];         // registered url
-    parse_state_t parse_state;
-    uint8_t state;
-} rtsp_session_t;
+    uint8_t state;                                    // RTSP_CLIENT_STATE_xxx
+    /* Next client entry in the list of server */
+    LIST_ENTRY(rtsp_client_t) next;
+} rtsp_client_t;
 
 
-rtsp_session_t *rtsp_session_create(const char *url, uint16_t port);
+rtsp_session_t *rtsp_session_create(const char *url);
 
 int rtsp_session_delete(rtsp_session_t *session);
 
-int rtsp_session_accept(rtsp_session_t *session);
-
-int rtsp_session_terminate(rtsp_session_t *session);
-
 int rtsp_session_add_media_stream(rtsp_session_t *session, media_stream_t *media);
 
-int rtsp_handle_requests(rtsp_session_t *session, uint32_t readTimeoutMs);
+/**
+ * Offer multicast transport for the session, all multicast clients share one packet stream
+ *
+ * @param group multicast group address, e.g. "239.255.255.11"
+ * @param port even RTP port of the first track, every track takes the next port pair
+ * @param ttl time to live of the datagrams
+ */
+int rtsp_session_set_multicast(rtsp_session_t *session, const char *group, uint16_t port, uint8_t ttl);
+
+rtsp_client_t *rtsp_client_create(struct rtsp_server_t *server, SOCKET client_socket);
+
+/**
+ * Stop all streams of the client and close its socket
+ */
+int rtsp_client_delete(rtsp_client_t *client);
+
+/**
+ * Read from the client socket, handling all complete requests and interleaved RTCP frames
+ *
+ * @return 0 on success, -1 no data available, -3 client closed socket
+ */
+int rtsp_client_handle_requests(rtsp_client_t *client);
+
+/**
+ * Stop the streams of the session, release them and remove the session from the server
+ */
+void rtsp_client_session_delete(rtsp_client_session_t *cs);
+
+/**
+ * Time left until the session expires, requests naming it and RTCP of its viewer keep it alive
+ *
+ * @return milliseconds, <= 0 if the session has expired
+ */
+int rtsp_client_session_time_left(rtsp_client_session_t *cs);
+
+/**
+ * Send the due RTCP reports of the unicast tracks played in the session
+ *
+ * @return milliseconds until the next report, -1 if nothing is scheduled
+ */
+int rtsp_client_session_rtcp_timer(rtsp_client_session_t *cs);
+
+/**
+ * Reception quality of a unicast track at the viewer, from its RTCP receiver reports
+ *
+ * @return 0 on success, -1 if the track is not unicast or has no report yet
+ */
+int rtsp_client_session_get_qos(rtsp_client_session_t *cs, uint32_t track, rtp_qos_t *qos);
+
+/**
+ * Send the due RTCP reports of the multicast tracks of the session
+ *
+ * @return milliseconds until the next report, -1 if nothing is scheduled
+ */
+int rtsp_session_rtcp_timer(rtsp_session_t *session);
+
+#if defined(_DEBUG) || defined(DEBUG)
+void rtsp_session_test(void);
+#endif
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "send_queue.h"
+
+static const char *TAG __attribute__((unused)) = "send_queue";
+
+#define SEND_QUEUE_CHECK(a, str, ret_val)                       \
+    if (!(a))                                                     \
+    {                                                             \
+        ESP_LOGE(TAG, "%s(%d): %s", __FUNCTION__, __LINE__, str); \
+        return (ret_val);                                         \
+    }
+
+#define SEND_QUEUE_ITEM_IOV   3 // head, payload header and payload
+
+send_queue_t *send_queue_create(SOCKET s, uint32_t capacity, uint32_t max_bytes)
+{
+    send_queue_t *queue = (send_queue_t *)calloc(1, sizeof(send_queue_t));
+    SEND_QUEUE_CHECK(NULL != queue, "memory for send queue is not enough", NULL);
+    queue->items = (send_queue_item_t *)calloc(capacity, sizeof(send_queue_item_t));
+    if (NULL == queue->items) {
+        free(queue);
+        ESP_LOGE(TAG, "memory for send queue items is insufficient");
+        return NULL;
+    }
+    queue->socket = s;
+    queue->capacity = capacity;
+    queue->max_bytes = max_bytes;
+    return queue;
+}
+
+static inline uint32_t send_queue_item_size(const send_queue_item_t *item)
+{
+    return item->head_len + (item->packet ? item->packet->size : item->size);
+}
+
+static void send_queue_pop(send_queue_t *queue)
+{
+    send_queue_item_t *item = &queue->items[queue->first];
+    if (item->train) {
+        rtp_packet_train_release(item->train);
+    }
+    free(item->data);
+    item->train = NULL;
+    item->packet = NULL;
+    item->data = NULL;
+    queue->first = (queue->first + 1) % queue->capacity;
+    queue->count--;
+}
+
+void send_queue_abort(send_queue_t *queue)
+{
+    while (queue->count) {
+        send_queue_pop(queue);
+    }
+    queue->bytes = 0;
+    queue->error = true;
+}
+
+void send_queue_delete(send_queue_t *queue)
+{
+    while (queue->count) {
+        send_queue_pop(queue);
+    }
+    free(queue->items);
+    free(queue);
+}
+
+bool send_queue_has_room(send_queue_t *queue, uint32_t items, uint32_t bytes)
+{
+    if (queue->count + items > queue->capacity) {
+        return false;
+    }
+    return 0 == queue->count || queue->bytes + bytes <= queue->max_bytes;
+}
+
+static send_queue_item_t *send_queue_append(send_queue_t *queue, const uint8_t *head, uint32_t head_len)
+{
+    SEND_QUEUE_CHECK(head_len <= SEND_QUEUE_HEAD_SIZE, "head is too long", NULL);
+    if (queue->error) {
+        return NULL;
+    }
+    if (queue->count >= queue->capacity) {
+        queue->dropped++;
+        return NULL;
+    }
+    send_queue_item_t *item = &queue->items[(queue->first + queue->count) % queue->capacity];
+    if (head_len) {
+        memcpy(item->head, head, head_len);
+    }
+    item->head_len = head_len;
+    item->packet = NULL;
+    item->train = NULL;
+    item->data = NULL;
+    item->size = 0;
+    item->offset = 0;
+    return item;
+}
+
+int send_queue_push_packet(send_queue_t *queue, const uint8_t *head, uint32_t head_len,
+                           const rtp_packet_t *packet, rtp_packet_train_t *train)
+{
+    send_queue_item_t *item = send_queue_append(queue, head, head_len);
+    if (NULL == item) {
+        return -1;
+    }
+    if (train) {
+        rtp_packet_train_addref(train);
+        item->train = train;
+        item->packet = packet;
+    } else if (packet->size) {
+        item->data = (uint8_t *)malloc(packet->size);
+        SEND_QUEUE_CHECK(NULL != item->data, "memory for send queue data is not enough", -1);
+        memcpy(item->data, packet->data + SEND_QUEUE_HEAD_SIZE, packet->header_size);
+        memcpy(item->data + packet->header_size, packet->payload, packet->payload_size);
+        item->size = packet->size;
+    }
+    queue->count++;
+    queue->bytes += send_queue_item_size(item);
+    return 0;
+}
+
+int send_queue_push(send_queue_t *queue, const void *data, uint32_t size)
+{
+    if (0 == size) {
+        return 0;
+    }
+    send_queue_item_t *item = send_queue_append(queue, NULL, 0);
+    if (NULL == item) {
+        return -1;
+    }
+    item->data = (uint8_t *)malloc(size);
+    SEND_QUEUE_CHECK(NULL != item->data, "memory for send queue data is not enough", -1);
+    memcpy(item->data, data, size);
+    item->size = size;
+    queue->count++;
+    queue->bytes += size;
+    return 0;
+}
+
+/**
+ * Describe the unsent bytes of item in iov
+ *
+ * @return number of buffers used
+ */
+static int send_queue_item_iov(const send_queue_item_t *item, struct iovec *iov)
+{
+    struct iovec parts[SEND_QUEUE_ITEM_IOV];
+    int n = 0;
+    parts[n].iov_base = (void *)item->head;
+    parts[n++].iov_len = item->head_len;
+    if (item->packet) {
+        parts[n].iov_base = item->packet->data + SEND_QUEUE_HEAD_SIZE;
+        parts[n++].iov_len = item->packet->header_size;
+        parts[n].iov_base = (void *)item->packet->payload;
+        parts[n++].iov_len = item->packet->payload_size;
+    } else {
+        parts[n].iov_base = item->data;
+        parts[n++].iov_len = item->size;
+    }
+
+    uint32_t skip = item->offset;
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        if (skip >= parts[i].iov_len) {
+            skip -= parts[i].iov_len;
+            continue;
+        }
+        iov[count].iov_base = (uint8_t *)parts[i].iov_base + skip;
+        iov[count].iov_len = parts[i].iov_len - skip;
+        skip = 0;
+        count++;
+    }
+    return count;
+}
+
+int send_queue_flush(send_queue_t *queue)
+{
+    if (queue->error) {
+        return -1;
+    }
+    while (queue->count) {
+        // gather as many items as possible into one send
+        struct iovec iov[SEND_QUEUE_FLUSH_IOV];
+        int iovcnt = 0;
+        size_t len = 0;
+        for (uint32_t i = 0; i < queue->count && iovcnt + SEND_QUEUE_ITEM_IOV <= SEND_QUEUE_FLUSH_IOV; i++) {
+            const send_queue_item_t *item = &queue->items[(queue->first + i) % queue->capacity];
+            iovcnt += send_queue_item_iov(item, iov + iovcnt);
+            len += send_queue_item_size(item) - item->offset;
+        }
+
+        ssize_t res = socketsendv(queue->socket, iov, iovcnt);
+        if (-2 == res) {
+            ESP_LOGE(TAG, "socket send failed, errno=%d", errno);
+            return -1;
+        }
+        if (res <= 0) {
+            return queue->bytes; // socket buffer is full, resume on writable
+        }
+
+        queue->bytes -= res;
+        size_t sent = res;
+        while (sent) {
+            send_queue_item_t *item = &queue->items[queue->first];
+            uint32_t left = send_queue_item_size(item) - item->offset;
+            if (sent < left) {
+                item->offset += sent;
+                break;
+            }
+            sent -= left;
+            send_queue_pop(queue);
+        }
+        if ((size_t)res < len) {
+            return queue->bytes;
+        }
+    }
+    return 0;
+}
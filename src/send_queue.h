@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "platglue.h"
+#include "rtp.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SEND_QUEUE_HEAD_SIZE  (RTP_TCP_HEAD_SIZE + RTP_HEADER_SIZE)
+
+#define SEND_QUEUE_FLUSH_IOV  48 // buffers gathered by one send of send_queue_flush()
+
+/**
+ * One pending write: a small head private to this connection followed by a packet of a train or data
+ */
+typedef struct {
+    uint8_t head[SEND_QUEUE_HEAD_SIZE];   // e.g. interleaved prefix and RTP header of this subscriber
+    uint8_t head_len;
+    const rtp_packet_t *packet;           // payload header and payload sent after head, NULL if data is used
+    rtp_packet_train_t *train;            // owner of packet
+    uint8_t *data;                        // copy owned by the queue
+    uint32_t size;
+    uint32_t offset;                      // bytes of the item already sent
+} send_queue_item_t;
+
+/**
+ * Bounded output queue of a non-blocking TCP socket
+ */
+typedef struct send_queue_t {
+    SOCKET socket;
+    uint32_t capacity;                    // max items
+    uint32_t max_bytes;                   // max pending bytes
+    uint32_t first;                       // index of the oldest item
+    uint32_t count;                       // items in queue
+    uint32_t bytes;                       // pending bytes, i.e. depth of the queue
+    uint32_t dropped;                     // packets refused because the queue was full
+    bool error;                           // the stream is broken, see send_queue_abort()
+    send_queue_item_t *items;
+} send_queue_t;
+
+send_queue_t *send_queue_create(SOCKET s, uint32_t capacity, uint32_t max_bytes);
+
+void send_queue_delete(send_queue_t *queue);
+
+/**
+ * Check whether items with bytes in total can be queued.
+ * An empty queue accepts any bytes, so that a large frame still makes progress.
+ */
+bool send_queue_has_room(send_queue_t *queue, uint32_t items, uint32_t bytes);
+
+/**
+ * Queue a copy of data
+ *
+ * @return 0 on success, -1 queue is full or out of memory
+ */
+int send_queue_push(send_queue_t *queue, const void *data, uint32_t size);
+
+/**
+ * Queue head followed by the payload header and payload of packet, the packet stays referenced until sent
+ *
+ * @param train owner of packet, NULL to make the queue copy the packet
+ * @return 0 on success, -1 queue is full or out of memory
+ */
+int send_queue_push_packet(send_queue_t *queue, const uint8_t *head, uint32_t head_len,
+                           const rtp_packet_t *packet, rtp_packet_train_t *train);
+
+/**
+ * Drop everything queued after a failure which leaves the stream inconsistent,
+ * later flushes fail so that the connection gets closed
+ */
+void send_queue_abort(send_queue_t *queue);
+
+/**
+ * Write as much as the socket accepts, partially sent items are resumed next time
+ *
+ * @return pending bytes after writing, -1 on socket error
+ */
+int send_queue_flush(send_queue_t *queue);
+
+/**
+ * @return bytes waiting to be sent
+ */
+static inline uint32_t send_queue_depth(const send_queue_t *queue)
+{
+    return queue->bytes;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "udp_port_pool.h"
+
+static const char *TAG __attribute__((unused)) = "udp_port_pool";
+
+#define UDP_PORT_POOL_CHECK(a, str, ret_val)                       \
+    if (!(a))                                                     \
+    {                                                             \
+        ESP_LOGE(TAG, "%s(%d): %s", __FUNCTION__, __LINE__, str); \
+        return (ret_val);                                         \
+    }
+
+/**
+ * Bind the RTP and RTCP sockets of the pair at port
+ */
+static int udp_port_pool_bind(uint16_t port, UDPSOCKET *rtp_socket, UDPSOCKET *rtcp_socket)
+{
+    *rtp_socket = udpsocketcreate(port);
+    if (NULLSOCKET == *rtp_socket) {
+        return -1;
+    }
+    *rtcp_socket = udpsocketcreate(port + 1);
+    if (NULLSOCKET == *rtcp_socket) {
+        udpsocketclose(*rtp_socket);
+        *rtp_socket = NULLSOCKET;
+        return -1;
+    }
+    // a full socket buffer drops the datagram instead of stalling the media path
+    socketsetnonblocking(*rtp_socket);
+    socketsetnonblocking(*rtcp_socket);
+    return 0;
+}
+
+static inline void udp_port_pool_set_free(udp_port_pool_t *pool, uint32_t pair)
+{
+    pool->free_map[pair / 32] |= 1u << (pair % 32);
+    pool->free_count++;
+}
+
+udp_port_pool_t *udp_port_pool_create(uint16_t base, uint16_t pairs, bool prebind)
+{
+    UDP_PORT_POOL_CHECK(0 == (base & 1), "RTP port must be even", NULL);
+    UDP_PORT_POOL_CHECK(pairs > 0 && (uint32_t)base + 2 * pairs <= 0x10000, "invalid port range", NULL);
+    udp_port_pool_t *pool = (udp_port_pool_t *)calloc(1, sizeof(udp_port_pool_t));
+    UDP_PORT_POOL_CHECK(NULL != pool, "memory for udp port pool is not enough", NULL);
+
+    pool->base = base;
+    pool->pairs = pairs;
+    pool->words = (pairs + 31) / 32;
+    pool->free_map = (uint32_t *)calloc(pool->words, sizeof(uint32_t));
+    if (NULL == pool->free_map) {
+        free(pool);
+        ESP_LOGE(TAG, "memory for udp port map is not enough");
+        return NULL;
+    }
+    if (prebind) {
+        pool->sockets = (UDPSOCKET *)calloc(2 * pairs, sizeof(UDPSOCKET));
+        if (NULL == pool->sockets) {
+            udp_port_pool_delete(pool);
+            ESP_LOGE(TAG, "memory for udp sockets is not enough");
+            return NULL;
+        }
+    }
+
+    for (uint32_t i = 0; i < pairs; i++) {
+        // a pair which can't be bound in advance, e.g. used by another program, is left out
+        if (prebind && 0 != udp_port_pool_bind(base + 2 * i, &pool->sockets[2 * i], &pool->sockets[2 * i + 1])) {
+            ESP_LOGW(TAG, "port %u is not available", base + 2 * i);
+            continue;
+        }
+        udp_port_pool_set_free(pool, i);
+    }
+    ESP_LOGI(TAG, "%u of %u port pairs from %u are free", pool->free_count, pairs, base);
+    return pool;
+}
+
+void udp_port_pool_delete(udp_port_pool_t *pool)
+{
+    if (pool->sockets) {
+        for (uint32_t i = 0; i < 2 * (uint32_t)pool->pairs; i++) {
+            if (NULLSOCKET != pool->sockets[i]) {
+                udpsocketclose(pool->sockets[i]);
+            }
+        }
+        free(pool->sockets);
+    }
+    free(pool->free_map);
+    free(pool);
+}
+
+int udp_port_pool_alloc(udp_port_pool_t *pool, UDPSOCKET *rtp_socket, UDPSOCKET *rtcp_socket, uint16_t *port)
+{
+    // the word of the last allocation or release usually has a free bit, so the search is short
+    for (uint32_t n = 0; n < pool->words; n++) {
+        uint32_t w = (pool->hint + n) % pool->words;
+        uint32_t bits = pool->free_map[w];
+        while (bits) {
+            uint32_t pair = w * 32 + __builtin_ctz(bits);
+            bits &= bits - 1;
+            uint16_t p = pool->base + 2 * pair;
+            if (pool->sockets) {
+                *rtp_socket = pool->sockets[2 * pair];
+                *rtcp_socket = pool->sockets[2 * pair + 1];
+                pool->sockets[2 * pair] = NULLSOCKET;
+                pool->sockets[2 * pair + 1] = NULLSOCKET;
+            } else if (0 != udp_port_pool_bind(p, rtp_socket, rtcp_socket)) {
+                continue; // taken by someone else for now, it stays free for a later try
+            }
+            pool->free_map[w] &= ~(1u << (pair % 32));
+            pool->free_count--;
+            pool->hint = w;
+            *port = p;
+            return 0;
+        }
+    }
+    ESP_LOGE(TAG, "no free port pair for RTP and RTCP");
+    return -1;
+}
+
+void udp_port_pool_release(udp_port_pool_t *pool, uint16_t port, UDPSOCKET rtp_socket, UDPSOCKET rtcp_socket)
+{
+    uint32_t pair = (port - pool->base) / 2;
+    if (port < pool->base || pair >= pool->pairs) {
+        ESP_LOGE(TAG, "port %u is not in the pool", port);
+        return;
+    }
+    udpsocketclose(rtp_socket);
+    udpsocketclose(rtcp_socket);
+    // bound again right away, so that the next viewer gets unconnected sockets with nothing queued
+    if (pool->sockets && 0 != udp_port_pool_bind(port, &pool->sockets[2 * pair], &pool->sockets[2 * pair + 1])) {
+        ESP_LOGW(TAG, "port %u is lost for the pool", port);
+        return;
+    }
+    udp_port_pool_set_free(pool, pair);
+    pool->hint = pair / 32;
+}
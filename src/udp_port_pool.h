@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "platglue.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define UDP_PORT_POOL_BASE   6970    // default first RTP port of the pool
+
+/**
+ * Server UDP port pairs of RTP and RTCP, RTP on the even port and RTCP on the next one
+ */
+typedef struct udp_port_pool_t {
+    uint16_t base;                        // RTP port of pair 0
+    uint16_t pairs;                       // pair n uses ports base + 2 * n and base + 2 * n + 1
+    uint16_t free_count;
+    uint16_t hint;                        // word of free_map where the next search starts
+    uint32_t words;
+    uint32_t *free_map;                   // bit n is set while pair n is free
+    UDPSOCKET *sockets;                   // RTP and RTCP socket of each pair bound in advance, NULL if not
+} udp_port_pool_t;
+
+/**
+ * @param base even RTP port of the first pair
+ * @param pairs number of port pairs
+ * @param prebind bind the sockets of all pairs now, so that allocating makes no system call
+ */
+udp_port_pool_t *udp_port_pool_create(uint16_t base, uint16_t pairs, bool prebind);
+
+/**
+ * Close the sockets bound in advance, pairs still allocated must be released before
+ */
+void udp_port_pool_delete(udp_port_pool_t *pool);
+
+/**
+ * Take a free port pair with its bound sockets
+ *
+ * @param port set to the RTP port, RTCP uses port + 1
+ * @return 0 on success, -1 if no pair is free
+ */
+int udp_port_pool_alloc(udp_port_pool_t *pool, UDPSOCKET *rtp_socket, UDPSOCKET *rtcp_socket, uint16_t *port);
+
+/**
+ * Give back a pair taken by udp_port_pool_alloc(), its sockets are closed
+ */
+void udp_port_pool_release(udp_port_pool_t *pool, uint16_t port, UDPSOCKET rtp_socket, UDPSOCKET rtcp_socket);
+
+#ifdef __cplusplus
+}
+#endif